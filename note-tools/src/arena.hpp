@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+
+
+namespace ntx {
+
+// Forwards to upstream, counting what passes through
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : m_upstream{upstream}
+    { }
+
+    std::size_t m_n_allocations = 0;
+    std::size_t m_n_bytes = 0;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        ++m_n_allocations;
+        m_n_bytes += bytes;
+        return m_upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        m_upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource* m_upstream;
+};
+
+
+// Small allocations are bumped out of a monotonic buffer and never freed, large
+// ones (which are almost always growing vectors) go to upstream as normal so
+// that the buffers a vector outgrows are not left lying around.
+class MonotonicResource : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t s_max_small = 1 << 10;
+
+    explicit MonotonicResource(std::pmr::memory_resource* upstream)
+        : m_upstream{upstream}
+        , m_small{1 << 16, upstream}
+    { }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (bytes > s_max_small) {
+            return m_upstream->allocate(bytes, alignment);
+        }
+        return m_small.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        if (bytes > s_max_small) {
+            m_upstream->deallocate(p, bytes, alignment);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource* m_upstream;
+    std::pmr::monotonic_buffer_resource m_small;
+};
+
+
+// The memory for compiling a single file. The elements, blocks and ropes are all
+// allocated from here and given back in one go when the arena is destroyed.
+class Arena
+{
+public:
+    enum class Kind
+    {
+        // Never frees small allocations until the end
+        Monotonic,
+        // Straight to the heap, so blocks are freed as soon as they are written
+        Heap
+    };
+
+    // upstream is where the arena gets its memory from, and what it is all given
+    // back to
+    explicit Arena(Kind kind, std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : m_heap{upstream}
+        , m_requests{make_arena(kind)}
+    { }
+
+    Arena(const Arena&) = delete;
+    Arena& operator = (const Arena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &m_requests; }
+
+    // What the containers asked for, i.e. what would have gone to the heap
+    const CountingResource& requests() const { return m_requests; }
+    // What the arena asked the heap for
+    const CountingResource& heap() const { return m_heap; }
+
+private:
+    std::pmr::memory_resource* make_arena(Kind kind) {
+        if (kind == Kind::Monotonic) {
+            return &m_monotonic.emplace(&m_heap);
+        }
+        return &m_heap;
+    }
+
+    // Declared in the order they are layered on top of each other
+    CountingResource m_heap;
+    std::optional<MonotonicResource> m_monotonic;
+    CountingResource m_requests;
+};
+
+} // ntx
@@ -0,0 +1,156 @@
+// Compares ntx::classify_line against the std::regex patterns it replaced.
+//
+//     ntx_bench_classify [n_lines] [n_repeats]
+//
+// The lines are checked for identical classification before anything is timed.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "parsers.hpp"
+
+
+namespace patterns {
+
+static const std::regex tag{"^% TAG (.+)"};
+static const std::regex cmd{"^% CMD (.+) (.+)"};
+static const std::regex env_decl{"^[ ]*\\\\([A-z]+)[ ]*([^ ]*)"};
+static const std::regex section_def{"^[ ]*\\\\([A-z]+)[ ]*(.*)"};
+
+} // patterns
+
+
+ntx::LineClass classify_line_regex(const std::string& line, std::smatch& match) {
+    using ntx::LineKind;
+
+    if (std::regex_match(line, match, patterns::tag)) {
+        return {LineKind::Tag, {&*match[1].first, std::size_t(match[1].length())}};
+    }
+    if (std::regex_match(line, match, patterns::cmd)) {
+        return {
+            LineKind::Cmd,
+            {&*match[1].first, std::size_t(match[1].length())},
+            {&*match[2].first, std::size_t(match[2].length())}
+        };
+    }
+    if (std::regex_match(line, match, patterns::env_decl) ||
+        std::regex_match(line, match, patterns::section_def)) {
+        // The label can legitimately be empty so we cannot take &*first
+        auto label_pos = std::size_t(match[2].first - line.begin());
+        return {
+            LineKind::Declaration,
+            {&*match[1].first, std::size_t(match[1].length())},
+            std::string_view{line}.substr(label_pos, match[2].length())
+        };
+    }
+    return {LineKind::Text};
+}
+
+
+std::vector<std::string> make_lines(std::size_t n_lines) {
+    static const std::vector<std::string> fixed = {
+        "% TAG algebra",
+        "% TAG ",
+        "% TAG a\r",
+        "% CMD foo bar",
+        "% CMD foo bar baz",
+        "% CMD foo ",
+        "% CMD  x",
+        "% CMD a b\r",
+        "\\section Groups and rings",
+        "\\thm thm:main",
+        "    \\eq eq:one",
+        "    \\eq eq:one x\r",
+        "    \\proof",
+        "\\eq1abc",
+        "\\arr{ 1 2 3; }",
+        "\\_weird` ^x",
+        "\\ not a decl",
+        "\\",
+        "    Let G be a group and let x \\in G. Then x^2 = e.",
+        "",
+        "        ",
+    };
+    static const std::vector<std::string> words = {
+        "Let", "G", "be", "a", "group", "x", "\\in", "=", "e^{i\\pi}", "(x", "y)", "and",
+        "the", "proof", "follows;", "[[", "]]", "*", "\\cos(\\theta)", "+", "1"
+    };
+
+    std::mt19937 rng{42};
+    std::vector<std::string> lines = fixed;
+    while (lines.size() < n_lines) {
+        std::string line(4 * (rng() % 3), ' ');
+        switch (rng() % 8)
+        {
+        case 0:
+            line += "\\" + words[rng() % 5] + " " + words[rng() % words.size()];
+            break;
+        case 1:
+            line = "% TAG " + words[rng() % words.size()];
+            break;
+        default:
+            for (std::size_t n = 4 + rng() % 12; n > 0; --n) {
+                line += words[rng() % words.size()] + " ";
+            }
+        }
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+
+bool same(const ntx::LineClass& lhs, const ntx::LineClass& rhs) {
+    return lhs.m_kind == rhs.m_kind && lhs.m_first == rhs.m_first && lhs.m_second == rhs.m_second;
+}
+
+
+template <typename F>
+double time_ns_per_line(const std::vector<std::string>& lines, std::size_t n_repeats, F&& f) {
+    using clock = std::chrono::steady_clock;
+
+    std::size_t sink = 0;
+    auto start = clock::now();
+    for (std::size_t r = 0; r < n_repeats; ++r) {
+        for (const auto& line : lines) {
+            sink += static_cast<std::size_t>(f(line).m_kind);
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+    // Stop the optimiser from dropping the loop
+    if (sink == std::size_t(-1)) std::cout << "";
+    return elapsed / double(lines.size() * n_repeats);
+}
+
+
+int main(int argc, char** argv) {
+    std::size_t n_lines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    std::size_t n_repeats = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5;
+
+    const auto lines = make_lines(n_lines);
+
+    std::smatch match;
+    for (const auto& line : lines) {
+        auto expected = classify_line_regex(line, match);
+        auto actual = ntx::classify_line(line);
+        if (!same(expected, actual)) {
+            std::cout << "[FATAL] classify_line disagrees with the regexes on '" << line << "'" << std::endl;
+            return 2;
+        }
+    }
+
+    double regex_ns = time_ns_per_line(
+        lines, n_repeats, [&](const std::string& l) { return classify_line_regex(l, match); });
+    double classify_ns = time_ns_per_line(
+        lines, n_repeats, [](const std::string& l) { return ntx::classify_line(l); });
+
+    std::cout << "lines:          " << lines.size() << " x " << n_repeats << "\n"
+              << "regex:          " << regex_ns << " ns/line\n"
+              << "classify_line:  " << classify_ns << " ns/line\n"
+              << "speedup:        " << regex_ns / classify_ns << "x" << std::endl;
+}
@@ -0,0 +1,135 @@
+// Times each stage of compiling generated notes, from 1KB up to max_mb.
+//
+//     ntx_bench_compile [max_mb] [seed]
+//
+// For each size (growing 16 fold, so 1KB, 16KB, ... 1GB) it reports the time
+// and throughput of lexing the source, of converting the tokens to tex and of
+// compiling the source end to end, along with how many allocations each took per
+// MB of source and how many bytes they came to (relative to the source). Every
+// stage is repeated until it has run for a while and the fastest run is kept.
+// Then the most memory each structure held at once, relative to the source.
+//
+// The corpus is checked to compile before anything is timed.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "arena.hpp"
+#include "blox.hpp"
+#include "detextion.hpp"
+#include "ntx.hpp"
+
+#include "bench/corpus.hpp"
+
+
+struct Stage
+{
+    double m_seconds;
+    std::size_t m_n_allocations;
+    std::size_t m_n_bytes;
+};
+
+// Runs f (given the resource to allocate from) until at least min_seconds have
+// gone by, at least once, and keeps the fastest. The allocations are counted on
+// the first run.
+template <typename F>
+Stage time_stage(double min_seconds, F&& f) {
+    using clock = std::chrono::steady_clock;
+
+    Stage stage{1e30, 0, 0};
+    double total = 0;
+    for (bool first = true; first || total < min_seconds; first = false) {
+        ntx::CountingResource counter;
+
+        auto start = clock::now();
+        f(&counter);
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+        if (first) {
+            stage.m_n_allocations = counter.m_n_allocations;
+            stage.m_n_bytes = counter.m_n_bytes;
+        }
+        stage.m_seconds = std::min(stage.m_seconds, elapsed);
+        total += elapsed;
+    }
+    return stage;
+}
+
+void print_stage(std::string_view name, const Stage& stage, std::size_t n_source_bytes) {
+    const double mb = double(n_source_bytes) / (1 << 20);
+    std::cout << "  " << std::left << std::setw(10) << name << std::right << std::fixed
+              << std::setw(10) << std::setprecision(3) << stage.m_seconds * 1e3 << " ms"
+              << std::setw(10) << std::setprecision(1) << mb / stage.m_seconds << " MB/s"
+              << std::setw(12) << std::setprecision(0) << stage.m_n_allocations / mb << " allocs/MB"
+              << std::setw(8) << std::setprecision(2) << double(stage.m_n_bytes) / n_source_bytes << "x allocated"
+              << "\n";
+}
+
+void print_memory(const ntx::MemoryStats& memory, std::size_t n_source_bytes) {
+    std::cout << "  peak      " << std::fixed << std::setprecision(2);
+    for (std::size_t i = 0; i < ntx::s_n_structures; ++i) {
+        std::cout << " " << to_string(static_cast<ntx::Structure>(i)) << " "
+                  << double(memory.m_structures[i].m_peak_bytes) / n_source_bytes << "x";
+    }
+    std::cout << ", total " << double(memory.m_total.m_peak_bytes) / n_source_bytes << "x\n";
+}
+
+std::string format_size(std::size_t n_bytes) {
+    if (n_bytes >= (1 << 30)) return std::to_string(n_bytes >> 30) + "GB";
+    if (n_bytes >= (1 << 20)) return std::to_string(n_bytes >> 20) + "MB";
+    return std::to_string(n_bytes >> 10) + "KB";
+}
+
+
+int main(int argc, char** argv) {
+    std::size_t max_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    std::uint32_t seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 42;
+
+    // Small sizes are repeated for longer, relative to their run time, so that
+    // their timings are not noise
+    constexpr double min_seconds = 0.5;
+
+    for (std::size_t size = 1 << 10; size <= (max_mb << 20); size *= 16) {
+        const std::string source = ntx::bench::CorpusGenerator{seed}.make(size);
+
+        if (auto result = ntx::compile(source); !result) {
+            std::cout << "[FATAL] The generated corpus does not compile: " << *result.m_error << std::endl;
+            return 2;
+        }
+
+        std::cout << format_size(size) << " (" << source.size() << " bytes)\n";
+
+        const auto lex = time_stage(min_seconds, [&](std::pmr::memory_resource* resource) {
+            auto tokens = ntx::lex(source, ntx::s_environments, resource);
+        });
+        print_stage("lex", lex, source.size());
+
+        // Converting is timed from tokens lexed up front
+        ntx::Arena arena{ntx::Arena::Kind::Heap};
+        const auto tokens = ntx::lex(source, ntx::s_environments, arena.resource());
+        const auto convert = time_stage(min_seconds, [&](std::pmr::memory_resource* resource) {
+            auto tex = ntx::convert_to_tex(tokens, resource);
+        });
+        print_stage("convert", convert, source.size());
+
+        const auto compile = time_stage(min_seconds, [&](std::pmr::memory_resource* resource) {
+            ntx::CompileSettings settings;
+            settings.m_upstream = resource;
+            auto result = ntx::compile(source, settings);
+        });
+        print_stage("compile", compile, source.size());
+
+        ntx::CompileStats stats;
+        stats.m_memory.emplace();
+        ntx::CompileSettings settings;
+        settings.m_stats = &stats;
+        ntx::compile(source, settings);
+        print_memory(*stats.m_memory, source.size());
+        std::cout << std::flush;
+    }
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+
+
+namespace ntx::bench {
+
+// Generates ntx that looks like real notes and always compiles: sections of
+// prose with inline maths, theorems and proofs holding equations (some with
+// \arr{ arrays) and lists of * and [[label]] items. The same seed always gives
+// the same text, so timings of different builds are of the same input.
+class CorpusGenerator
+{
+public:
+    explicit CorpusGenerator(std::uint32_t seed = 42) : m_rng{seed} {}
+
+    // At least n_bytes of ntx, ending at the end of a section
+    std::string make(std::size_t n_bytes) {
+        std::string text;
+        text.reserve(n_bytes + (1 << 12));
+        while (text.size() < n_bytes) {
+            section(text);
+        }
+        return text;
+    }
+
+private:
+    std::size_t roll(std::size_t n) { return m_rng() % n; }
+
+    template <std::size_t N>
+    std::string_view pick(const std::string_view (&words)[N]) {
+        return words[roll(N)];
+    }
+
+    void indent(std::string& text, std::size_t depth) {
+        text.append(4 * depth, ' ');
+    }
+
+    // Words of prose with some maths mixed in, ending in a full stop unless it is
+    // a title. The maths never starts a line (a line starting with '=' carries on
+    // the last).
+    void sentence(std::string& text, std::size_t n_words, bool heavy_maths, bool is_title = false) {
+        static constexpr std::string_view prose[] = {
+            "Let", "the", "group", "be", "and", "so", "we", "have", "that", "a",
+            "map", "is", "injective", "Then", "for", "every", "element", "it",
+            "follows", "which", "proves", "claim", "Suppose", "ring", "field",
+            "module", "over", "where", "is", "prime", "of", "order", "there",
+            "exists", "unique", "morphism", "Hence", "This", "shows", "by"
+        };
+        static constexpr std::string_view maths[] = {
+            "x^2", "a_{i}", "G", "H", "x \\in G", "f(x) = y", "(x y)^{-1}",
+            "\\alpha + \\beta", "e^{i\\theta}", "Z_p", "a + b", "x*y/z",
+            "\\cos(\\theta)", "\\sum_{i=1}^{n} a_i", "[a, b]", "\\{x, y\\}",
+            "g \\circ f", "n!", "2^{n}", "\\phi: G \\to H", "|G| = p^k", "12", "3.5"
+        };
+
+        for (std::size_t i = 0; i < n_words; ++i) {
+            if (i > 0) {
+                text += ' ';
+            }
+            text += i > 0 && roll(heavy_maths ? 2 : 5) == 0 ? pick(maths) : pick(prose);
+        }
+        if (!is_title) {
+            text += ".";
+        }
+    }
+
+    void paragraph(std::string& text, std::size_t depth, std::size_t n_lines = 0) {
+        const bool heavy_maths = roll(4) == 0;
+        for (std::size_t n = n_lines ? n_lines : 1 + roll(4); n > 0; --n) {
+            indent(text, depth);
+            sentence(text, 4 + roll(16), heavy_maths);
+            text += '\n';
+        }
+    }
+
+    void equation(std::string& text, std::size_t depth) {
+        static constexpr std::string_view lines[] = {
+            "a^p = \\arr{ 1 2 3; 4 5 6; } + b_{i}",
+            "\\cos(\\theta) + i\\sin(\\theta) = e^{i\\theta}",
+            "M = \\arr{ a b; c d; }",
+            "\\int_0^1 f(x) dx = F(1) - F(0)",
+            "(a + b)^2 = a^2 + 2ab + b^2",
+            "\\sum_{k=0}^{n} \\binom{n}{k} = 2^n"
+        };
+
+        indent(text, depth);
+        text += roll(2) ? "\\eq" : "\\eq eq:" + std::to_string(m_n_labels++);
+        text += '\n';
+        for (std::size_t n = 1 + roll(2); n > 0; --n) {
+            indent(text, depth + 1);
+            text += pick(lines);
+            text += '\n';
+        }
+    }
+
+    void list(std::string& text, std::size_t depth) {
+        const bool labelled = roll(2);
+        for (std::size_t n = 2 + roll(3); n > 0; --n) {
+            indent(text, depth);
+            if (labelled) {
+                text += "[[ (";
+                text += static_cast<char>('a' + n % 26);
+                text += ") ]] ";
+            }
+            else {
+                text += "* ";
+            }
+            sentence(text, 2 + roll(6), false);
+            text += '\n';
+        }
+    }
+
+    // A theorem (or similar) or a proof, which may hold another one
+    void block(std::string& text, std::size_t depth) {
+        static constexpr std::string_view environments[] = {
+            "\\thm", "\\lemma", "\\prop", "\\corollary", "\\proof"
+        };
+
+        indent(text, depth);
+        const auto environment = pick(environments);
+        text += environment;
+        if (environment != "\\proof" && roll(2)) {
+            text += " thm:" + std::to_string(m_n_labels++);
+        }
+        text += '\n';
+
+        paragraph(text, depth + 1);
+        for (std::size_t n = roll(4); n > 0; --n) {
+            switch (roll(depth < 2 ? 4 : 3))
+            {
+            case 0: equation(text, depth + 1); break;
+            case 1:
+                // Introduced by a line of its own, or it would carry on whatever
+                // is above it
+                paragraph(text, depth + 1, 1);
+                list(text, depth + 2);
+                break;
+            case 2: paragraph(text, depth + 1); break;
+            case 3: block(text, depth + 1); break;
+            }
+        }
+    }
+
+    void section(std::string& text) {
+        text += roll(3) ? "\\subsection " : "\\section ";
+        sentence(text, 1 + roll(4), false, true);
+        text += '\n';
+
+        for (std::size_t n = 1 + roll(6); n > 0; --n) {
+            switch (roll(3))
+            {
+            case 0: paragraph(text, 0); break;
+            case 1: block(text, 0); break;
+            case 2: equation(text, 0); break;
+            }
+        }
+        text += '\n';
+    }
+
+    std::mt19937 m_rng;
+    std::size_t m_n_labels = 0;
+};
+
+} // ntx::bench
@@ -0,0 +1,108 @@
+// Times editing generated notes in place, as an editor would on each keystroke.
+//
+//     ntx_bench_incremental [n_lines=20000] [checkpoint_lines] [seed]
+//
+// Types n_keys letters, each at a random word of the source, and then deletes
+// them again, reporting the time an edit takes (to bring the tex up to date) and
+// how much of the source it converted again, against compiling all of it. The tex
+// is checked against compile at the end.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "incremental.hpp"
+#include "ntx.hpp"
+
+#include "bench/corpus.hpp"
+
+
+int main(int argc, char** argv) {
+    using clock = std::chrono::steady_clock;
+
+    std::size_t n_lines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+    std::size_t checkpoint_lines = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : ntx::s_checkpoint_lines;
+    std::uint32_t seed = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 42;
+
+    constexpr std::size_t n_keys = 2000;
+
+    // Grown until it has the lines asked for
+    std::string source;
+    for (std::size_t n_bytes = 1 << 16; std::count(source.begin(), source.end(), '\n') < std::ptrdiff_t(n_lines); n_bytes *= 2) {
+        source = ntx::bench::CorpusGenerator{seed}.make(n_bytes);
+    }
+
+    auto start = clock::now();
+    ntx::IncrementalCompile incremental{source, checkpoint_lines};
+    const double first_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    if (incremental.error()) {
+        std::cout << "[FATAL] The generated corpus does not compile: " << *incremental.error() << std::endl;
+        return 2;
+    }
+
+    start = clock::now();
+    ntx::compile(source);
+    const double compile_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+    std::cout << std::count(source.begin(), source.end(), '\n') << " lines (" << source.size() << " bytes), "
+              << incremental.n_checkpoints() << " checkpoints\n"
+              << std::fixed << std::setprecision(3)
+              << "  compile      " << compile_ms << " ms\n"
+              << "  first        " << first_ms << " ms\n";
+
+    // A letter after a letter of a word that is not a command, which leaves the
+    // notes compiling
+    auto in_word_f = [](std::string_view text, std::size_t pos) {
+        if (!pos || !std::isalpha(text[pos]) || !std::isalpha(text[pos - 1])) {
+            return false;
+        }
+        std::size_t word_begin = pos - 1;
+        while (word_begin && std::isalpha(text[word_begin - 1])) {
+            --word_begin;
+        }
+        return !word_begin || text[word_begin - 1] != '\\';
+    };
+    std::mt19937 rng{seed};
+    std::vector<double> times;
+    std::size_t n_converted = 0;
+    std::vector<std::size_t> typed;
+    auto edit_f = [&](std::size_t begin, std::size_t end, std::string_view text) {
+        auto edit_start = clock::now();
+        incremental.edit(begin, end, text);
+        times.push_back(std::chrono::duration<double, std::micro>(clock::now() - edit_start).count());
+        n_converted += incremental.n_converted_bytes();
+    };
+    for (std::size_t n = 0; n < n_keys; ++n) {
+        const auto& text = incremental.source();
+        std::size_t pos = rng() % text.size();
+        while (pos < text.size() && !in_word_f(text, pos)) {
+            ++pos;
+        }
+        if (pos == text.size()) {
+            continue;
+        }
+        edit_f(pos, pos, "q");
+        typed.push_back(pos);
+    }
+    // Deleted newest first, so that each is where it was typed
+    for (auto it = typed.rbegin(); it != typed.rend(); ++it) {
+        edit_f(*it, *it + 1, "");
+    }
+
+    std::sort(times.begin(), times.end());
+    auto at_f = [&](double q) { return times[std::min(times.size() - 1, std::size_t(q * times.size()))]; };
+    std::cout << "  edit         p50 " << at_f(0.5) << " us, p99 " << at_f(0.99) << " us, max " << times.back() << " us\n"
+              << "  converted    " << n_converted / times.size() << " bytes an edit\n";
+
+    if (incremental.source() != source || incremental.tex() != ntx::compile(source).m_tex) {
+        std::cout << "[FATAL] The tex after editing is not that of compile" << std::endl;
+        return 2;
+    }
+}
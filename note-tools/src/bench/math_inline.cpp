@@ -0,0 +1,149 @@
+// Compares ntx::get_math_start against the heuristics it replaced, which searched
+// each word again for brackets, maths and operator characters.
+//
+//     ntx_bench_math_inline [n_lines] [n_repeats]
+//
+// The words are those of generated notes and of random lines of the characters
+// the heuristics look at, lexed as the compiler would. Every word is checked to
+// be decided the same way before anything is timed.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "detextion.hpp"
+#include "math_inline.hpp"
+
+#include "bench/corpus.hpp"
+
+
+// The original start_math_inline, with the word before it left to the caller
+ntx::MathStart get_math_start_scanning(const ntx::Element& element) {
+    using ntx::MathStart;
+
+    const auto& s = element.m_data;
+    switch (s.length())
+    {
+    case 0:
+        return MathStart::None;
+    case 1:
+        {
+            char c = s[0];
+            if (element.n_numerals) return MathStart::None;
+            if (element.n_lower_case) return c == 'a' ? MathStart::None : MathStart::Start;
+            if (element.n_upper_case) return c == 'I' ? MathStart::None : MathStart::Start;
+            if (c =='[' || c == '{') return MathStart::Start;
+            if (c == '=' || c == '-' || c == '+' || c =='/' || c =='*' || c == '^' || c == '_' ||
+                c == '<' || c == '>') {
+                return MathStart::TakeOne;
+            }
+            return MathStart::None;
+        }
+    case 2:
+        {
+            if (element.n_lower_case == 0) {
+                return MathStart::Start;
+            }
+            else if (element.n_lower_case == 1) {
+                if (element.n_upper_case) return s[0] > s[1] ? MathStart::Start : MathStart::None;
+                return MathStart::Start;
+            }
+            return MathStart::None;
+        }
+    default:
+        {
+            if (s.find_first_of("}])") != std::string_view::npos) {
+                return MathStart::None;
+            }
+            if (s.find_first_of("\\[{^_") != std::string_view::npos) {
+                return MathStart::Start;
+            }
+            if (((element.n_upper_case + element.n_lower_case) == 1) &&
+                s.find_first_of("+-/*") != std::string_view::npos) {
+                return MathStart::Start;
+            }
+        }
+    }
+    return MathStart::None;
+}
+
+
+// Lines of words of the characters the heuristics look at, one to six long, as
+// well as some letters, numerals and a byte outside ascii
+std::string make_lines(std::size_t n_lines) {
+    static constexpr std::string_view chars = "aIxyAZ09\\[]{}()^_+-/*=<>;,.:!|'\xc3";
+
+    std::mt19937 rng{42};
+    std::string text;
+    for (std::size_t line = 0; line < n_lines; ++line) {
+        for (std::size_t n_words = 1 + rng() % 8; n_words > 0; --n_words) {
+            for (std::size_t n = 1 + rng() % 6; n > 0; --n) {
+                text += chars[rng() % chars.size()];
+            }
+            text += ' ';
+        }
+        text += '\n';
+    }
+    return text;
+}
+
+
+template <typename F>
+double time_ns_per_word(const std::vector<ntx::Element>& words, std::size_t n_repeats, F&& f) {
+    using clock = std::chrono::steady_clock;
+
+    std::size_t sink = 0;
+    auto start = clock::now();
+    for (std::size_t r = 0; r < n_repeats; ++r) {
+        for (const auto& word : words) {
+            sink += static_cast<std::size_t>(f(word));
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+    // Stop the optimiser from dropping the loop
+    if (sink == std::size_t(-1)) std::cout << "";
+    return elapsed / double(words.size() * n_repeats);
+}
+
+
+int main(int argc, char** argv) {
+    std::size_t n_lines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    std::size_t n_repeats = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5;
+
+    // Neither is compiled, only lexed, so a random line need not make sense
+    const std::string notes = ntx::bench::CorpusGenerator{}.make(64 * n_lines);
+    const std::string lines = make_lines(n_lines);
+
+    std::pmr::monotonic_buffer_resource resource;
+    std::vector<ntx::Element> words;
+    std::vector<ntx::Tokens> tokens;
+    for (const std::string_view text : {std::string_view{notes}, std::string_view{lines}}) {
+        const auto& lexed = tokens.emplace_back(ntx::lex(text, ntx::s_environments, &resource));
+        for (std::size_t pos = 0; pos < lexed.size(); ++pos) {
+            if (lexed.kind(pos) == ntx::TokenKind::Element) {
+                words.push_back(lexed.element(pos));
+            }
+        }
+    }
+
+    for (const auto& word : words) {
+        if (get_math_start_scanning(word) != ntx::get_math_start(word)) {
+            std::cout << "[FATAL] get_math_start disagrees with the heuristics on '" << word.m_data << "'" << std::endl;
+            return 2;
+        }
+    }
+
+    double scanning_ns = time_ns_per_word(words, n_repeats, get_math_start_scanning);
+    double table_ns = time_ns_per_word(words, n_repeats, ntx::get_math_start);
+
+    std::cout << "words:           " << words.size() << " x " << n_repeats << "\n"
+              << "scanning:        " << scanning_ns << " ns/word\n"
+              << "get_math_start:  " << table_ns << " ns/word\n"
+              << "speedup:         " << scanning_ns / table_ns << "x" << std::endl;
+}
@@ -0,0 +1,195 @@
+// Compares ntx::WordScanner against the character at a time loop it replaced.
+//
+//     ntx_bench_scan [n_lines] [n_repeats]
+//
+// The words and their character counts are checked to be identical before
+// anything is timed. Throughput is reported in MB/s of source, the best of
+// n_repeats passes over the lines.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "scan.hpp"
+
+
+struct Word
+{
+    std::string_view m_data;
+    ntx::CharCounts m_char_counts;
+
+    bool operator == (const Word& other) const {
+        return m_data.data() == other.m_data.data() &&
+            m_data.size() == other.m_data.size() &&
+            m_char_counts.n_lower_case == other.m_char_counts.n_lower_case &&
+            m_char_counts.n_upper_case == other.m_char_counts.n_upper_case &&
+            m_char_counts.n_numerals == other.m_char_counts.n_numerals;
+    }
+};
+
+
+// The original loop from the lexer
+template <typename F>
+void split_scalar(std::string_view line, std::size_t pos, F&& f) {
+    auto element_f = [&](std::size_t start, std::size_t end) {
+        if (start >= end) return;
+        auto data = line.substr(start, end - start);
+        ntx::CharCounts char_counts{0, 0, 0};
+        for (char c : data) {
+            if (c >= 'a' && c <= 'z') ++char_counts.n_lower_case;
+            if (c >= 'A' && c <= 'Z') ++char_counts.n_upper_case;
+            if (c >= '0' && c <= '9') ++char_counts.n_numerals;
+        }
+        f(data, char_counts);
+    };
+
+    std::size_t w_begin = pos;
+    for (; pos < line.size(); ++pos) {
+        switch (line[pos])
+        {
+        case ' ':
+            element_f(w_begin, pos);
+            w_begin = pos + 1;
+            break;
+        case '{':
+        case ';':
+            element_f(w_begin, pos + 1);
+            w_begin = pos + 1;
+            break;
+        case '}': case '[': case ']': case '(': case ')': case '+': case '*': case '/':
+            element_f(w_begin, pos);
+            element_f(pos, pos + 1);
+            w_begin = pos + 1;
+            break;
+        default:
+            break;
+        }
+    }
+    element_f(w_begin, line.size());
+}
+
+
+std::vector<std::string> make_lines(std::size_t n_lines) {
+    static const std::vector<std::string> fixed = {
+        "",
+        " ",
+        "{",
+        "a{b}c",
+        ";;;;",
+        "    Let G be a group and let x \\in G. Then x^2 = e.",
+        std::string(63, 'a') + "{" + std::string(70, 'Z') + " 0123",
+        std::string(64, ' ') + "x",
+        std::string(200, '9'),
+        "\x80\xff\x7f z\xc3\xa9 A",
+    };
+    static const std::vector<std::string> words = {
+        "Let", "G", "be", "a", "group", "x", "\\in", "=", "e^{i\\pi}", "(x", "y)", "and",
+        "the", "proof", "follows;", "[[", "]]", "*", "\\cos(\\theta)", "+", "1", "2019",
+        "a/b", "\\arr{", "1;", "}", "Theorem", "isomorphic", "f(x_1,", "x_2)"
+    };
+
+    std::mt19937 rng{42};
+    std::vector<std::string> lines = fixed;
+    while (lines.size() < n_lines) {
+        std::string line(4 * (rng() % 3), ' ');
+        for (std::size_t n = 2 + rng() % 24; n > 0; --n) {
+            line += words[rng() % words.size()] + " ";
+        }
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+
+// f is called with each word and its character counts. Only a checksum is kept
+// so that the time is that of splitting rather than of storing the words.
+template <typename F>
+double time_mb_per_s(const std::vector<std::string_view>& lines, F&& f) {
+    using clock = std::chrono::steady_clock;
+
+    std::size_t n_bytes = 0;
+    for (const auto& line : lines) n_bytes += line.size() + 1;
+
+    std::size_t sink = 0;
+    auto sink_f = [&](std::string_view word, const ntx::CharCounts& c) {
+        sink += word.size() + c.n_lower_case + c.n_upper_case + c.n_numerals;
+    };
+
+    auto start = clock::now();
+    for (const auto& line : lines) {
+        f(line, sink_f);
+    }
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    // Stop the optimiser from dropping the loop
+    if (sink == std::size_t(-1)) std::cout << "";
+    return double(n_bytes) / elapsed / 1e6;
+}
+
+
+int main(int argc, char** argv) {
+    std::size_t n_lines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    std::size_t n_repeats = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5;
+
+    // The scanner is given the whole text and then its lines, as the lexer does
+    std::string text;
+    for (const auto& line : make_lines(n_lines)) {
+        text += line;
+        text += '\n';
+    }
+    text.pop_back();
+
+    std::vector<std::string_view> lines;
+    for (std::size_t begin = 0; begin <= text.size();) {
+        const std::size_t end = std::min(text.find('\n', begin), text.size());
+        lines.push_back(std::string_view{text}.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    ntx::WordScanner scanner{text};
+    std::vector<Word> expected, actual;
+    for (const auto& line : lines) {
+        for (std::size_t pos : {std::size_t{0}, line.find_first_not_of(' ')}) {
+            if (pos == std::string::npos) continue;
+            expected.clear();
+            actual.clear();
+            auto push_f = [](std::vector<Word>& words) {
+                return [&](std::string_view w, const ntx::CharCounts& c) { words.push_back({w, c}); };
+            };
+            split_scalar(line, pos, push_f(expected));
+            scanner.split(line, pos, push_f(actual));
+            if (expected != actual) {
+                std::cout << "[FATAL] WordScanner disagrees with the scalar loop on '" << line << "'" << std::endl;
+                return 2;
+            }
+        }
+    }
+
+    // The best of n_repeats passes each, taken in turn so that both see the same
+    // noise from the rest of the machine
+    double scalar_mb = 0, simd_mb = 0;
+    for (std::size_t r = 0; r < n_repeats; ++r) {
+        scalar_mb = std::max(scalar_mb, time_mb_per_s(
+            lines, [](std::string_view l, auto& f) { split_scalar(l, 0, f); }));
+        simd_mb = std::max(simd_mb, time_mb_per_s(
+            lines, [&](std::string_view l, auto& f) { scanner.split(l, 0, f); }));
+    }
+
+#if defined(__AVX2__)
+    const char* isa = "avx2";
+#elif defined(__SSE2__)
+    const char* isa = "sse2";
+#else
+    const char* isa = "scalar";
+#endif
+
+    std::cout << "lines:          " << lines.size() << " x " << n_repeats << "\n"
+              << "scalar:         " << scalar_mb << " MB/s\n"
+              << "WordScanner:    " << simd_mb << " MB/s (" << isa << ")\n"
+              << "speedup:        " << simd_mb / scalar_mb << "x" << std::endl;
+}
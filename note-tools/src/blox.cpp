@@ -0,0 +1,922 @@
+#include "blox.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+
+#include "exception.hpp"
+#include "math_inline.hpp"
+
+
+namespace ntx {
+
+Block make_block(
+    std::pmr::memory_resource* resource,
+    EnvironmentType type,
+    std::size_t indent,
+    const Tokens& tokens,
+    std::size_t initial,
+    BlockElement name,
+    std::string_view label,
+    const Environment* environment = nullptr) {
+    return Block{
+        type,
+        indent,
+        tokens.line_number(initial),
+        tokens.brackets(initial).m_round,
+        std::move(name),
+        label,
+        std::pmr::vector<BlockElement>{resource},
+        environment
+    };
+}
+
+template <typename S, typename T, typename... Ts>
+bool starts_with_any_of(const S& s, T t, Ts... ts) {
+    if constexpr (sizeof...(Ts) > 0) {
+        return s.starts_with(t) || starts_with_any_of(s, ts...);
+    }
+    else {
+        return s.starts_with(t);
+    }
+}
+
+
+template <typename S, typename T, typename... Ts>
+bool ends_with_any_of(const S& s, T t, Ts... ts) {
+    if constexpr (sizeof...(Ts) > 0) {
+        return s.ends_with(t) || ends_with_any_of(s, ts...);
+    }
+    else {
+        return s.ends_with(t);
+    }
+}
+
+
+bool needs_space(char w_front, char w_back, char n_front) {
+    auto is_any_of_f = [](char c, std::string_view cs) {
+        return c && cs.find(c) != std::string_view::npos;
+    };
+
+    if (is_any_of_f(w_back, "{[(\"'\n") ||
+        is_any_of_f(n_front, "}]).,;:\"'") ||
+        (w_front == '\\' && is_any_of_f(n_front, "{[("))){
+        return false;
+    }
+
+    return true;
+}
+
+bool needs_space(
+    const BlockElement& word,
+    const BlockElement* next) {
+    if (!next) {
+        // last element just return it
+        return false;
+    }
+
+    // Ropes have to be walked to find their ends so we only do so once
+    return needs_space(
+        word.empty() ? '\0' : word.front(),
+        word.empty() ? '\0' : word.back(),
+        next->empty() ? '\0' : next->front());
+}
+
+// Moves the output of the block into out: the block itself followed by any
+// elements that trail it (terminal new lines and punctuation)
+void amalgamate_block(
+    Block& block,
+    std::pmr::vector<BlockElement>& out,
+    std::pmr::memory_resource* resource) {
+    auto amalgamate = Rope::make(resource);
+    std::size_t n_new_lines = 0;
+
+    // Common views
+    auto clean_view_f = [&](auto& data_raw, std::size_t n_data) {
+            // Drop all terminal new lines (we will add them back)
+            for (auto it = data_raw.rbegin(); it != data_raw.rend() && it->is("\n"); ++it) {
+                --n_data;
+            }
+
+            for (std::size_t pos = 0; pos < n_data; ++pos) {
+                bool space = needs_space(
+                    data_raw[pos],
+                    pos + 1 < n_data ? &data_raw[pos + 1] : nullptr);
+                amalgamate->append(std::move(data_raw[pos]));
+                if (space) {
+                    amalgamate->append(" ");
+                }
+            }
+
+            n_new_lines += data_raw.size() - n_data;
+    };
+    
+    auto& data = block.m_data;
+    std::optional<std::string_view> punctuation;
+    // What the last trailing new line becomes
+    std::string_view last_new_line = "\n";
+
+    switch (block.m_type)
+    {
+    case EnvironmentType::PlainText:
+        {
+            const auto* environment = block.m_environment;
+            if (environment) {
+                amalgamate->append(environment->m_begin);
+                if (block.m_label.length()) {
+                    amalgamate->append("\\label{");
+                    amalgamate->append(block.m_label);
+                    amalgamate->append("}\n");
+                }
+            }
+
+            clean_view_f(data, data.size());
+
+            if (environment) {
+                amalgamate->append(environment->m_end);
+            }
+            break;
+        }
+    case EnvironmentType::MathBlock:
+        {
+            const auto& environment = *block.m_environment;
+            bool has_label = block.m_label.length();
+            amalgamate->append(has_label ? environment.m_begin : environment.m_begin_unnumbered);
+            if (has_label) {
+                amalgamate->append("\\label{");
+                amalgamate->append(block.m_label);
+                amalgamate->append("}\n");
+            }
+
+            clean_view_f(data, data.size());
+
+            amalgamate->append(has_label ? environment.m_end : environment.m_end_unnumbered);
+            break;
+        }
+    case EnvironmentType::MathInline:
+        {
+            amalgamate->append("$");
+            assert (!data.empty());
+            if (const auto& last = data.back(); ends_with_any_of(last, ';', ',', '.', ':')) {
+                // The last element is always a word of the source
+                assert(!last.m_rope);
+                const auto s = last.m_data;
+                clean_view_f(data, data.size() - 1);
+                amalgamate->append(s.substr(0, s.length() - 1));
+                amalgamate->append("$");
+                punctuation = s.substr(s.length() - 1);
+            }
+            else {
+                clean_view_f(data, data.size());
+                amalgamate->append("$");
+            }
+            break;
+        }
+    case EnvironmentType::Array:
+        {
+            // Only ever holds words of the source
+            std::size_t max_row_length = 0;
+            std::size_t current_row_length = 0;
+            
+            for (const auto& e : block.m_data) {
+                if (e.m_data.ends_with(';')) {
+                    max_row_length = std::max(max_row_length, current_row_length + (e.m_data.length() > 1));
+                    current_row_length = 0;
+                }
+                else {
+                    ++current_row_length;
+                }
+            }
+
+            max_row_length = std::max(max_row_length, current_row_length);
+            current_row_length = 0;
+
+            static constexpr std::string_view s_columns = "cccccccccccccccccccccccccccccccc";
+
+            amalgamate->append("\\left\\( \\begin{array}{");
+            for (std::size_t n = max_row_length; n > 0;) {
+                auto n_columns = std::min(n, s_columns.length());
+                amalgamate->append(s_columns.substr(0, n_columns));
+                n -= n_columns;
+            }
+            amalgamate->append("} ");
+            for (const auto& e : block.m_data) {
+                if (e.m_data.ends_with(';')) {
+                    if (auto n_e = e.m_data.length(); n_e > 1) {
+                        amalgamate->append(e.m_data.substr(0, n_e - 1));
+                        amalgamate->append(" ");
+                    }
+                    amalgamate->append("// ");
+                    current_row_length = 0;
+                }
+                else {
+                    amalgamate->append(e.m_data);
+                    amalgamate->append(++current_row_length < max_row_length ? " & " : " ");
+                }
+            }
+            amalgamate->append("\\end{array} \\right\\)");
+            break;
+        }
+    case EnvironmentType::ListItem:
+        {
+            if (block.m_label == "first") {
+                amalgamate->append("\n\\begin{enumerate}");
+            }
+            amalgamate->append("\n");
+            amalgamate->append(std::move(block.m_name));
+            amalgamate->append(" ");
+            clean_view_f(data, data.size());
+            if (block.m_label == "first") {
+                // This ends up after any terminal new lines
+                if (n_new_lines) {
+                    last_new_line = "\n\n\\end{enumerate}";
+                }
+                else {
+                    amalgamate->append("\n\\end{enumerate}");
+                }
+            }
+            break;
+        }
+    default:
+        // Section
+        assert(false);
+    }
+
+    out.emplace_back(std::move(amalgamate));
+    if (punctuation) {
+        out.emplace_back(*punctuation);
+    }
+    for (; n_new_lines > 0; --n_new_lines) {
+        out.emplace_back(n_new_lines > 1 ? "\n" : last_new_line);
+    }
+}
+
+void push_last_block(History& history) {
+    if (history.m_check_only) {
+        history.pop_back();
+        return;
+    }
+
+    Span span{history.m_trace, "push_last_block", phase_time(history.m_stats, Phase::Amalgamate)};
+    PhaseScope phase{history.m_stats, Phase::Amalgamate};
+
+    // FIXME - check that all brackets are closed...
+    auto& block = history.back();
+    auto& parent = history.m_blocks[history.size() - 2];
+    amalgamate_block(block, parent.m_data, history.m_amalgamate_resource);
+    history.pop_back();
+}
+
+using item_label_t = std::tuple<BlockElement, std::size_t /* end of label */>;
+
+std::optional<item_label_t> try_get_item_label(
+    std::pmr::memory_resource* resource,
+    std::size_t pos,
+    const Tokens& tokens) {
+    if (pos == 0 || !is_line_break(tokens.kind(pos - 1))) {
+        return std::nullopt;
+    }
+
+    //    * ...
+    if (tokens.kind(pos) == TokenKind::Element && tokens.text(pos) == "*") {
+        return item_label_t{std::string_view{"\\item"}, pos + 1};
+    }
+
+    // [[ {some labelling} ]] ...
+    {
+        std::size_t stage = 0;
+        bool matched = false;
+        std::size_t label_end = 0;
+        std::size_t offset = 0;
+        for (; pos + offset < tokens.size(); ++offset) {
+            if (tokens.kind(pos + offset) != TokenKind::Element) {
+                goto escape_loop;
+            }
+            const auto s = tokens.text(pos + offset);
+            switch (stage)
+            {
+            case 0:
+            case 1:
+                {
+                    if (s == "[") { ++stage; }
+                    else { goto escape_loop; }
+                    break;
+                }
+            case 2:
+                if (s == "]") { ++stage; label_end = pos + offset; }
+                break;
+            case 3:
+                {
+                    if (s == "]") { matched = true; }
+                    else { goto escape_loop; }
+                    break;
+                }
+            }
+        }
+        escape_loop:
+        if (matched) {
+            // FIXME - what if the label needs to be in mathmode...
+            auto label = Rope::make(resource);
+            label->append("\\item[");
+            for (std::size_t label_pos = pos + 2; label_pos < label_end; ++label_pos) {
+                if (label_pos > pos + 2) {
+                    label->append(" ");
+                }
+                label->append(tokens.text(label_pos));
+            }
+            label->append("]");
+            return item_label_t{std::move(label), pos + offset + 1};
+        }
+    }
+
+    return std::nullopt;
+}
+
+
+bool cannot_take(const BlockElement& e) {
+    return e.contains_any_of("}])");
+}
+
+
+std::size_t take_at_least_one(const std::pmr::vector<BlockElement>& history) {
+    using namespace std;
+
+    size_t n_history = history.size();
+    if (!n_history || cannot_take(history[n_history - 1])) return 0;
+
+    // TODO - do I ever need to take more?
+    return 1;
+}
+
+
+std::optional<std::size_t> start_math_inline(
+    const Element& element,
+    const std::pmr::vector<BlockElement>& history) {
+    switch (get_math_start(element))
+    {
+    case MathStart::Start:
+        return 0;
+    case MathStart::TakeOne:
+        return take_at_least_one(history);
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<std::size_t> read_math_inline(
+    std::size_t pos,
+    std::size_t open_b_round, /*what the math inline block started with*/
+    const Tokens& tokens,
+    std::pmr::vector<BlockElement>& history) {
+    // FIXME - This is really not optimal...
+    const auto e = tokens.element(pos);
+    if (e.m_open_b_square || e.m_open_b_curly) {
+        history.emplace_back(e.m_data);
+        return pos;
+    }
+    else if (start_math_inline(e, history)) {
+        history.emplace_back(e.m_data);
+        return pos;
+    }
+    // TODO - this is awful
+    else if (e.n_numerals == e.m_data.length()) {
+        history.emplace_back(e.m_data);
+        return pos;
+    }
+    else if (e.m_open_b_round != open_b_round) {
+        // We must exit math mode with the same number of round brackets with which
+        // we entered it
+        history.emplace_back(e.m_data);
+        return pos;
+    }
+    else if (
+        !(e.n_lower_case == e.m_data.size()) &&
+        pos + 1 < tokens.size() &&
+        tokens.kind(pos + 1) == TokenKind::Element &&
+        start_math_inline(tokens.element(pos + 1), history)) {
+        history.emplace_back(e.m_data);
+        history.emplace_back(tokens.text(pos + 1));
+        return pos + 1;
+    }
+    return std::nullopt;
+}
+
+
+size_t handle_line_break(
+    const LineBreak& line_break,
+    size_t pos,
+    const Tokens& tokens,
+    History& history) {
+    if (history.back().m_type == EnvironmentType::Array) {
+        // An array must be completed on the same line
+        throw Exception{
+            "[",
+            line_break.m_line_number,
+            ":0] SyntaxError: Array started on previous line must be completed on the same line"
+        };
+    }
+    if (line_break.is_empty) {
+        switch (history.back().m_type)
+        {
+        case EnvironmentType::MathInline:
+            // RULE: an empty line ends an inline environment
+            push_last_block(history);
+        case EnvironmentType::PlainText:
+        case EnvironmentType::MathBlock:
+        case EnvironmentType::ListItem:
+            history.back().m_data.emplace_back("\n");
+            break;
+        default:
+            assert(false);
+        }
+    }
+    else
+    {
+        if (line_break.m_indent > history.back().m_indent) {
+            if (auto item_label = try_get_item_label(history.resource(), pos + 1, tokens)) {
+                auto& [label, end_of_label] = *item_label;
+                history.emplace_back(make_block(
+                    history.resource(),
+                    EnvironmentType::ListItem,
+                    line_break.m_indent,  // TODO check if it is +4
+                    tokens,
+                    pos + 1,
+                    std::move(label),
+                    history.back().m_type != EnvironmentType::ListItem ? "first" : ""
+                ));
+                return end_of_label;
+            }
+            else {
+                Exception e{
+                    "[",
+                    line_break.m_line_number,
+                    ":0] IndentationError: Expected indent ",
+                    history.back().m_indent,
+                    " found ",
+                    line_break.m_indent
+                };
+                if (!history.m_error_log) {
+                    throw e;
+                }
+                history.m_error_log->report(e);
+                return pos + 1;
+            }
+        }
+
+        auto no_match_f = [&](const Block& block) {
+            return Exception{
+                "[",
+                line_break.m_line_number,
+                ":0] IndentationError: Indent level doesn't match any. Expecting ",
+                block.m_indent,
+                " started on line ",
+                block.m_line_number,
+                " found ",
+                line_break.m_indent
+            };
+        };
+
+        // When recovering, a line at the indent of no open block closes none, so
+        // that the next line at the indent of one still carries it on. The error
+        // is the one closing them would have reached.
+        if (history.m_error_log) {
+            const auto carried_on = std::find_if(history.m_blocks.rbegin(), history.m_blocks.rend(), [&](const Block& block) {
+                return block.m_indent <= line_break.m_indent;
+            });
+            if (carried_on != history.m_blocks.rend() && carried_on->m_indent != line_break.m_indent) {
+                history.m_error_log->report(no_match_f(*carried_on));
+                return pos + 1;
+            }
+        }
+
+        while (history.back().m_indent > line_break.m_indent) {
+            push_last_block(history);
+        }
+        if (history.back().m_indent != line_break.m_indent) {
+            auto e = no_match_f(history.back());
+            if (!history.m_error_log) {
+                throw e;
+            }
+            history.m_error_log->report(e);
+        }
+    }
+    return pos + 1;
+}
+
+
+size_t handle_environment_decleration(
+    const EnvironmentDecleration& environment_decleration,
+    size_t pos,
+    const Tokens& tokens,
+    History& history) {
+    switch (history.back().m_type)
+    {
+    case EnvironmentType::MathBlock:
+    case EnvironmentType::Array:
+        {
+            throw Exception{
+                "[",
+                environment_decleration.m_line_number,
+                ":*] SyntaxError: Cannot declare an environment whilst in environment ",
+                history.back().m_type
+            };
+        }
+    case EnvironmentType::MathInline:
+        push_last_block(history);
+    case EnvironmentType::PlainText:
+    case EnvironmentType::ListItem:
+        {
+            const auto& environment = *environment_decleration.m_environment;
+            switch(environment.m_type)
+            {
+            case EnvironmentType::Section:
+                {
+                    if (history.m_stats) {
+                        history.m_stats->count_block(EnvironmentType::Section, history.size());
+                    }
+                    auto section = Rope::make(history.resource());
+                    section->append(environment.m_begin);
+                    section->append(environment_decleration.m_label);
+                    section->append(environment.m_end);
+                    history.back().m_data.emplace_back(std::move(section));
+                    break;
+                }
+            case EnvironmentType::PlainText:
+            case EnvironmentType::MathBlock:
+                {
+                    history.emplace_back(make_block(
+                        history.resource(),
+                        environment.m_type,
+                        history.back().m_indent + 4,
+                        tokens,
+                    pos,
+                        environment.m_name,
+                        environment_decleration.m_label,
+                        &environment
+                    ));
+                    break;
+                }
+            default:
+                {
+                    throw Exception{
+                        "[",
+                        environment_decleration.m_line_number,
+                        ":*] SyntaxError: Cannot declar environment of type ",
+                        environment.m_type
+                    };
+                } 
+            }
+            break;
+        }
+    default:
+        assert(false);
+    }
+    return pos + 1;
+}
+
+size_t handle_element(
+    const Element& element,
+    size_t pos,
+    const Tokens& tokens,
+    History& history) {
+    switch (history.back().m_type)
+    {
+    case EnvironmentType::ListItem:
+        {
+            if (auto item_label = try_get_item_label(history.resource(), pos, tokens)) {
+                auto& [label, end_of_label] = *item_label;
+                history.emplace_back(make_block(
+                    history.resource(),
+                    EnvironmentType::ListItem,
+                    history.back().m_indent + 4,
+                    tokens,
+                    pos,
+                    std::move(label),
+                    ""
+                ));
+                return end_of_label;
+            }
+        }
+    case EnvironmentType::PlainText:
+        {
+            if (auto math_start_opt = start_math_inline(element, history.back().m_data)) {
+                // FIXME - check here for bracket numbers and raise exception if have curly or
+                // square. In the case that we have a round we need to check that we exit with the
+                // same number
+
+                // If math_start > 0 we need to take that many elements from the history
+                // We first create the block and then add in the data
+                size_t math_start = *math_start_opt;
+                Block block = make_block(
+                    history.resource(),
+                    EnvironmentType::MathInline,
+                    history.back().m_indent,
+                    tokens,
+                    pos - math_start, // TODO - not sure actually correct
+                    std::string_view{},
+                    ""
+                );
+
+                for (;math_start > 0; --math_start) {
+                    block.m_data.emplace_back(std::move(history.back().m_data.back()));
+                    history.back().m_data.pop_back();
+                }
+
+                block.m_data.emplace_back(element.m_data);
+
+                history.emplace_back(std::move(block));
+            }
+            else {
+                // TODO - could look at neateing up words somehow
+                history.back().m_data.emplace_back(element.m_data);
+            }
+            break;
+        }
+    case EnvironmentType::MathBlock:
+        {
+            // 1. Check if the array starts
+            if (element.m_data == "\\arr{") {
+                // TODO - figure out how to change bracket type...
+                // could be something like \arr(, \arr[, etc.
+                history.emplace_back(make_block(
+                    history.resource(),
+                    EnvironmentType::Array,
+                    history.back().m_indent,
+                    tokens,
+                    pos,
+                    std::string_view{},
+                    ""
+                ));
+            }
+            else {
+                history.back().m_data.emplace_back(element.m_data);
+            }
+
+            break;
+        }
+    case EnvironmentType::Array:
+        {
+            if (element.m_data == "}") {
+                // Array is complete
+                push_last_block(history);
+            }
+            else {
+                history.back().m_data.emplace_back(element.m_data);
+            }
+
+            break;
+        }
+    case EnvironmentType::MathInline:
+        {
+            if (auto pos_opt = read_math_inline(
+                    pos,
+                    history.back().m_open_b_round,
+                    tokens,
+                    history.back().m_data))
+            {
+                // In this case we stay in math inline mode
+                pos = *pos_opt;
+            }
+            else {
+                push_last_block(history);
+                history.back().m_data.emplace_back(element.m_data);
+            }
+            break;
+        }
+    default:
+        assert(false);
+    }
+    return pos + 1;
+}
+
+
+// Adds the time of its scope to Parse, less any time spent amalgamating within it
+// (which is a phase of its own)
+class ParseTimer
+{
+public:
+    explicit ParseTimer(CompileStats* stats)
+        : m_stats{stats}
+        , m_phase{stats, Phase::Parse}
+    {
+        if (m_stats) {
+            m_begin = Trace::clock::now();
+            m_amalgamating = m_stats->time(Phase::Amalgamate);
+        }
+    }
+
+    ~ParseTimer() {
+        if (m_stats) {
+            const auto amalgamated = m_stats->time(Phase::Amalgamate) - m_amalgamating;
+            m_stats->time(Phase::Parse) += Trace::clock::now() - m_begin - amalgamated;
+        }
+    }
+
+private:
+    CompileStats* m_stats;
+    PhaseScope m_phase;
+    Trace::clock::time_point m_begin;
+    std::chrono::nanoseconds m_amalgamating;
+};
+
+
+Converter::Converter(
+    std::string& out,
+    std::pmr::memory_resource* resource,
+    CompileStats* stats,
+    Trace* trace)
+    : m_out{out}
+    , m_history{ProfilingResource::wrap(m_blocks_profiling, stats, Structure::Blocks, resource)}
+{
+    m_history.emplace_back(
+        EnvironmentType::PlainText,
+        0,
+        0,
+        0,
+        std::string_view{},
+        "",
+        std::pmr::vector<BlockElement>{resource}
+    );
+
+    m_history.m_amalgamate_resource = ProfilingResource::wrap(
+        m_amalgamates_profiling, stats, Structure::Amalgamates, resource);
+
+    // The root is not counted as a block
+    m_history.m_stats = stats;
+    m_history.m_trace = trace;
+    if (stats) {
+        stats->m_peak_history_depth = std::max<std::size_t>(stats->m_peak_history_depth, 1);
+    }
+}
+
+void Converter::feed(const Tokens& tokens) {
+    using namespace std;
+
+    ParseTimer timer{m_history.m_stats};
+    Trace* trace = m_history.m_trace;
+
+    // A handler can consume past the end of the line it was in (a list label
+    // closing the line), in which case we skip the same number of tokens here
+    size_t pos = m_skip;
+
+    if (m_history.size() && !m_history.m_blocks.front().m_line_number && tokens.size()) {
+        set_first_line(tokens.line_number(0));
+    }
+
+    while (pos < tokens.size()) {
+        switch (tokens.kind(pos))
+        {
+        case TokenKind::LineBreak:
+        case TokenKind::BlankLine:
+            {
+                Span span{trace, "handle_line_break"};
+                flush();
+                pos = handle_line_break(tokens.line_break(pos), pos, tokens, m_history);
+                break;
+            }
+        case TokenKind::EnvironmentDecleration:
+            {
+                Span span{trace, "handle_environment_decleration"};
+                pos = handle_environment_decleration(
+                    tokens.environment_decleration(pos), pos, tokens, m_history);
+                break;
+            }
+        case TokenKind::Element:
+            {
+                Span span{trace, "handle_element"};
+                pos = handle_element(tokens.element(pos), pos, tokens, m_history);
+                break;
+            }
+        }
+    }
+
+    m_skip = pos - tokens.size();
+}
+
+void Converter::finish() {
+    ParseTimer timer{m_history.m_stats};
+
+    while (m_history.size() > 1) {
+        push_last_block(m_history);
+    }
+
+    assert(m_history.size() == 1);
+    if (m_history.m_check_only) {
+        return;
+    }
+
+    note_first_front();
+    std::pmr::vector<BlockElement> final_block{m_history.resource()};
+    {
+        Span span{m_history.m_trace, "amalgamate_block", phase_time(m_history.m_stats, Phase::Amalgamate)};
+        PhaseScope phase{m_history.m_stats, Phase::Amalgamate};
+        amalgamate_block(m_history.back(), final_block, m_history.m_amalgamate_resource);
+    }
+    const auto capacity = m_out.capacity();
+    final_block.front().append_to(m_out); // Everything else is just new lines
+    count_output(capacity);
+}
+
+std::optional<Converter::Boundary> Converter::finish_chunk() {
+    ParseTimer timer{m_history.m_stats};
+
+    if (m_skip || m_history.back().m_type == EnvironmentType::Array) {
+        return std::nullopt;
+    }
+    for (std::size_t pos = 1; pos < m_history.size(); ++pos) {
+        if (m_history.m_blocks[pos].m_indent == 0) {
+            return std::nullopt;
+        }
+    }
+
+    while (m_history.size() > 1) {
+        push_last_block(m_history);
+    }
+
+    auto& data = m_history.back().m_data;
+    if (data.empty()) {
+        return std::nullopt;
+    }
+
+    note_first_front();
+    const auto capacity = m_out.capacity();
+    for (std::size_t pos = 0; pos < data.size(); ++pos) {
+        data[pos].append_to(m_out);
+        if (pos + 1 < data.size() && needs_space(data[pos], &data[pos + 1])) {
+            m_out += ' ';
+        }
+    }
+    count_output(capacity);
+
+    const auto& last = data.back();
+    Boundary boundary{
+        last.empty() ? '\0' : last.front(),
+        last.empty() ? '\0' : last.back()
+    };
+    data.clear();
+    return boundary;
+}
+
+void Converter::note_first_front() {
+    const auto& data = m_history.back().m_data;
+    if (!m_first_front && !data.empty()) {
+        m_first_front = data.front().empty() ? '\0' : data.front().front();
+    }
+}
+
+void Converter::count_output(std::size_t old_capacity) {
+    if (auto* memory = memory_stats(m_history.m_stats)) {
+        memory->reallocate(Structure::Output, old_capacity, m_out.capacity());
+    }
+}
+
+void Converter::flush() {
+    auto& data = m_history.back().m_data;
+    if (m_history.m_check_only && m_history.size() == 1) {
+        data.clear();
+        return;
+    }
+    if (m_history.size() > 1 || data.size() < 2) {
+        return;
+    }
+
+    // The last element could still be taken by a math inline block and terminal
+    // new lines are dropped, so we stop at the last word before them
+    std::size_t n_final = 0;
+    for (std::size_t pos = data.size() - 1; pos-- > 0;) {
+        if (!data[pos].is("\n")) {
+            n_final = pos;
+            break;
+        }
+    }
+    if (!n_final) {
+        return;
+    }
+
+    note_first_front();
+    const auto capacity = m_out.capacity();
+    for (std::size_t pos = 0; pos < n_final; ++pos) {
+        data[pos].append_to(m_out);
+        if (needs_space(data[pos], &data[pos + 1])) {
+            m_out += ' ';
+        }
+    }
+    count_output(capacity);
+
+    data.erase(data.begin(), data.begin() + n_final);
+}
+
+
+std::string convert_to_tex(
+    const Tokens& tokens,
+    std::pmr::memory_resource* resource,
+    CompileStats* stats,
+    Trace* trace) {
+    std::string tex;
+    Converter converter{tex, resource, stats, trace};
+    converter.feed(tokens);
+    converter.finish();
+    return tex;
+}
+
+} // ntx
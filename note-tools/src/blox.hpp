@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "environments.hpp"
+#include "exception.hpp"
+#include "rope.hpp"
+#include "stats.hpp"
+#include "tokens.hpp"
+
+
+namespace ntx {
+
+// A block's contents are rope segments. Most are views into the source, but once a
+// child block is complete its output is spliced in as a whole rope.
+using BlockElement = Rope::Segment;
+
+struct Block
+{
+    EnvironmentType m_type;
+
+    std::size_t m_indent;
+
+    // Taken from the token that started the block, so that we never have to
+    // look back through the tokens (which may no longer exist when streaming)
+    std::size_t m_line_number;
+    std::size_t m_open_b_round;
+
+    // A rope for labelled list items, otherwise a view
+    BlockElement m_name;
+    std::string_view m_label;
+
+    std::pmr::vector<BlockElement> m_data = {};
+
+    // What the block was declared as, if it was
+    const Environment* m_environment = nullptr;
+};
+
+struct History
+{
+    explicit History(std::pmr::memory_resource* resource)
+        : m_blocks{resource}
+        , m_amalgamate_resource{resource}
+    {}
+
+    std::pmr::deque<Block> m_blocks;
+
+    // Where finished blocks are amalgamated into, which is only different from
+    // the blocks' when counting memory
+    std::pmr::memory_resource* m_amalgamate_resource;
+
+    std::pmr::memory_resource* resource() const { return m_blocks.get_allocator().resource(); }
+
+    Block& back() { return m_blocks.back(); }
+    const Block& back() const { return m_blocks.back(); }
+    std::size_t size() const { return m_blocks.size(); }
+    void pop_back() { m_blocks.pop_back(); }
+
+    template <typename... Ts>
+    Block& emplace_back(Ts&&... args) {
+        auto& block = m_blocks.emplace_back(std::forward<Ts>(args)...);
+        if (m_stats) {
+            m_stats->count_block(block.m_type, m_blocks.size());
+        }
+        return block;
+    }
+
+    // Where the blocks made and the time spent go, if anywhere
+    CompileStats* m_stats = nullptr;
+    Trace* m_trace = nullptr;
+
+    // Finished blocks are dropped rather than amalgamated into their parent (see
+    // Converter::check_only)
+    bool m_check_only = false;
+
+    // Where errors that can be carried on past go, rather than being thrown (see
+    // Converter::recover_into)
+    ErrorLog* m_error_log = nullptr;
+};
+
+
+// Whether a word should be followed by a space when written before the next,
+// given only the characters that decide it ('\0' for an empty element)
+bool needs_space(char w_front, char w_back, char n_front);
+
+// Whether word should be followed by a space when written before next
+bool needs_space(const BlockElement& word, const BlockElement* next);
+
+
+// Runs the block state machine over the tokens it is fed. The handlers never
+// look beyond the line they are in, so the tokens can be fed a line at a time
+// (streaming) or all at once with the same result. Whenever we are back at
+// indent 0 the finished text is written to out, so only the open blocks are held.
+class Converter
+{
+public:
+    // The blocks, time and spans of converting go to stats and trace if given
+    Converter(
+        std::string& out,
+        std::pmr::memory_resource* resource,
+        CompileStats* stats = nullptr,
+        Trace* trace = nullptr);
+
+    // tokens must start at the beginning of a line
+    void feed(const Tokens& tokens);
+
+    // Closes all the open blocks and writes whatever is left
+    void finish();
+
+    // Only follows the blocks, making no tex, which is all finding the errors
+    // takes. What a block holds never decides where another starts or ends (only
+    // which words it takes with it) so the errors are those converting would
+    // throw. Must be called before anything is fed.
+    void check_only() { m_history.m_check_only = true; }
+
+    // Indentation errors go to log rather than being thrown, carrying on as
+    // though the line continued the block it is in. Other errors leave the blocks
+    // in no state to carry on from so are still thrown.
+    void recover_into(ErrorLog& log) { m_history.m_error_log = &log; }
+
+    // The line errors say the root block started on, that of the first token of
+    // the source. Taken from the first tokens fed, so only needed when starting
+    // part way through the source (see find_first_line).
+    void set_first_line(std::size_t line_number) { m_history.m_blocks.front().m_line_number = line_number; }
+
+    // The ends of the last element written by finish_chunk, which decide whether
+    // there is a space between it and whatever is written next
+    struct Boundary
+    {
+        char m_front;
+        char m_back;
+    };
+
+    // Closes the open blocks as a line at indent 0 would and writes everything,
+    // including terminal new lines, as more text follows. Returns nullopt if such
+    // a line would not bring us back to the root: an inline block open at indent
+    // 0, an array (an error) or a list label running on past the tokens fed.
+    std::optional<Boundary> finish_chunk();
+
+    // The first character written, as needs_space sees it, once anything has been
+    std::optional<char> first_front() const { return m_first_front; }
+
+private:
+    void note_first_front();
+
+    // Counts the output growing from old_capacity, if memory is being counted
+    void count_output(std::size_t old_capacity);
+
+    // Writes the part of the root block that can no longer change. This only
+    // happens once we are back at indent 0, i.e. all other blocks are complete.
+    void flush();
+
+    std::string& m_out;
+
+    // Only made when counting memory, and before the history as they must outlive
+    // its blocks
+    std::optional<ProfilingResource> m_blocks_profiling;
+    std::optional<ProfilingResource> m_amalgamates_profiling;
+
+    History m_history;
+    std::size_t m_skip = 0;
+    std::optional<char> m_first_front;
+};
+
+
+// Converts all the tokens at once
+std::string convert_to_tex(
+    const Tokens& tokens,
+    std::pmr::memory_resource* resource,
+    CompileStats* stats = nullptr,
+    Trace* trace = nullptr);
+
+} // ntx
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "hash.hpp"
+
+
+namespace ntx {
+
+// A persistent cache of compiled tex, one file per entry named by the key. The
+// key is a hash of the source together with everything else that decides the
+// tex (see make_key), which is stored without the ntx footer. A file's modification time is when it was last used,
+// and the least recently used are removed by evict once the cache is too big.
+// Entries have an extension of their own and evict only ever removes files named
+// as an entry, so pointing the cache at a directory of notes or tex is harmless.
+//
+// Entries are written to a temporary file and renamed into place, so several
+// threads (or processes) can share a cache. The worst that can happen is that
+// the same entry is written twice.
+class CompileCache
+{
+public:
+    CompileCache(std::filesystem::path dir, std::uintmax_t max_bytes)
+        : m_dir{std::move(dir)}
+        , m_max_bytes{max_bytes}
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+    }
+
+    // salt covers everything but the source that the output depends on
+    static std::uint64_t make_key(std::string_view source, std::uint64_t salt) {
+        return hash_bytes(source, salt);
+    }
+
+    // The cached tex for key, if there is one. Counts a hit or a miss.
+    std::optional<std::filesystem::path> find(std::uint64_t key) {
+        auto path = entry_path(key);
+
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) {
+            ++m_n_misses;
+            return std::nullopt;
+        }
+
+        // Touch it, so that it is the most recently used
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        ++m_n_hits;
+        return path;
+    }
+
+    // Copies the cached tex for key to out. Returns false (counting a miss) if
+    // there is none.
+    bool copy_to(std::uint64_t key, const std::filesystem::path& out) {
+        auto path = find(key);
+        if (!path) return false;
+
+        std::error_code ec;
+        std::filesystem::copy_file(*path, out, std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            // Most likely evicted by another process in the meantime
+            --m_n_hits;
+            ++m_n_misses;
+            return false;
+        }
+        return true;
+    }
+
+    void store(std::uint64_t key, std::string_view tex) {
+        auto tmp = temp_path(key);
+        {
+            std::ofstream file{tmp, std::ios::binary};
+            file.write(tex.data(), tex.size());
+            if (!file) return;
+        }
+        commit(tmp, key);
+    }
+
+    void store_file(std::uint64_t key, const std::filesystem::path& tex) {
+        auto tmp = temp_path(key);
+        std::error_code ec;
+        std::filesystem::copy_file(tex, tmp, std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) return;
+        commit(tmp, key);
+    }
+
+    // Removes the least recently used entries until the cache fits in max_bytes
+    void evict() {
+        struct Entry
+        {
+            std::filesystem::path m_path;
+            std::uintmax_t m_size;
+            std::filesystem::file_time_type m_used;
+        };
+
+        std::error_code ec;
+        std::vector<Entry> entries;
+        std::uintmax_t total = 0;
+        for (const auto& file : std::filesystem::directory_iterator{m_dir, ec}) {
+            if (!is_entry(file.path()) || !file.is_regular_file(ec)) {
+                continue;
+            }
+            auto size = file.file_size(ec);
+            auto used = file.last_write_time(ec);
+            if (ec) continue;
+            entries.push_back({file.path(), size, used});
+            total += size;
+        }
+
+        if (total <= m_max_bytes) return;
+
+        std::sort(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.m_used < rhs.m_used;
+        });
+        for (const auto& entry : entries) {
+            if (total <= m_max_bytes) break;
+            if (std::filesystem::remove(entry.m_path, ec)) {
+                total -= entry.m_size;
+                ++m_n_evicted;
+            }
+        }
+    }
+
+    std::size_t hits() const { return m_n_hits; }
+    std::size_t misses() const { return m_n_misses; }
+    std::size_t evicted() const { return m_n_evicted; }
+
+private:
+    std::filesystem::path entry_path(std::uint64_t key) const {
+        return m_dir / (to_hex(key) + s_extension);
+    }
+
+    // Whether path is named as entry_path names them: a 16 digit hex key and the
+    // extension
+    static bool is_entry(const std::filesystem::path& path) {
+        const std::string name = path.filename().string();
+        if (name.size() != 16 + s_extension.size() || !name.ends_with(s_extension)) {
+            return false;
+        }
+        return std::all_of(name.begin(), name.begin() + 16, [](char c) {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+        });
+    }
+
+    // Unique to the process and thread, so that concurrent stores of the same
+    // key do not write over each other's temporary file
+    std::filesystem::path temp_path(std::uint64_t key) const {
+        auto writer = hash_bytes(
+            std::to_string(::getpid()),
+            std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        return m_dir / (to_hex(key) + "." + to_hex(writer) + ".tmp");
+    }
+
+    void commit(const std::filesystem::path& tmp, std::uint64_t key) {
+        std::error_code ec;
+        std::filesystem::rename(tmp, entry_path(key), ec);
+        if (ec) {
+            std::filesystem::remove(tmp, ec);
+        }
+    }
+
+    inline static const std::string s_extension = ".ntxcache";
+
+    std::filesystem::path m_dir;
+    std::uintmax_t m_max_bytes;
+
+    std::atomic<std::size_t> m_n_hits = 0;
+    std::atomic<std::size_t> m_n_misses = 0;
+    std::atomic<std::size_t> m_n_evicted = 0;
+};
+
+} // ntx
@@ -0,0 +1,321 @@
+#include "detextion.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <optional>
+
+
+namespace ntx {
+
+void count_brackets(
+    std::string_view line,
+    const LineClass& line_class,
+    const Environments& environments,
+    OpenBrackets& open) {
+    if (line_class.m_kind == LineKind::Tag || line_class.m_kind == LineKind::Cmd) {
+        return;
+    }
+    if (line_class.m_kind == LineKind::Declaration) {
+        if (environments.find(line_class.m_first)) {
+            return;
+        }
+    }
+
+    for (char c : line) {
+        switch (c)
+        {
+        case '{': ++open.m_curly; break;
+        case '}': --open.m_curly; break;
+        case '[': ++open.m_square; break;
+        case ']': --open.m_square; break;
+        case '(': ++open.m_round; break;
+        case ')': --open.m_round; break;
+        default: break;
+        }
+    }
+}
+
+
+bool Lexer::next_line(Tokens& tokens) {
+    using namespace std;
+
+    string_view line;
+    while (++m_line_number, read_line(line)) {
+        if (lex_line(line, tokens)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Lexer::read_line(std::string_view& line) {
+    if (m_line_begin >= m_text.size()) {
+        return false;
+    }
+    std::size_t line_end = m_text.find('\n', m_line_begin);
+    if (line_end == std::string_view::npos) {
+        line_end = m_text.size();
+    }
+    line = m_text.substr(m_line_begin, line_end - m_line_begin);
+    m_line_begin = line_end + 1;
+    return true;
+}
+
+bool Lexer::lex_line(std::string_view line, Tokens& tokens) {
+    using namespace std;
+
+    // 1. If it matches any lines we use for meta data we do not include in the tokens
+    // 2. Each new line is an element. If all white space we treat as a blank line
+    // 3. An environment decleration is a single element.
+    //    (i) It cannot happen if we have any open braces
+    // 4. General element construction
+
+    // 1. ...
+    const auto line_class = classify_line(line);
+
+    if (line_class.m_kind == LineKind::Tag || line_class.m_kind == LineKind::Cmd) {
+        return false;
+    }
+
+    // TODO - comments
+
+    // 2. ...
+    const size_t line_begin = line.data() - m_text.data();
+    size_t indent = line.find_first_not_of(' ');
+    if (indent == string::npos) {
+        // Line is empty
+        tokens.push_blank_line(m_line_number, line_begin);
+        return true;
+    }
+
+    tokens.push_line_break(m_line_number, line_begin, indent);
+
+    // 3. ...
+    if (line_class.m_kind == LineKind::Declaration) {
+        if (const auto* environment = m_environments->find(line_class.m_first)) {
+            if (m_open_b_round || m_open_b_square || m_open_b_curly) {
+                Exception e{
+                    "[",
+                    m_line_number,
+                    ":0] SyntaxError: Cannot start new environment='",
+                    line_class.m_first,
+                    "' as brackets not closed. Open '('=",
+                    m_open_b_round,
+                    ", '{'=",
+                    m_open_b_curly,
+                    ", '['=",
+                    m_open_b_square,
+                    "."
+                };
+                if (!m_error_log) {
+                    throw e;
+                }
+                m_error_log->report(e);
+                m_open_b_round = m_open_b_square = m_open_b_curly = 0;
+            }
+
+            tokens.push_environment_decleration(
+                EnvironmentDecleration{m_line_number, environment, line_class.m_second}
+            );
+            return true;
+        }
+    }
+
+    // 4. Split the rest of the line into words. A word ending in a bracket
+    //    opens or closes it for the words that follow.
+    m_scanner.split(line, indent, [&](string_view word, const CharCounts& char_counts) {
+        const Brackets brackets{
+            static_cast<uint16_t>(m_open_b_round),
+            static_cast<uint16_t>(m_open_b_square),
+            static_cast<uint16_t>(m_open_b_curly)
+        };
+        tokens.push_element(m_line_number, word, brackets, char_counts);
+
+        switch (word.back())
+        {
+        case '{': ++m_open_b_curly; break;
+        case '}': --m_open_b_curly; break;
+        case '[': ++m_open_b_square; break;
+        case ']': --m_open_b_square; break;
+        case '(': ++m_open_b_round; break;
+        case ')': --m_open_b_round; break;
+        default: break;
+        }
+    });
+
+    return true;
+}
+
+
+void lex_in_parallel(
+    std::string_view text,
+    const Environments& environments,
+    Tokens& tokens,
+    WorkStealingPool& pool) {
+    struct Part
+    {
+        std::size_t m_begin = 0;
+        std::size_t m_end = 0;
+
+        // What the part opens and closes, then what is open at its start
+        OpenBrackets m_open;
+        std::size_t m_n_lines = 0;
+        std::size_t m_first_line = 1;
+
+        std::optional<Tokens> m_tokens;
+        std::exception_ptr m_error;
+    };
+
+    // Parts start at the beginning of a line
+    const std::size_t n_parts = std::clamp<std::size_t>(text.size() / s_min_chunk_size, 1, 4 * pool.size());
+    std::vector<Part> parts;
+    for (std::size_t begin = 0; begin < text.size();) {
+        std::size_t end = text.size();
+        if (parts.size() + 1 < n_parts) {
+            end = text.find('\n', (parts.size() + 1) * text.size() / n_parts);
+            end = end == std::string_view::npos ? text.size() : end + 1;
+        }
+        auto& part = parts.emplace_back();
+        part.m_begin = begin;
+        part.m_end = end;
+        begin = end;
+    }
+
+    if (parts.size() < 2) {
+        Lexer lexer{text, environments};
+        while (lexer.next_line(tokens)) {}
+        return;
+    }
+
+    // 1. The brackets opened and closed by each part
+    for (auto& part : parts) {
+        pool.submit([&part, text, &environments]() {
+            for (std::size_t next_begin = part.m_begin; next_begin < part.m_end;) {
+                const std::size_t line_begin = next_begin;
+                std::size_t line_end = text.find('\n', line_begin);
+                if (line_end == std::string_view::npos) {
+                    line_end = text.size();
+                }
+                next_begin = line_end + 1;
+
+                const auto line = text.substr(line_begin, line_end - line_begin);
+                count_brackets(line, classify_line(line), environments, part.m_open);
+                ++part.m_n_lines;
+            }
+        });
+    }
+    pool.wait();
+
+    // 2. An exclusive prefix sum gives what is open at the start of each
+    OpenBrackets open;
+    std::size_t line_number = 1;
+    for (auto& part : parts) {
+        const auto opened = part.m_open;
+        part.m_open = open;
+        part.m_first_line = line_number;
+        open += opened;
+        line_number += part.m_n_lines;
+    }
+
+    // 3. Lex the parts. The heap is used as the tokens' resource need not be
+    //    thread safe.
+    for (auto& part : parts) {
+        pool.submit([&part, text, &environments]() {
+            try {
+                auto& part_tokens = part.m_tokens.emplace(text, std::pmr::new_delete_resource());
+                Lexer lexer{text, environments, part.m_begin, part.m_end, part.m_first_line, part.m_open};
+                while (lexer.next_line(part_tokens)) {}
+            }
+            catch (...) {
+                part.m_error = std::current_exception();
+            }
+        });
+    }
+    pool.wait();
+
+    std::size_t n_tokens = tokens.size();
+    for (const auto& part : parts) {
+        if (part.m_error) {
+            std::rethrow_exception(part.m_error);
+        }
+        n_tokens += part.m_tokens->size();
+    }
+    tokens.reserve(n_tokens);
+    for (const auto& part : parts) {
+        tokens.append(*part.m_tokens);
+    }
+}
+
+
+Tokens lex(
+    std::string_view text,
+    const Environments& environments,
+    std::pmr::memory_resource* resource,
+    WorkStealingPool* pool) {
+    Tokens tokens{text, resource};
+    if (pool) {
+        lex_in_parallel(text, environments, tokens, *pool);
+    }
+    else {
+        Lexer lexer{text, environments};
+        while (lexer.next_line(tokens)) {}
+    }
+    return tokens;
+}
+
+
+bool is_top_level_line(std::string_view line, const LineClass& line_class) {
+    return !line.empty() && line[0] != ' ' &&
+        line_class.m_kind != LineKind::Tag && line_class.m_kind != LineKind::Cmd &&
+        std::string_view{"=-+/*^_<>"}.find(line[0]) == std::string_view::npos;
+}
+
+std::size_t find_first_line(std::string_view text) {
+    std::size_t line_number = 1;
+    for (std::size_t begin = 0; begin < text.size(); ++line_number) {
+        std::size_t end = text.find('\n', begin);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        const auto line_class = classify_line(text.substr(begin, end - begin));
+        if (line_class.m_kind != LineKind::Tag && line_class.m_kind != LineKind::Cmd) {
+            return line_number;
+        }
+        begin = end + 1;
+    }
+    return 1;
+}
+
+std::vector<TopLevelCut> find_top_level_cuts(
+    std::string_view text,
+    const Environments& environments,
+    std::size_t min_chunk) {
+    using namespace std;
+
+    vector<TopLevelCut> cuts;
+    OpenBrackets open;
+    size_t line_number = 0;
+    size_t chunk_begin = 0;
+
+    for (size_t next_begin = 0; next_begin < text.size();) {
+        ++line_number;
+        const size_t line_begin = next_begin;
+        size_t line_end = text.find('\n', line_begin);
+        if (line_end == string_view::npos) {
+            line_end = text.size();
+        }
+        next_begin = line_end + 1;
+        const auto line = text.substr(line_begin, line_end - line_begin);
+        const auto line_class = classify_line(line);
+
+        if (line_begin - chunk_begin >= min_chunk && !open.any() && is_top_level_line(line, line_class)) {
+            cuts.push_back({line_begin, line_number});
+            chunk_begin = line_begin;
+        }
+
+        count_brackets(line, line_class, environments, open);
+    }
+    return cuts;
+}
+
+} // ntx
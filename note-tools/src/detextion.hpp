@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "environments.hpp"
+#include "exception.hpp"
+#include "parsers.hpp"
+#include "pool.hpp"
+#include "scan.hpp"
+#include "tokens.hpp"
+
+
+namespace ntx {
+
+// How many brackets of each kind are open at some point of the source. Counted as
+// the lexer does, so a stray closing bracket wraps around.
+struct OpenBrackets
+{
+    std::size_t m_round = 0;
+    std::size_t m_square = 0;
+    std::size_t m_curly = 0;
+
+    bool any() const { return m_round || m_square || m_curly; }
+
+    OpenBrackets& operator += (const OpenBrackets& other) {
+        m_round += other.m_round;
+        m_square += other.m_square;
+        m_curly += other.m_curly;
+        return *this;
+    }
+};
+
+// Adds the brackets the line opens and closes to open, just as lexing it would
+// but without splitting it into words (every bracket ends exactly one word).
+// Meta data lines and declarations of the environments leave the brackets alone.
+void count_brackets(
+    std::string_view line,
+    const LineClass& line_class,
+    const Environments& environments,
+    OpenBrackets& open);
+
+
+// Pulls the tokens out of the source one line at a time, so that the whole
+// file never has to be held as tokens. The tokens refer to the text by offset,
+// and to the environments it can declare, so both must outlive them.
+class Lexer
+{
+public:
+    Lexer(std::string_view text, const Environments& environments)
+        : m_text{text}
+        , m_environments{&environments}
+        , m_scanner{text}
+    {
+        // Token offsets are 32 bit
+        if (text.size() > std::numeric_limits<std::uint32_t>::max()) {
+            throw Exception{"Cannot compile files larger than 4GiB"};
+        }
+    }
+
+    // Just the lines in [begin, end) of text, the first of which is first_line
+    // with the brackets in open still open
+    Lexer(
+        std::string_view text,
+        const Environments& environments,
+        std::size_t begin,
+        std::size_t end,
+        std::size_t first_line,
+        const OpenBrackets& open = {})
+        : Lexer{text.substr(0, end), environments}
+    {
+        m_line_begin = begin;
+        m_line_number = first_line - 1;
+        m_open_b_round = open.m_round;
+        m_open_b_square = open.m_square;
+        m_open_b_curly = open.m_curly;
+    }
+
+    std::string_view text() const { return m_text; }
+
+    // Errors that only leave brackets open go to log rather than being thrown,
+    // carrying on as though the brackets were closed
+    void recover_into(ErrorLog& log) { m_error_log = &log; }
+
+    // Appends the tokens of the next line (skipping meta data lines). Returns
+    // false once there are no lines left.
+    bool next_line(Tokens& tokens);
+
+private:
+    // Behaves as getline would
+    bool read_line(std::string_view& line);
+
+    // Returns false if the line is meta data and produced no tokens
+    bool lex_line(std::string_view line, Tokens& tokens);
+
+    std::string_view m_text;
+    const Environments* m_environments;
+    std::size_t m_line_begin = 0;
+
+    std::size_t m_line_number = 0;
+    // TODO - could get nicer error messages if kept track of where the last open brace
+    // was , i.e. a stack of braces rather than a count;
+    std::size_t m_open_b_round = 0;
+    std::size_t m_open_b_square = 0;
+    std::size_t m_open_b_curly = 0;
+
+    ErrorLog* m_error_log = nullptr;
+    WordScanner m_scanner;
+};
+
+
+// Below this a file is not worth splitting between threads
+static constexpr std::size_t s_min_chunk_size = 1 << 18;
+
+// Lexes the text on the pool, appending to tokens. All the lexer carries from one
+// line to the next is the open brackets (and the line number), so a first pass
+// counts what each part of the text opens and closes, a prefix sum of those gives
+// what is open at the start of each part and then the parts are lexed at once,
+// each into tokens of its own that are appended in order. An error is the one
+// lexing the whole text would have stopped at. Must not be called from a task on
+// the pool.
+void lex_in_parallel(
+    std::string_view text,
+    const Environments& environments,
+    Tokens& tokens,
+    WorkStealingPool& pool);
+
+// Lexes all of text, in parallel if there is a pool. The tokens refer to text and
+// environments, so they must outlive them.
+Tokens lex(
+    std::string_view text,
+    const Environments& environments,
+    std::pmr::memory_resource* resource,
+    WorkStealingPool* pool = nullptr);
+
+
+// Where a source can be split into parts that lex and convert independently
+struct TopLevelCut
+{
+    std::size_t m_begin;
+    std::size_t m_line_number;
+};
+
+// Whether the source could be split at line, with no brackets open. A line at
+// indent 0 closes every block but inline ones (which the converter checks for,
+// see Converter::finish_chunk), so what is left is the lexer's state: the
+// brackets must all be closed. The line must also not start with an operator, as
+// that could take the word before it into a math inline.
+bool is_top_level_line(std::string_view line, const LineClass& line_class);
+
+// The line of the first token of text, as meta data lines make none (or 1 if
+// there are none)
+std::size_t find_first_line(std::string_view text);
+
+// Finds lines, at least min_chunk bytes apart, at which the source could be split
+std::vector<TopLevelCut> find_top_level_cuts(
+    std::string_view text,
+    const Environments& environments,
+    std::size_t min_chunk);
+
+} // ntx
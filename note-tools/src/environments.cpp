@@ -0,0 +1,119 @@
+#include "environments.hpp"
+
+#include <algorithm>
+
+#include "exception.hpp"
+#include "parsers.hpp"
+
+
+namespace ntx {
+
+Environments s_environments;
+
+
+Environments::Environments() {
+    for (const auto& builtin : detail::s_builtin_environments) {
+        push_back(builtin.m_short_name, builtin.m_type, builtin.m_name);
+    }
+}
+
+void Environments::add(std::string_view short_name, EnvironmentType type, std::string_view name) {
+    if (short_name.empty() || !std::all_of(short_name.begin(), short_name.end(), detail::is_name_char)) {
+        throw Exception{"Cannot add environment '", short_name, "' as it could not be declared"};
+    }
+    if (type != EnvironmentType::PlainText && type != EnvironmentType::MathBlock && type != EnvironmentType::Section) {
+        throw Exception{"Cannot add environment '", short_name, "' of type ", type};
+    }
+    if (name.empty() || name.find_first_of(" \t\r\n{}\\") != std::string_view::npos) {
+        throw Exception{"Cannot add environment '", short_name, "' as '", name, "' is not a tex name"};
+    }
+
+    push_back(store(std::string{short_name}), type, store(std::string{name}));
+    m_added[m_environments.back().m_short_name] = &m_environments.back();
+}
+
+void Environments::add(std::string_view definition) {
+    const auto equals = definition.find('=');
+    const auto colon = definition.find(':', equals);
+    if (equals == std::string_view::npos || colon == std::string_view::npos) {
+        throw Exception{"Cannot add environment '", definition, "', expected <short name>=<type>:<name>"};
+    }
+
+    const auto type_name = definition.substr(equals + 1, colon - equals - 1);
+    for (auto type : {EnvironmentType::PlainText, EnvironmentType::MathBlock, EnvironmentType::Section}) {
+        if (to_string(type) == type_name) {
+            add(definition.substr(0, equals), type, definition.substr(colon + 1));
+            return;
+        }
+    }
+    throw Exception{"Cannot add environment '", definition, "' as there is no type '", type_name, "'"};
+}
+
+std::vector<const Environment*> Environments::added() const {
+    auto out = m_parent ? m_parent->added() : std::vector<const Environment*>{};
+    for (const auto& [short_name, environment] : m_added) {
+        out.push_back(environment);
+    }
+    // Leaving out those of the parent that were replaced here
+    std::erase_if(out, [this](const Environment* environment) { return find(environment->m_short_name) != environment; });
+    return out;
+}
+
+void Environments::push_back(std::string_view short_name, EnvironmentType type, std::string_view name) {
+    auto& environment = m_environments.emplace_back(short_name, type, name);
+    const std::string s_name{name};
+    switch (type)
+    {
+    case EnvironmentType::Section:
+        environment.m_begin = store("\\" + s_name + "{");
+        environment.m_end = "}";
+        break;
+    case EnvironmentType::MathBlock:
+        environment.m_begin_unnumbered = store("\n\\begin{" + s_name + "*}\n");
+        environment.m_end_unnumbered = store("\n\\end{" + s_name + "*}\n");
+        [[fallthrough]];
+    default:
+        environment.m_begin = store("\n\\begin{" + s_name + "}\n");
+        environment.m_end = store("\n\\end{" + s_name + "}\n");
+        break;
+    }
+}
+
+
+std::size_t load_environments(std::string_view text, Environments& environments) {
+    std::size_t n_loaded = 0;
+    for (std::size_t pos = text.find(s_environment_command);
+         pos != std::string_view::npos;
+         pos = text.find(s_environment_command, pos + 1)) {
+        if (pos && text[pos - 1] != '\n') {
+            continue;
+        }
+        const auto line = text.substr(pos, text.find('\n', pos) - pos);
+        const auto line_class = classify_line(line);
+        if (line_class.m_kind != LineKind::Cmd || line_class.m_first != "environment") {
+            continue;
+        }
+
+        try {
+            environments.add(line_class.m_second);
+        }
+        catch (const Exception& e) {
+            const auto line_number = std::count(text.begin(), text.begin() + pos, '\n') + 1;
+            throw Exception{"[", line_number, ":0] ", e.m_message};
+        }
+        ++n_loaded;
+    }
+    return n_loaded;
+}
+
+
+SourceEnvironments::SourceEnvironments(std::string_view source, const Environments& parent)
+    : m_parent{&parent}
+{
+    if (source.find(s_environment_command) != std::string_view::npos) {
+        m_own = std::make_unique<Environments>(&parent);
+        load_environments(source, *m_own);
+    }
+}
+
+} // ntx
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "tokens.hpp"
+
+
+namespace ntx {
+
+// An environment that can be declared, by the name it is declared with. What its
+// blocks start and end with is made once, when it is added, rather than for
+// every block.
+struct Environment
+{
+    Environment(std::string_view short_name, EnvironmentType type, std::string_view name)
+        : m_short_name{short_name}
+        , m_type{type}
+        , m_name{name}
+    {}
+
+    std::string_view m_short_name;
+    EnvironmentType m_type;
+    // As it is called in the tex
+    std::string_view m_name;
+
+    // A section is m_begin, its label and then m_end. Other environments wrap
+    // their block in them, a math block without a label in the unnumbered pair.
+    std::string_view m_begin = {};
+    std::string_view m_end = {};
+    std::string_view m_begin_unnumbered = {};
+    std::string_view m_end_unnumbered = {};
+};
+
+
+namespace detail {
+
+struct BuiltinEnvironment
+{
+    std::string_view m_short_name;
+    EnvironmentType m_type;
+    std::string_view m_name;
+};
+
+inline constexpr BuiltinEnvironment s_builtin_environments[] = {
+    {"proof",         EnvironmentType::PlainText, "proof"},
+    {"thm",           EnvironmentType::PlainText, "theorem"},
+    {"theorem",       EnvironmentType::PlainText, "theorem"},
+    {"lemma",         EnvironmentType::PlainText, "lemma"},
+    {"corollary",     EnvironmentType::PlainText, "corollary"},
+    {"prop",          EnvironmentType::PlainText, "proposition"},
+    {"proposition",   EnvironmentType::PlainText, "proposition"},
+    {"construction",  EnvironmentType::PlainText, "construction"},
+    {"eq",            EnvironmentType::MathBlock, "equation"},
+    {"equation",      EnvironmentType::MathBlock, "equation"},
+    {"section",       EnvironmentType::Section,   "section"},
+    {"subsection",    EnvironmentType::Section,   "subsection"},
+    {"subsubsection", EnvironmentType::Section,   "subsubsection"},
+};
+
+inline constexpr std::size_t s_n_builtin_environments = std::size(s_builtin_environments);
+
+// The built-in short names are hashed into a table of slots with no two in the
+// same one, so looking one up is a hash, a load and a compare
+inline constexpr std::size_t s_builtin_slot_bits = 5;
+inline constexpr std::uint8_t s_no_builtin = 0xff;
+
+constexpr std::size_t builtin_slot(std::string_view short_name, std::uint32_t seed) {
+    std::uint32_t h = seed;
+    for (char c : short_name) {
+        h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return h >> (32 - s_builtin_slot_bits);
+}
+
+using builtin_slots_t = std::array<std::uint8_t, std::size_t{1} << s_builtin_slot_bits>;
+
+constexpr bool fill_builtin_slots(std::uint32_t seed, builtin_slots_t& slots) {
+    slots.fill(s_no_builtin);
+    for (std::size_t i = 0; i < s_n_builtin_environments; ++i) {
+        auto& slot = slots[builtin_slot(s_builtin_environments[i].m_short_name, seed)];
+        if (slot != s_no_builtin) {
+            return false;
+        }
+        slot = static_cast<std::uint8_t>(i);
+    }
+    return true;
+}
+
+// The first seed that puts every built-in in a slot of its own
+constexpr std::uint32_t find_builtin_seed() {
+    builtin_slots_t slots{};
+    std::uint32_t seed = 2166136261u;
+    while (!fill_builtin_slots(seed, slots)) {
+        ++seed;
+    }
+    return seed;
+}
+
+inline constexpr std::uint32_t s_builtin_seed = find_builtin_seed();
+
+inline constexpr builtin_slots_t s_builtin_slots = []() {
+    builtin_slots_t slots{};
+    fill_builtin_slots(s_builtin_seed, slots);
+    return slots;
+}();
+
+} // detail
+
+
+// The built-in environments and any added to them, e.g. from the
+// "% CMD environment <short name>=<type>:<name>" lines of a config file (see
+// load_environments). Adding is not safe while anything is compiling with them,
+// so s_environments has all its own added before the first file is, and a source
+// adds those it declares itself to one of its own on top (see SourceEnvironments).
+class Environments
+{
+public:
+    Environments();
+
+    // Those of parent, which must outlive it, with any added here on top
+    explicit Environments(const Environments* parent) : m_parent{parent} {}
+
+    Environments(const Environments&) = delete;
+    Environments& operator = (const Environments&) = delete;
+
+    // The environment declared as short_name, if there is one. Added environments
+    // come first, so they can replace those of the parent and built-in ones.
+    const Environment* find(std::string_view short_name) const {
+        using namespace detail;
+        if (!m_added.empty()) {
+            if (auto it = m_added.find(short_name); it != m_added.end()) {
+                return it->second;
+            }
+        }
+        if (m_parent) {
+            return m_parent->find(short_name);
+        }
+        const auto i = s_builtin_slots[builtin_slot(short_name, s_builtin_seed)];
+        if (i != s_no_builtin && m_environments[i].m_short_name == short_name) {
+            return &m_environments[i];
+        }
+        return nullptr;
+    }
+
+    // Adds the environment, replacing any declared with the same short name.
+    // Throws if it could never be declared or written.
+    void add(std::string_view short_name, EnvironmentType type, std::string_view name);
+
+    // Adds one given as "<short name>=<type>:<name>", e.g. "defn=PlainText:definition"
+    void add(std::string_view definition);
+
+    // Those added on top of the built-ins, here or to the parent, that have not
+    // been replaced since. In no particular order.
+    std::vector<const Environment*> added() const;
+
+private:
+    void push_back(std::string_view short_name, EnvironmentType type, std::string_view name);
+
+    std::string_view store(std::string s) { return m_strings.emplace_back(std::move(s)); }
+
+    const Environments* m_parent = nullptr;
+
+    // Neither moves what it holds, so the views into them stay valid. Only the
+    // environments without a parent hold the built-ins, at the start.
+    std::deque<Environment> m_environments;
+    std::deque<std::string> m_strings;
+
+    // By short name, those added after the built-ins
+    std::unordered_map<std::string_view, const Environment*> m_added;
+};
+
+// The built-ins and those of --environments
+extern Environments s_environments;
+
+// What the lines that declare environments start with
+inline constexpr std::string_view s_environment_command = "% CMD environment ";
+
+// Adds the environments of the "% CMD environment ..." lines in text, returning
+// how many there were. Other lines are left alone, so notes can be read as they
+// are.
+std::size_t load_environments(std::string_view text, Environments& environments = s_environments);
+
+
+// The environments a source can declare: those it is compiled with and on top of
+// them the ones its own "% CMD environment" lines add, which no other source
+// sees. Throws, as an error at the line, if one of those cannot be added.
+class SourceEnvironments
+{
+public:
+    SourceEnvironments(std::string_view source, const Environments& parent);
+
+    const Environments& get() const { return m_own ? *m_own : *m_parent; }
+
+private:
+    const Environments* m_parent;
+    // Only made if the source declares any, and held apart so that moving this
+    // leaves the environments in place
+    std::unique_ptr<Environments> m_own;
+};
+
+} // ntx
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+
+namespace ntx {
+
+namespace detail {
+
+// Strings as they are, numbers in decimal and anything else through a
+// to_string found next to its type (e.g. EnvironmentType)
+template <typename T>
+void append_message(std::string& message, const T& arg) {
+    if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        message += std::string_view{arg};
+    }
+    else if constexpr (std::is_same_v<T, char>) {
+        message += arg;
+    }
+    else if constexpr (std::is_arithmetic_v<T>) {
+        message += std::to_string(arg);
+    }
+    else {
+        message += to_string(arg);
+    }
+}
+
+} // detail
+
+
+struct Exception : public std::exception
+{
+    Exception() : std::exception{}, m_message{} {}
+
+    // The message is the arguments one after the other
+    template <typename... Ts>
+    explicit Exception(const Ts&... args)
+        : std::exception{}
+        , m_message{}
+    {
+        (detail::append_message(m_message, args), ...);
+    }
+
+    const char* what() const noexcept override { return m_message.c_str(); }
+
+    std::string m_message;
+};
+
+
+// The errors a recovering pass has carried on past. Once it would hold
+// m_max_errors an error is thrown as usual, which ends the pass.
+struct ErrorLog
+{
+    std::size_t m_max_errors;
+    std::vector<std::string> m_errors{};
+
+    // Keeps the error if there is room for another after it, otherwise throws it
+    void report(const Exception& e) {
+        if (m_errors.size() + 1 >= m_max_errors) {
+            throw e;
+        }
+        m_errors.push_back(e.m_message);
+    }
+};
+
+} // ntx
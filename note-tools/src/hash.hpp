@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+
+namespace ntx {
+
+namespace detail {
+
+inline std::uint64_t read_u64(const char* p) {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// The high and low halves of the 128 bit product folded together
+inline std::uint64_t mix(std::uint64_t a, std::uint64_t b) {
+    const unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+    return static_cast<std::uint64_t>(r >> 64) ^ static_cast<std::uint64_t>(r);
+}
+
+} // detail
+
+
+// A fast, non-cryptographic 64 bit hash of some bytes (multiply and fold, in the
+// style of wyhash). Good enough to key caches by content, not for anything an
+// attacker controls.
+inline std::uint64_t hash_bytes(std::string_view data, std::uint64_t seed = 0) {
+    using namespace detail;
+
+    constexpr std::uint64_t k0 = 0xa0761d6478bd642full;
+    constexpr std::uint64_t k1 = 0xe7037ed1a0b428dbull;
+    constexpr std::uint64_t k2 = 0x8ebc6af09c88c6e3ull;
+
+    const char* p = data.data();
+    std::size_t n = data.size();
+    seed ^= k0;
+
+    for (; n >= 16; n -= 16, p += 16) {
+        seed = mix(read_u64(p) ^ k1, read_u64(p + 8) ^ seed);
+    }
+
+    // The tail is padded with zeros, the length is mixed in at the end so that
+    // this does not collide with a longer input
+    char tail[16] = {};
+    std::memcpy(tail, p, n);
+    seed = mix(read_u64(tail) ^ k1, read_u64(tail + 8) ^ seed);
+
+    return mix(seed ^ k2, data.size() ^ k1);
+}
+
+inline std::string to_hex(std::uint64_t h) {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string out(16, '0');
+    for (std::size_t i = 16; i-- > 0; h >>= 4) {
+        out[i] = digits[h & 0xf];
+    }
+    return out;
+}
+
+} // ntx
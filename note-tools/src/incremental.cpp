@@ -0,0 +1,355 @@
+#include "incremental.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include "arena.hpp"
+#include "detextion.hpp"
+#include "exception.hpp"
+
+
+namespace ntx {
+
+IncrementalCompile::IncrementalCompile(
+    std::string source,
+    std::size_t checkpoint_lines,
+    const CompileSettings& settings)
+    : m_source{std::move(source)}
+    , m_checkpoint_lines{std::max<std::size_t>(checkpoint_lines, 1)}
+    , m_settings{settings}
+    , m_checkpoints{Checkpoint{0, 1}}
+{
+    // Parts are always converted on this thread
+    m_settings.m_pool = nullptr;
+    declare_and_convert();
+}
+
+void IncrementalCompile::edit(std::size_t begin, std::size_t end, std::string_view text) {
+    assert(begin <= end && end <= m_source.size());
+
+    auto n_lines_f = [](std::string_view s) {
+        return static_cast<std::ptrdiff_t>(std::count(s.begin(), s.end(), '\n'));
+    };
+    const std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(text.size()) - static_cast<std::ptrdiff_t>(end - begin);
+    const std::ptrdiff_t line_delta = n_lines_f(text) - n_lines_f(std::string_view{m_source}.substr(begin, end - begin));
+    const std::size_t new_end = begin + text.size();
+
+    // Whether the lines holding [from, to) of s could declare an environment
+    auto declares_f = [](std::string_view s, std::size_t from, std::size_t to) {
+        from = from ? s.rfind('\n', from - 1) + 1 : 0;
+        to = std::min(s.find('\n', to), s.size());
+        return s.substr(from, to - from).find(s_environment_command) != std::string_view::npos;
+    };
+    // While one is an error it is looked for again, as its line may have moved
+    const bool redeclare = !m_environments || declares_f(m_source, begin, end);
+
+    // Where a position of the old source is in the new one
+    auto move_f = [&](std::size_t pos, std::size_t if_replaced) {
+        if (pos < begin) return pos;
+        if (pos >= end) return pos + delta;
+        return if_replaced;
+    };
+
+    // Checkpoints in what was replaced are gone and those after it move. The
+    // first is always at the start.
+    m_checkpoints.erase(
+        std::remove_if(m_checkpoints.begin() + 1, m_checkpoints.end(), [&](const Checkpoint& checkpoint) {
+            return checkpoint.m_begin >= begin && checkpoint.m_begin < end;
+        }),
+        m_checkpoints.end());
+    for (std::size_t i = 1; i < m_checkpoints.size(); ++i) {
+        auto& checkpoint = m_checkpoints[i];
+        if (checkpoint.m_begin >= end) {
+            checkpoint.m_begin += delta;
+            checkpoint.m_first_line += line_delta;
+        }
+    }
+
+    m_source.replace(begin, end - begin, text);
+    if (redeclare || declares_f(m_source, begin, new_end)) {
+        declare_and_convert();
+        return;
+    }
+    if (!m_error) {
+        convert(begin, new_end);
+        return;
+    }
+
+    const std::size_t dirty_begin = move_f(m_dirty_begin, begin);
+    const std::size_t dirty_end = move_f(m_dirty_end, new_end);
+
+    // An edit away from what did not convert is converted on its own, and then
+    // that is again, as its error may have moved lines. Only if both fail is all
+    // between them converted as one.
+    const std::size_t line_begin = begin ? m_source.rfind('\n', begin - 1) + 1 : 0;
+    if (new_end < dirty_begin || line_begin > dirty_end) {
+        convert(begin, new_end);
+        if (!m_error) {
+            const std::size_t n_converted_bytes = m_n_converted_bytes;
+            convert(dirty_begin, dirty_end);
+            m_n_converted_bytes += n_converted_bytes;
+            return;
+        }
+    }
+    convert(std::min(begin, dirty_begin), std::max(new_end, dirty_end));
+}
+
+IncrementalCompile::Preview IncrementalCompile::preview(std::size_t pos) const {
+    const std::string_view source = m_source;
+    const Environments& environments = m_environments ? m_environments->get() : *m_settings.m_environments;
+    pos = std::min(pos, source.size());
+
+    // Every checkpoint starts a top level line, so the block is found from the
+    // last one at or before pos
+    const auto checkpoint_it = std::partition_point(
+        m_checkpoints.begin() + 1,
+        m_checkpoints.end(),
+        [pos](const Checkpoint& checkpoint) { return checkpoint.m_begin <= pos; });
+    const auto& checkpoint = *(checkpoint_it - 1);
+
+    Preview preview{checkpoint.m_begin, source.size(), {}};
+    std::size_t first_line = checkpoint.m_first_line;
+    {
+        OpenBrackets open;
+        std::size_t line_number = checkpoint.m_first_line;
+        for (std::size_t next = checkpoint.m_begin; next < source.size(); ++line_number) {
+            const std::size_t begin = next;
+            std::size_t end = source.find('\n', begin);
+            if (end == std::string_view::npos) {
+                end = source.size();
+            }
+            next = end + 1;
+            const auto line = source.substr(begin, end - begin);
+            const auto line_class = classify_line(line);
+
+            if (begin > checkpoint.m_begin && !open.any() && is_top_level_line(line, line_class)) {
+                if (begin > pos) {
+                    preview.m_end = begin;
+                    break;
+                }
+                preview.m_begin = begin;
+                first_line = line_number;
+            }
+            count_brackets(line, line_class, environments, open);
+        }
+    }
+
+    auto& result = preview.m_result;
+    if (!m_environments) {
+        result.m_error = m_error;
+        return preview;
+    }
+
+    Arena arena{m_settings.m_arena_kind, m_settings.m_upstream};
+    try {
+        Tokens tokens{source, arena.resource()};
+        Lexer lexer{source, environments, preview.m_begin, preview.m_end, first_line};
+        while (lexer.next_line(tokens)) {}
+
+        Converter converter{result.m_tex, arena.resource()};
+        converter.set_first_line(find_first_line(source));
+        converter.feed(tokens);
+        converter.finish();
+    }
+    catch (const Exception& e) {
+        result.m_tex.clear();
+        result.m_error = e.m_message;
+    }
+    return preview;
+}
+
+void IncrementalCompile::declare_and_convert() {
+    m_checkpoints.erase(m_checkpoints.begin() + 1, m_checkpoints.end());
+    try {
+        m_environments.emplace(m_source, *m_settings.m_environments);
+    }
+    catch (const Exception& e) {
+        m_environments.reset();
+        m_error = e.m_message;
+        m_dirty_begin = 0;
+        m_dirty_end = m_source.size();
+        m_n_converted_bytes = 0;
+        return;
+    }
+    convert(0, m_source.size());
+}
+
+void IncrementalCompile::convert(std::size_t region_begin, std::size_t region_end) {
+    const std::string_view source = m_source;
+    const Environments& environments = m_environments->get();
+
+    // The last checkpoint before the line the region starts on, as an edit to the
+    // line of a checkpoint could mean it is no longer top level
+    const std::size_t line_begin = region_begin ? source.rfind('\n', region_begin - 1) + 1 : 0;
+    const auto first_it = std::partition_point(
+        m_checkpoints.begin() + 1,
+        m_checkpoints.end(),
+        [line_begin](const Checkpoint& checkpoint) { return checkpoint.m_begin < line_begin; });
+    const std::size_t first = first_it - m_checkpoints.begin() - 1;
+
+    // Splits what is converted into parts, finding where it ends: the first old
+    // checkpoint past the region with no brackets open, from which everything
+    // converts as it did before
+    std::vector<TopLevelCut> parts{{m_checkpoints[first].m_begin, m_checkpoints[first].m_first_line}};
+    std::size_t sync = first + 1;
+    std::size_t converted_end = source.size();
+    {
+        OpenBrackets open;
+        std::size_t line_number = parts.front().m_line_number;
+        for (std::size_t next = parts.front().m_begin; next < source.size(); ++line_number) {
+            const std::size_t begin = next;
+            std::size_t end = source.find('\n', begin);
+            if (end == std::string_view::npos) {
+                end = source.size();
+            }
+            next = end + 1;
+            const auto line = source.substr(begin, end - begin);
+            const auto line_class = classify_line(line);
+
+            if (begin > parts.front().m_begin && !open.any()) {
+                while (sync < m_checkpoints.size() && m_checkpoints[sync].m_begin < begin) {
+                    ++sync;
+                }
+                if (begin >= region_end && sync < m_checkpoints.size() && m_checkpoints[sync].m_begin == begin) {
+                    converted_end = begin;
+                    break;
+                }
+                if (line_number - parts.back().m_line_number >= m_checkpoint_lines &&
+                    is_top_level_line(line, line_class)) {
+                    parts.push_back({begin, line_number});
+                }
+            }
+            count_brackets(line, line_class, environments, open);
+        }
+        if (converted_end == source.size()) {
+            sync = m_checkpoints.size();
+        }
+    }
+
+    Arena arena{m_settings.m_arena_kind, m_settings.m_upstream};
+    std::vector<Tokens> tokens;
+    auto lex_f = [&](std::size_t i, std::size_t end) {
+        auto& part = tokens.emplace_back(source, arena.resource());
+        Lexer lexer{source, environments, parts[i].m_begin, end, parts[i].m_line_number};
+        while (lexer.next_line(part)) {}
+    };
+
+    // The parts are joined as convert_to_tex does on a pool: a part that turns out
+    // not to be independent of the one before is fed to that one's converter
+    std::vector<Checkpoint> made;
+    std::string tex;
+    std::string part_tex;
+    std::optional<Converter> converter;
+    std::optional<Converter::Boundary> boundary = first ? m_checkpoints[first - 1].m_boundary : std::nullopt;
+
+    const std::size_t first_line = find_first_line(source);
+    auto start_f = [&](std::size_t i) {
+        made.push_back(Checkpoint{parts[i].m_begin, parts[i].m_line_number});
+        converter.emplace(part_tex, arena.resource());
+        converter->set_first_line(first_line);
+        converter->feed(tokens[i]);
+    };
+    auto close_f = [&](std::optional<Converter::Boundary> next) {
+        auto& checkpoint = made.back();
+        checkpoint.m_first_front = converter->first_front();
+        checkpoint.m_boundary = next;
+        checkpoint.m_tex_begin = tex.size();
+        checkpoint.m_space_before = boundary && checkpoint.m_first_front &&
+            needs_space(boundary->m_front, boundary->m_back, *checkpoint.m_first_front);
+        if (checkpoint.m_space_before) {
+            tex += ' ';
+        }
+        tex += part_tex;
+        part_tex.clear();
+        boundary = next;
+    };
+
+    try {
+        // All the lexing comes before any converting, as when compiling
+        tokens.reserve(parts.size());
+        for (std::size_t i = 0; i < parts.size(); ++i) {
+            lex_f(i, i + 1 < parts.size() ? parts[i + 1].m_begin : converted_end);
+        }
+
+        start_f(0);
+        for (std::size_t i = 0;;) {
+            if (i + 1 < parts.size()) {
+                ++i;
+                if (auto next = converter->finish_chunk()) {
+                    close_f(next);
+                    start_f(i);
+                }
+                else {
+                    converter->feed(tokens[i]);
+                }
+                continue;
+            }
+
+            if (converted_end == source.size()) {
+                converter->finish();
+                close_f(std::nullopt);
+                break;
+            }
+            if (auto next = converter->finish_chunk()) {
+                close_f(next);
+                break;
+            }
+
+            // The old part at converted_end depends on what comes before it after
+            // all, so it is converted again too
+            const std::size_t end = sync + 1 < m_checkpoints.size()
+                ? m_checkpoints[sync + 1].m_begin
+                : source.size();
+            parts.push_back({converted_end, m_checkpoints[sync].m_first_line});
+            lex_f(parts.size() - 1, end);
+            converter->feed(tokens.back());
+            ++i;
+            ++sync;
+            converted_end = end;
+        }
+    }
+    catch (const Exception& e) {
+        // Until an edit makes it compile again, the first of the checkpoints
+        // stands for all it converted, its tex left as it was
+        m_error = e.m_message;
+        m_dirty_begin = parts.front().m_begin;
+        m_dirty_end = converted_end;
+        m_checkpoints.erase(m_checkpoints.begin() + first + 1, m_checkpoints.begin() + sync);
+        m_n_converted_bytes = converted_end - parts.front().m_begin;
+        return;
+    }
+    m_error.reset();
+    m_n_converted_bytes = converted_end - parts.front().m_begin;
+
+    // Splice the tex in, from the start of the first part to the space before the
+    // part it synced with, which is joined again
+    const std::size_t tex_begin = m_checkpoints[first].m_tex_begin;
+    std::size_t tex_end = m_tex.size();
+    bool sync_space = false;
+    if (sync < m_checkpoints.size()) {
+        const auto& next = m_checkpoints[sync];
+        tex_end = next.m_tex_begin + next.m_space_before;
+        sync_space = boundary && next.m_first_front &&
+            needs_space(boundary->m_front, boundary->m_back, *next.m_first_front);
+        if (sync_space) {
+            tex += ' ';
+        }
+    }
+    m_tex.replace(tex_begin, tex_end - tex_begin, tex);
+
+    if (sync < m_checkpoints.size()) {
+        const std::ptrdiff_t tex_delta = static_cast<std::ptrdiff_t>(tex.size()) - static_cast<std::ptrdiff_t>(tex_end - tex_begin);
+        for (std::size_t i = sync + 1; i < m_checkpoints.size(); ++i) {
+            m_checkpoints[i].m_tex_begin += tex_delta;
+        }
+        m_checkpoints[sync].m_tex_begin = tex_begin + tex.size() - sync_space;
+        m_checkpoints[sync].m_space_before = sync_space;
+    }
+    for (auto& checkpoint : made) {
+        checkpoint.m_tex_begin += tex_begin;
+    }
+    m_checkpoints.erase(m_checkpoints.begin() + first, m_checkpoints.begin() + sync);
+    m_checkpoints.insert(m_checkpoints.begin() + first, made.begin(), made.end());
+}
+
+} // ntx
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "blox.hpp"
+#include "ntx.hpp"
+
+
+namespace ntx {
+
+// Lines apart (at least) that IncrementalCompile keeps checkpoints
+static constexpr std::size_t s_checkpoint_lines = 64;
+
+// A source that is edited in place and kept compiled, for editors. The source is
+// split at top level lines (see is_top_level_line) into parts of at least
+// checkpoint_lines lines, each converted on its own and joined as converting a
+// big file in parallel does, so the tex is always what compile would give.
+//
+// A checkpoint is where one of these parts starts. There the parser's state is
+// as simple as it gets: only the root block is open and no brackets are, so all
+// it has to hold is where the part starts in the source and in the tex, and the
+// ends of its tex that decide the spaces joining it to its neighbours.
+//
+// An edit converts again from the last checkpoint before the line it starts on,
+// until it reaches an old checkpoint past the edit at which no brackets are open
+// (the state is again that of the old run), and the tex of what it converted is
+// spliced in place of the old. So an edit costs about a part or two whatever the
+// size of the source.
+//
+// The exception is an edit to a line that declares an environment, as every line
+// could lex differently with them changed: they are read again and the whole
+// source is converted.
+class IncrementalCompile
+{
+public:
+    explicit IncrementalCompile(
+        std::string source,
+        std::size_t checkpoint_lines = s_checkpoint_lines,
+        const CompileSettings& settings = {});
+
+    // Replaces the bytes [begin, end) of the source with text
+    void edit(std::size_t begin, std::size_t end, std::string_view text);
+
+    const std::string& source() const { return m_source; }
+
+    // The tex of the source, without the ntx footer. Out of date if there is an
+    // error.
+    const std::string& tex() const { return m_tex; }
+
+    // Why the source does not compile, the same as compile would give
+    const std::optional<std::string>& error() const { return m_error; }
+
+    // The top level block holding a position of the source, from the top level
+    // line at or before it to the next, and that block compiled on its own (so
+    // with line numbers as in the source), e.g. to preview it in an editor
+    struct Preview
+    {
+        std::size_t m_begin;
+        std::size_t m_end;
+        CompileResult m_result;
+    };
+    Preview preview(std::size_t pos) const;
+
+    std::size_t n_checkpoints() const { return m_checkpoints.size(); }
+
+    // How much of the source the last edit (or the first conversion) converted
+    std::size_t n_converted_bytes() const { return m_n_converted_bytes; }
+
+private:
+    struct Checkpoint
+    {
+        std::size_t m_begin;
+        std::size_t m_first_line;
+
+        // Where its tex starts, including the space joining it to the part before
+        std::size_t m_tex_begin = 0;
+        bool m_space_before = false;
+
+        // The ends of its tex, which decide the spaces either side of it. The last
+        // part has no boundary.
+        std::optional<char> m_first_front = std::nullopt;
+        std::optional<Converter::Boundary> m_boundary = std::nullopt;
+    };
+
+    // Reads the environments the source declares again and converts all of it,
+    // which is then a single part
+    void declare_and_convert();
+
+    // Converts again from the last checkpoint before the line holding
+    // region_begin, until an old checkpoint at or after region_end at which the
+    // state matches
+    void convert(std::size_t region_begin, std::size_t region_end);
+
+    std::string m_source;
+    std::size_t m_checkpoint_lines;
+    CompileSettings m_settings;
+    // Not set while one the source declares is an error
+    std::optional<SourceEnvironments> m_environments;
+
+    std::string m_tex;
+    std::vector<Checkpoint> m_checkpoints;
+
+    // If the last conversion failed, the part of the source that was not
+    // converted, which the next edit converts again
+    std::optional<std::string> m_error;
+    std::size_t m_dirty_begin = 0;
+    std::size_t m_dirty_end = 0;
+
+    std::size_t m_n_converted_bytes = 0;
+};
+
+} // ntx
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "exception.hpp"
+
+
+namespace ntx {
+
+// Just enough JSON for the language server's messages. Objects are kept as a
+// list of members in the order they came, as they only ever have a few.
+class Json
+{
+public:
+    using array_t = std::vector<Json>;
+    using object_t = std::vector<std::pair<std::string, Json>>;
+
+    Json() = default;
+    Json(std::nullptr_t) {}
+    Json(bool value) : m_value{value} {}
+    Json(double value) : m_value{value} {}
+    Json(int value) : m_value{static_cast<double>(value)} {}
+    Json(std::size_t value) : m_value{static_cast<double>(value)} {}
+    Json(std::string value) : m_value{std::move(value)} {}
+    Json(std::string_view value) : m_value{std::string{value}} {}
+    Json(const char* value) : m_value{std::string{value}} {}
+    Json(array_t value) : m_value{std::move(value)} {}
+    Json(object_t value) : m_value{std::move(value)} {}
+
+    bool is_null() const { return std::holds_alternative<std::nullptr_t>(m_value); }
+    bool is_number() const { return std::holds_alternative<double>(m_value); }
+    bool is_string() const { return std::holds_alternative<std::string>(m_value); }
+    bool is_array() const { return std::holds_alternative<array_t>(m_value); }
+    bool is_object() const { return std::holds_alternative<object_t>(m_value); }
+
+    // Each throws an Exception if the value is of another type
+    bool as_bool() const { return get<bool>("a boolean"); }
+    double as_number() const { return get<double>("a number"); }
+    const std::string& as_string() const { return get<std::string>("a string"); }
+    const array_t& as_array() const { return get<array_t>("an array"); }
+    const object_t& as_object() const { return get<object_t>("an object"); }
+
+    // The member called name, or null if there is none (or this is not an object)
+    const Json& operator [] (std::string_view name) const {
+        static const Json s_null;
+        if (const auto* object = std::get_if<object_t>(&m_value)) {
+            for (const auto& [key, value] : *object) {
+                if (key == name) return value;
+            }
+        }
+        return s_null;
+    }
+
+    // The member called name, the number of which is a count. Throws if it is
+    // not a whole number that fits in a std::size_t.
+    std::size_t as_count(std::string_view name) const {
+        // The max rounds up to 2^64, the first number that does not fit
+        static constexpr double s_too_big = static_cast<double>(std::numeric_limits<std::size_t>::max());
+        const double number = (*this)[name].as_number();
+        if (!(number >= 0 && number < s_too_big) || number != std::floor(number)) {
+            throw Exception{"JSON member '", name, "' is not a count"};
+        }
+        return static_cast<std::size_t>(number);
+    }
+
+    static Json parse(std::string_view text) {
+        std::size_t pos = 0;
+        Json json = parse_value(text, pos, 0);
+        skip_space(text, pos);
+        if (pos != text.size()) {
+            throw Exception{"JSON has trailing characters at ", pos};
+        }
+        return json;
+    }
+
+    std::string dump() const {
+        std::string text;
+        dump(text);
+        return text;
+    }
+
+    void dump(std::string& text) const {
+        std::visit([&text](const auto& value) { dump_value(text, value); }, m_value);
+    }
+
+private:
+    template <typename T>
+    const T& get(const char* what) const {
+        if (const auto* value = std::get_if<T>(&m_value)) {
+            return *value;
+        }
+        throw Exception{"JSON value is not ", what};
+    }
+
+    // Deep enough for any message, but a bad one cannot use up the stack
+    static constexpr std::size_t s_max_depth = 64;
+
+    static void skip_space(std::string_view text, std::size_t& pos) {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+            ++pos;
+        }
+    }
+
+    static void expect(std::string_view text, std::size_t& pos, std::string_view word) {
+        if (text.substr(pos, word.size()) != word) {
+            throw Exception{"JSON expected '", word, "' at ", pos};
+        }
+        pos += word.size();
+    }
+
+    static Json parse_value(std::string_view text, std::size_t& pos, std::size_t depth) {
+        if (depth > s_max_depth) {
+            throw Exception{"JSON is nested too deep"};
+        }
+        skip_space(text, pos);
+        if (pos == text.size()) {
+            throw Exception{"JSON ended early"};
+        }
+        switch (text[pos])
+        {
+        case 'n': expect(text, pos, "null"); return Json{};
+        case 't': expect(text, pos, "true"); return Json{true};
+        case 'f': expect(text, pos, "false"); return Json{false};
+        case '"': return Json{parse_string(text, pos)};
+        case '[':
+            {
+                array_t array;
+                ++pos;
+                skip_space(text, pos);
+                if (pos < text.size() && text[pos] == ']') {
+                    ++pos;
+                    return Json{std::move(array)};
+                }
+                while (true) {
+                    array.push_back(parse_value(text, pos, depth + 1));
+                    skip_space(text, pos);
+                    if (pos < text.size() && text[pos] == ',') {
+                        ++pos;
+                        continue;
+                    }
+                    expect(text, pos, "]");
+                    return Json{std::move(array)};
+                }
+            }
+        case '{':
+            {
+                object_t object;
+                ++pos;
+                skip_space(text, pos);
+                if (pos < text.size() && text[pos] == '}') {
+                    ++pos;
+                    return Json{std::move(object)};
+                }
+                while (true) {
+                    skip_space(text, pos);
+                    if (pos == text.size() || text[pos] != '"') {
+                        throw Exception{"JSON expected a member name at ", pos};
+                    }
+                    std::string key = parse_string(text, pos);
+                    skip_space(text, pos);
+                    expect(text, pos, ":");
+                    object.emplace_back(std::move(key), parse_value(text, pos, depth + 1));
+                    skip_space(text, pos);
+                    if (pos < text.size() && text[pos] == ',') {
+                        ++pos;
+                        continue;
+                    }
+                    expect(text, pos, "}");
+                    return Json{std::move(object)};
+                }
+            }
+        default:
+            {
+                double number;
+                const char* end = text.data() + text.size();
+                auto [ptr, ec] = std::from_chars(text.data() + pos, end, number);
+                if (ec != std::errc{} || ptr == text.data() + pos) {
+                    throw Exception{"JSON has an unexpected character at ", pos};
+                }
+                pos = ptr - text.data();
+                return Json{number};
+            }
+        }
+    }
+
+    static unsigned parse_hex(std::string_view text, std::size_t& pos) {
+        unsigned code = 0;
+        auto [ptr, ec] = std::from_chars(text.data() + pos, text.data() + std::min(pos + 4, text.size()), code, 16);
+        if (ec != std::errc{} || ptr != text.data() + pos + 4) {
+            throw Exception{"JSON has a bad \\u escape at ", pos};
+        }
+        pos += 4;
+        return code;
+    }
+
+    static void append_utf8(std::string& s, std::uint32_t code) {
+        if (code < 0x80) {
+            s += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            s += static_cast<char>(0xc0 | code >> 6);
+            s += static_cast<char>(0x80 | (code & 0x3f));
+        }
+        else if (code < 0x10000) {
+            s += static_cast<char>(0xe0 | code >> 12);
+            s += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+            s += static_cast<char>(0x80 | (code & 0x3f));
+        }
+        else {
+            s += static_cast<char>(0xf0 | code >> 18);
+            s += static_cast<char>(0x80 | (code >> 12 & 0x3f));
+            s += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+            s += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    }
+
+    static std::string parse_string(std::string_view text, std::size_t& pos) {
+        std::string s;
+        ++pos;
+        while (true) {
+            // Runs without escapes are copied whole
+            const std::size_t run_end = text.find_first_of("\"\\", pos);
+            if (run_end == std::string_view::npos) {
+                throw Exception{"JSON string is not closed"};
+            }
+            s.append(text.substr(pos, run_end - pos));
+            pos = run_end + 1;
+            if (text[run_end] == '"') {
+                return s;
+            }
+            if (pos == text.size()) {
+                throw Exception{"JSON string is not closed"};
+            }
+            switch (const char c = text[pos++])
+            {
+            case '"': case '\\': case '/': s += c; break;
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u':
+                {
+                    std::uint32_t code = parse_hex(text, pos);
+                    // A pair of surrogates is one character, a lone one is replaced
+                    if (code >= 0xd800 && code < 0xdc00 && text.substr(pos, 2) == "\\u") {
+                        pos += 2;
+                        const std::uint32_t low = parse_hex(text, pos);
+                        code = low >= 0xdc00 && low < 0xe000
+                            ? 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00)
+                            : 0xfffd;
+                    }
+                    else if (code >= 0xd800 && code < 0xe000) {
+                        code = 0xfffd;
+                    }
+                    append_utf8(s, code);
+                    break;
+                }
+            default:
+                throw Exception{"JSON has a bad escape at ", pos - 1};
+            }
+        }
+    }
+
+    static void dump_value(std::string& text, std::nullptr_t) { text += "null"; }
+    static void dump_value(std::string& text, bool value) { text += value ? "true" : "false"; }
+
+    static void dump_value(std::string& text, double value) {
+        char buffer[32];
+        auto [ptr, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        text.append(buffer, ptr);
+    }
+
+    static void dump_value(std::string& text, const std::string& value) {
+        static constexpr char s_hex[] = "0123456789abcdef";
+        text += '"';
+        for (const char c : value) {
+            switch (c)
+            {
+            case '"': text += "\\\""; break;
+            case '\\': text += "\\\\"; break;
+            case '\n': text += "\\n"; break;
+            case '\r': text += "\\r"; break;
+            case '\t': text += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    text += "\\u00";
+                    text += s_hex[c >> 4];
+                    text += s_hex[c & 0xf];
+                }
+                else {
+                    text += c;
+                }
+            }
+        }
+        text += '"';
+    }
+
+    static void dump_value(std::string& text, const array_t& array) {
+        text += '[';
+        for (std::size_t i = 0; i < array.size(); ++i) {
+            if (i) text += ',';
+            array[i].dump(text);
+        }
+        text += ']';
+    }
+
+    static void dump_value(std::string& text, const object_t& object) {
+        text += '{';
+        for (std::size_t i = 0; i < object.size(); ++i) {
+            if (i) text += ',';
+            dump_value(text, object[i].first);
+            text += ':';
+            object[i].second.dump(text);
+        }
+        text += '}';
+    }
+
+    std::variant<std::nullptr_t, bool, double, std::string, array_t, object_t> m_value = nullptr;
+};
+
+} // ntx
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "exception.hpp"
+#include "incremental.hpp"
+#include "json.hpp"
+#include "ntx.hpp"
+
+
+namespace ntx {
+
+// Messages of the language server protocol as they go over a stream: headers, of
+// which only Content-Length matters, a blank line and then that many bytes of
+// JSON.
+class LspChannel
+{
+public:
+    LspChannel(std::istream& in, std::ostream& out) : m_in{in}, m_out{out} {}
+
+    // Longer than any document an editor would send. A message said to be longer
+    // is skipped rather than read into memory.
+    static constexpr std::size_t s_max_message_size = 256 << 20;
+
+    // The body of the next message, nullopt once the stream has ended
+    std::optional<std::string> read() {
+        std::optional<std::size_t> length;
+        for (std::string header; std::getline(m_in, header);) {
+            if (!header.empty() && header.back() == '\r') {
+                header.pop_back();
+            }
+            if (header.empty()) {
+                if (!length) {
+                    // A message without a length cannot be skipped, only ignored
+                    continue;
+                }
+                if (*length > s_max_message_size) {
+                    static constexpr auto s_max_ignore = static_cast<std::size_t>(std::numeric_limits<std::streamsize>::max());
+                    m_in.ignore(static_cast<std::streamsize>(std::min(*length, s_max_ignore)));
+                    length.reset();
+                    continue;
+                }
+                std::string body(*length, '\0');
+                if (!m_in.read(body.data(), body.size())) {
+                    return std::nullopt;
+                }
+                return body;
+            }
+
+            static constexpr std::string_view s_content_length = "content-length:";
+            if (header.size() > s_content_length.size() &&
+                std::equal(s_content_length.begin(), s_content_length.end(), header.begin(), [](char a, char b) {
+                    return a == std::tolower(static_cast<unsigned char>(b));
+                })) {
+                length = std::strtoull(header.c_str() + s_content_length.size(), nullptr, 10);
+            }
+        }
+        return std::nullopt;
+    }
+
+    void write(const Json& message) {
+        const std::string body = message.dump();
+        m_out << "Content-Length: " << body.size() << "\r\n\r\n" << body << std::flush;
+    }
+
+private:
+    std::istream& m_in;
+    std::ostream& m_out;
+};
+
+
+// Answers an editor over the language server protocol. Each open document is
+// kept as an IncrementalCompile, so a change (which editors send on every
+// keystroke) only converts the source around it again. The server:
+//
+//  - publishes the error compiling a document would give (an IndentationError,
+//    SyntaxError, ...) as a diagnostic on its line, whenever it changes
+//  - answers a hover with the tex of the top level block under the cursor,
+//    compiled on its own, as a live preview of it
+//
+// Everything is on the thread that calls run, one message at a time.
+class LanguageServer
+{
+public:
+    LanguageServer(std::istream& in, std::ostream& out, const CompileSettings& settings = {})
+        : m_channel{in, out}
+        , m_settings{settings}
+    {}
+
+    // Until the editor says to exit (or goes away), returning the exit code
+    int run() {
+        while (auto body = m_channel.read()) {
+            std::optional<Json> message;
+            try {
+                message = Json::parse(*body);
+            }
+            catch (const Exception& e) {
+                reply_error(Json{}, s_parse_error, e.m_message);
+                continue;
+            }
+            if ((*message)["method"].is_string() && (*message)["method"].as_string() == "exit") {
+                return m_is_shut_down ? 0 : 1;
+            }
+            handle(*message);
+        }
+        return m_is_shut_down ? 0 : 1;
+    }
+
+private:
+    // The error codes of JSON-RPC and the protocol
+    static constexpr int s_parse_error = -32700;
+    static constexpr int s_invalid_request = -32600;
+    static constexpr int s_method_not_found = -32601;
+    static constexpr int s_invalid_params = -32602;
+    static constexpr int s_server_not_initialized = -32002;
+
+    struct Document
+    {
+        Json m_version;
+        IncrementalCompile m_compile;
+        // Where each line starts, for turning positions into offsets
+        std::vector<std::size_t> m_line_begins;
+        // The last error published, so that it is only sent again if it changes
+        std::optional<std::string> m_published;
+    };
+
+    void handle(const Json& message) {
+        const Json& method = message["method"];
+        const Json& id = message["id"];
+        if (!method.is_string()) {
+            // A reply, but the server never asks anything
+            return;
+        }
+        const std::string& name = method.as_string();
+        const bool is_request = !id.is_null();
+
+        try {
+            if (name == "initialize") {
+                m_is_initialized = true;
+                reply(id, initialize(message["params"]));
+            }
+            else if (!m_is_initialized) {
+                if (is_request) {
+                    reply_error(id, s_server_not_initialized, "The server has not been initialized");
+                }
+            }
+            else if (m_is_shut_down) {
+                if (is_request) {
+                    reply_error(id, s_invalid_request, "The server has been shut down");
+                }
+            }
+            else if (name == "shutdown") {
+                m_is_shut_down = true;
+                m_documents.clear();
+                reply(id, Json{});
+            }
+            else if (name == "textDocument/didOpen") {
+                did_open(message["params"]["textDocument"]);
+            }
+            else if (name == "textDocument/didChange") {
+                did_change(message["params"]);
+            }
+            else if (name == "textDocument/didClose") {
+                did_close(message["params"]["textDocument"]);
+            }
+            else if (name == "textDocument/hover") {
+                reply(id, hover(message["params"]));
+            }
+            else if (is_request) {
+                reply_error(id, s_method_not_found, "Unknown method '" + name + "'");
+            }
+            // Other notifications ($/..., initialized, didSave, ...) need nothing
+        }
+        catch (const Exception& e) {
+            if (is_request) {
+                reply_error(id, s_invalid_params, e.m_message);
+            }
+            else {
+                std::cerr << "[lsp] " << name << ": " << e.m_message << std::endl;
+            }
+        }
+    }
+
+    Json initialize(const Json& params) {
+        // Positions are counted in UTF-16 code units unless the editor can take
+        // bytes, which need no counting
+        const Json& encodings = params["capabilities"]["general"]["positionEncodings"];
+        if (encodings.is_array()) {
+            for (const auto& encoding : encodings.as_array()) {
+                if (encoding.is_string() && encoding.as_string() == "utf-8") {
+                    m_is_utf8 = true;
+                }
+            }
+        }
+
+        return Json::object_t{
+            {"capabilities", Json::object_t{
+                {"positionEncoding", m_is_utf8 ? "utf-8" : "utf-16"},
+                // Open and close, with changes sent as edits
+                {"textDocumentSync", Json::object_t{{"openClose", true}, {"change", 2}}},
+                {"hoverProvider", true}
+            }},
+            {"serverInfo", Json::object_t{{"name", "ntx"}}}
+        };
+    }
+
+    void did_open(const Json& text_document) {
+        const std::string& uri = text_document["uri"].as_string();
+        auto& document = m_documents.insert_or_assign(uri, Document{
+            text_document["version"],
+            IncrementalCompile{text_document["text"].as_string(), s_checkpoint_lines, m_settings},
+            {},
+            std::nullopt
+        }).first->second;
+        find_line_begins(document);
+        publish(uri, document, true);
+    }
+
+    void did_change(const Json& params) {
+        const std::string& uri = params["textDocument"]["uri"].as_string();
+        auto& document = get_document(uri);
+        for (const auto& change : params["contentChanges"].as_array()) {
+            const std::string& text = change["text"].as_string();
+            if (change["range"].is_null()) {
+                document.m_compile = IncrementalCompile{text, s_checkpoint_lines, m_settings};
+                find_line_begins(document);
+                continue;
+            }
+            const std::size_t begin = offset_of(document, change["range"]["start"]);
+            const std::size_t end = std::max(begin, offset_of(document, change["range"]["end"]));
+            document.m_compile.edit(begin, end, text);
+            move_line_begins(document, begin, end, text);
+        }
+        document.m_version = params["textDocument"]["version"];
+        publish(uri, document, false);
+    }
+
+    void did_close(const Json& text_document) {
+        const std::string& uri = text_document["uri"].as_string();
+        m_documents.erase(uri);
+        // Its errors go with it
+        m_channel.write(Json::object_t{
+            {"jsonrpc", "2.0"},
+            {"method", "textDocument/publishDiagnostics"},
+            {"params", Json::object_t{{"uri", uri}, {"diagnostics", Json::array_t{}}}}
+        });
+    }
+
+    Json hover(const Json& params) {
+        const auto& document = get_document(params["textDocument"]["uri"].as_string());
+        const auto preview = document.m_compile.preview(offset_of(document, params["position"]));
+        const auto& result = preview.m_result;
+        if (result && result.m_tex.find_first_not_of(" \n") == std::string::npos) {
+            return Json{};
+        }
+
+        std::string value;
+        if (result) {
+            const std::string_view tex = std::string_view{result.m_tex}.substr(result.m_tex.find_first_not_of('\n'));
+            value = "```latex\n" + std::string{tex} + (tex.ends_with('\n') ? "```" : "\n```");
+        }
+        else {
+            value = *result.m_error;
+        }
+        return Json::object_t{
+            {"contents", Json::object_t{{"kind", result ? "markdown" : "plaintext"}, {"value", std::move(value)}}},
+            {"range", Json::object_t{
+                {"start", position_of(document, preview.m_begin)},
+                {"end", position_of(document, preview.m_end)}
+            }}
+        };
+    }
+
+    // Sends the document's error (or that it has none) if it is not what was last
+    // sent, or always if asked to
+    void publish(const std::string& uri, Document& document, bool always) {
+        const auto& error = document.m_compile.error();
+        if (!always && error == document.m_published) {
+            return;
+        }
+        document.m_published = error;
+
+        Json::array_t diagnostics;
+        if (error) {
+            // The editor has the line, so the "[line:column] " is left out
+            std::size_t line = get_error_line(*error);
+            line = line ? line - 1 : 0;
+            std::string_view message = *error;
+            if (const std::size_t close = message.find("] "); message.starts_with('[') && close != std::string_view::npos) {
+                message.remove_prefix(close + 2);
+            }
+            line = std::min(line, document.m_line_begins.size() - 1);
+
+            diagnostics.push_back(Json::object_t{
+                {"range", Json::object_t{
+                    {"start", position_of(document, document.m_line_begins[line])},
+                    {"end", position_of(document, line_end(document, line))}
+                }},
+                {"severity", 1},
+                {"source", "ntx"},
+                {"message", message}
+            });
+        }
+
+        m_channel.write(Json::object_t{
+            {"jsonrpc", "2.0"},
+            {"method", "textDocument/publishDiagnostics"},
+            {"params", Json::object_t{
+                {"uri", uri},
+                {"version", document.m_version},
+                {"diagnostics", std::move(diagnostics)}
+            }}
+        });
+    }
+
+    Document& get_document(const std::string& uri) {
+        auto it = m_documents.find(uri);
+        if (it == m_documents.end()) {
+            throw Exception{"Document '", uri, "' is not open"};
+        }
+        return it->second;
+    }
+
+    static void find_line_begins(Document& document) {
+        const auto& source = document.m_compile.source();
+        document.m_line_begins.assign(1, 0);
+        for (std::size_t pos = source.find('\n'); pos != std::string::npos; pos = source.find('\n', pos + 1)) {
+            document.m_line_begins.push_back(pos + 1);
+        }
+    }
+
+    // After [begin, end) of the source was replaced with text
+    static void move_line_begins(Document& document, std::size_t begin, std::size_t end, std::string_view text) {
+        auto& line_begins = document.m_line_begins;
+        const auto first = std::upper_bound(line_begins.begin(), line_begins.end(), begin);
+        const auto last = std::upper_bound(first, line_begins.end(), end);
+        const std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(text.size()) - static_cast<std::ptrdiff_t>(end - begin);
+        for (auto it = last; it != line_begins.end(); ++it) {
+            *it += delta;
+        }
+
+        std::vector<std::size_t> added;
+        for (std::size_t pos = text.find('\n'); pos != std::string_view::npos; pos = text.find('\n', pos + 1)) {
+            added.push_back(begin + pos + 1);
+        }
+        line_begins.insert(line_begins.erase(first, last), added.begin(), added.end());
+    }
+
+    static std::size_t line_end(const Document& document, std::size_t line) {
+        return line + 1 < document.m_line_begins.size()
+            ? document.m_line_begins[line + 1] - 1
+            : document.m_compile.source().size();
+    }
+
+    // The bytes of a UTF-8 character from its first, one for a stray continuation
+    static std::size_t utf8_length(char first) {
+        const auto c = static_cast<unsigned char>(first);
+        return c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    }
+
+    // A position (line and character) as an offset into the source, clamped to
+    // the end of its line as the protocol asks
+    std::size_t offset_of(const Document& document, const Json& position) const {
+        const std::size_t line = position.as_count("line");
+        const auto& source = document.m_compile.source();
+        if (line >= document.m_line_begins.size()) {
+            return source.size();
+        }
+        const std::size_t begin = document.m_line_begins[line];
+        const std::size_t end = line_end(document, line);
+        const std::size_t character = position.as_count("character");
+        if (m_is_utf8) {
+            return std::min(begin + character, end);
+        }
+
+        std::size_t pos = begin;
+        for (std::size_t units = 0; pos < end && units < character;) {
+            const std::size_t length = utf8_length(source[pos]);
+            units += length == 4 ? 2 : 1;
+            pos += length;
+        }
+        return std::min(pos, end);
+    }
+
+    Json position_of(const Document& document, std::size_t offset) const {
+        const auto& line_begins = document.m_line_begins;
+        const std::size_t line = std::upper_bound(line_begins.begin(), line_begins.end(), offset) - line_begins.begin() - 1;
+        std::size_t character = offset - line_begins[line];
+        if (!m_is_utf8) {
+            const auto& source = document.m_compile.source();
+            character = 0;
+            for (std::size_t pos = line_begins[line]; pos < offset; pos += utf8_length(source[pos])) {
+                character += utf8_length(source[pos]) == 4 ? 2 : 1;
+            }
+        }
+        return Json::object_t{{"line", line}, {"character", character}};
+    }
+
+    void reply(const Json& id, Json result) {
+        m_channel.write(Json::object_t{{"jsonrpc", "2.0"}, {"id", id}, {"result", std::move(result)}});
+    }
+
+    void reply_error(const Json& id, int code, std::string_view message) {
+        m_channel.write(Json::object_t{
+            {"jsonrpc", "2.0"},
+            {"id", id},
+            {"error", Json::object_t{{"code", code}, {"message", message}}}
+        });
+    }
+
+    LspChannel m_channel;
+    CompileSettings m_settings;
+
+    bool m_is_initialized = false;
+    bool m_is_shut_down = false;
+    bool m_is_utf8 = false;
+
+    std::unordered_map<std::string, Document> m_documents;
+};
+
+} // ntx
@@ -1,1028 +1,1046 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
-#include <deque>
-#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory_resource>
+#include <mutex>
 #include <iostream>
 #include <fstream>
-#include <regex>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <sstream>
-#include <variant>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <boost/program_options.hpp>
 
+#include "arena.hpp"
+#include "blox.hpp"
+#include "cache.hpp"
+#include "detextion.hpp"
+#include "exception.hpp"
+#include "hash.hpp"
+#include "lsp.hpp"
+#include "ntx.hpp"
+#include "pool.hpp"
+#include "serve.hpp"
+#include "token_cache.hpp"
 #include "version.hpp"
+#include "watch.hpp"
 
 
 namespace ntx {
 
-struct Exception : public std::exception
+// The bytes of an ntx file. Regular files are memory mapped so that lexing never
+// copies the source, anything else (pipes, ...) is read into memory. A mapped file
+// that is truncated or written over in place while it is in use kills the process
+// with SIGBUS (or changes under the tokens), so a process that stays running
+// reads them too (map is false).
+class SourceFile
 {
-    Exception() : std::exception{}, m_message{} {}
-    
-    template <typename... Ts>
-    explicit Exception(Ts... args)
-        : std::exception{}
-        , m_message{
-            std::invoke(
-                [&]() -> std::string
-                {
-                    std::stringstream s;
-                    (s << ... << args);
-                    return s.str();
-                }
-            )
+public:
+    explicit SourceFile(const std::string& f_name, bool map = true) {
+        int fd = ::open(f_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw Exception{"Cannot open file '", f_name, "'"};
         }
-    { }
-
-    std::string m_message;
-};
-
-
-namespace patterns {
-
-static const std::regex tag{"^% TAG (.+)"};
-static const std::regex cmd{"^% CMD (.+) (.+)"};
-static const std::regex env_decl{"^[ ]*\\\\([A-z]+)[ ]*([^ ]*)"};
-static const std::regex section_def{"^[ ]*\\\\([A-z]+)[ ]*(.*)"};
 
-} // patterns
-
-
-struct LineBreak
-{
-    std::size_t m_line_number;
-
-    bool is_empty;
-    std::size_t m_indent;
-};
+        struct stat st;
+        if (map && ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+                m_mapped = {static_cast<const char*>(data), static_cast<std::size_t>(st.st_size)};
+            }
+        }
 
+        if (!m_mapped.data()) {
+            char buffer[1 << 16];
+            ssize_t n;
+            while ((n = ::read(fd, buffer, sizeof(buffer))) != 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    ::close(fd);
+                    throw Exception{"Cannot read file '", f_name, "'"};
+                }
+                m_owned.append(buffer, n);
+            }
+        }
+        ::close(fd);
+    }
 
-enum class EnvironmentType
-{
-    Section,
-    PlainText,
-    MathBlock,
-    MathInline,
-    Array,
-    ListItem
-};
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator = (const SourceFile&) = delete;
 
-std::ostream& operator << (std::ostream& os, EnvironmentType e_type) {
-    switch (e_type) {
-    case EnvironmentType::Section:
-        os << "Section";
-        break;
-    case EnvironmentType::PlainText:
-        os << "PlainText";
-        break;
-    case EnvironmentType::MathBlock:
-        os << "MathBlock";
-        break;
-    case EnvironmentType::MathInline:
-        os << "MathInline";
-        break;
-    case EnvironmentType::Array:
-        os << "Array";
-        break;
-    case EnvironmentType::ListItem:
-        os << "ListItem";
-        break;
-    default:
-        assert(false);
+    ~SourceFile() {
+        if (m_mapped.data()) {
+            ::munmap(const_cast<char*>(m_mapped.data()), m_mapped.size());
+        }
     }
 
-    return os;
-}
-
-struct EnvironmentDecleration
-{
-    std::size_t m_line_number;
+    std::string_view view() const {
+        return m_mapped.data() ? m_mapped : std::string_view{m_owned};
+    }
 
-    EnvironmentType m_type;
-    std::string m_name;
-    std::string m_label;
+private:
+    std::string_view m_mapped = {};
+    std::string m_owned = {};
 };
 
-struct Element
-{
-    std::size_t m_line_number;
-    std::size_t m_line_pos;
-
-    //std::size_t m_sentence_pos;
-
-    // These could all be smaller
-    std::size_t m_open_b_round;
-    std::size_t m_open_b_square;
-    std::size_t m_open_b_curly;
-
-    std::size_t n_lower_case;
-    std::size_t n_upper_case;
-    std::size_t n_numerals;
 
-    std::string m_data;
-};
+std::string get_ntx_info() {
 
+    std::time_t now = std::time(nullptr);
 
-using element_v = std::variant<LineBreak, EnvironmentDecleration, Element>;
+    // The _r versions as files may be compiled on several threads at once
+    std::tm tm;
+    char buffer[32];
 
+    std::stringstream ss;
+    ss << "\n\n% "
+       << "ntx["
+       << NTX_VERSION_MAJOR
+       << ":"
+       << NTX_VERSION_MINOR
+       << "] - compiled @ "
+       << ::asctime_r(::gmtime_r(&now, &tm), buffer);
 
-std::size_t get_line_number(const element_v& element) {
-    return std::visit([](auto&& a) { return a.m_line_number; }, element);
+    return ss.str();
 }
 
+// As above but the same every time for the same source, so that unchanged notes
+// give byte for byte the same tex
+std::string get_ntx_info(std::uint64_t source_hash) {
+    std::stringstream ss;
+    ss << "\n\n% "
+       << "ntx["
+       << NTX_VERSION_MAJOR
+       << ":"
+       << NTX_VERSION_MINOR
+       << "] - source "
+       << to_hex(source_hash)
+       << "\n";
 
-using env_data_t = std::tuple<EnvironmentType, std::string>;
-
-static const std::unordered_map<std::string, env_data_t> s_environments = {
-    {"proof",         {EnvironmentType::PlainText, "proof"}},
-    {"thm",           {EnvironmentType::PlainText, "theorem"}},
-    {"theorem",       {EnvironmentType::PlainText, "theorem"}},
-    {"lemma",         {EnvironmentType::PlainText, "lemma"}},
-    {"corollary",     {EnvironmentType::PlainText, "corollary"}},
-    {"prop",          {EnvironmentType::PlainText, "proposition"}},
-    {"proposition",   {EnvironmentType::PlainText, "proposition"}},
-    {"construction",  {EnvironmentType::PlainText, "construction"}},
-    {"eq",            {EnvironmentType::MathBlock, "equation"}},
-    {"equation",      {EnvironmentType::MathBlock, "equation"}},
-    {"section",       {EnvironmentType::Section, "section"}},
-    {"subsection",    {EnvironmentType::Section,"subsection"}},
-    {"subsubsection", {EnvironmentType::Section,"subsubsection"}},
-};
+    return ss.str();
+}
 
 
-struct BlockElement
-{
-    std::string m_data;
-};
+void print_tokens(const Tokens& tokens, std::ostream& os) {
+    using namespace std;
 
-struct Block
-{
-    EnvironmentType m_type;
+    // Elements print their position in the line, which is relative to the line
+    // break that starts it
+    size_t line_begin = 0;
+    for (size_t pos = 0; pos < tokens.size(); ++pos) {
+        switch (tokens.kind(pos))
+        {
+        case TokenKind::LineBreak:
+        case TokenKind::BlankLine:
+            {
+                const auto a = tokens.line_break(pos);
+                line_begin = tokens.begin(pos);
+                os << "["
+                   << a.m_line_number
+                   << "]  LineBreak{is_empty="
+                   << a.is_empty
+                   << ", indent="
+                   << a.m_indent
+                   << "}\n";
+                break;
+            }
+        case TokenKind::EnvironmentDecleration:
+            {
+                const auto& a = tokens.environment_decleration(pos);
+                os << "["
+                   << a.m_line_number
+                   << "]  EnvironmentDecleration{name="
+                   << a.m_environment->m_name
+                   << ", label="
+                   << a.m_label
+                   << "}\n";
+                break;
+            }
+        case TokenKind::Element:
+            {
+                const auto a = tokens.element(pos);
+                os << "["
+                   << a.m_line_number
+                   << ":"
+                   << tokens.begin(pos) - line_begin
+                   << "]  Element{open_b_round="
+                   << a.m_open_b_round
+                   << ", open_b_square="
+                   << a.m_open_b_square
+                   << ", open_b_curly="
+                   << a.m_open_b_curly
+                   << ", n_lower_case="
+                   << a.n_lower_case
+                   << ", n_upper_case="
+                   << a.n_upper_case
+                   << ", n_numerals="
+                   << a.n_numerals
+                   << ", data=\""
+                   << a.m_data
+                   << "\"}\n";
+                break;
+            }
+        }
+    }
+}
 
-    std::size_t m_indent;
 
-    std::size_t m_initial_pos;
+// Everything other than the source that its tex depends on, for keying the cache:
+// the version (which decides the built-in environments) and those of the added
+// environments the source could declare. The ones it declares itself are in the
+// source, so only its own tex changes with them.
+std::uint64_t get_compile_salt(std::string_view source) {
+    static const std::uint64_t version_salt = std::invoke([]() {
+        std::stringstream ss;
+        ss << "ntx[" << NTX_VERSION_MAJOR << ":" << NTX_VERSION_MINOR << "]\n";
+        return hash_bytes(ss.str());
+    });
+
+    // What a declaration of each looks for, and what it is salted with. Sorted so
+    // that the order they were added in does not matter.
+    struct Added
+    {
+        std::string m_declaration;
+        std::string m_entry;
+    };
+    static const std::vector<Added> added = std::invoke([]() {
+        std::vector<Added> out;
+        for (const auto* environment : s_environments.added()) {
+            std::stringstream entry;
+            entry << environment->m_short_name << "=" << to_string(environment->m_type) << ":" << environment->m_name << "\n";
+            out.push_back({"\\" + std::string{environment->m_short_name}, entry.str()});
+        }
+        std::sort(out.begin(), out.end(), [](const Added& a, const Added& b) { return a.m_entry < b.m_entry; });
+        return out;
+    });
+
+    // A mention that declares nothing only costs a miss when the environment
+    // changes
+    std::string used;
+    for (const auto& environment : added) {
+        if (source.find(environment.m_declaration) != std::string_view::npos) {
+            used += environment.m_entry;
+        }
+    }
+    return used.empty() ? version_salt : hash_bytes(used, version_salt);
+}
 
-    std::string m_name;
-    std::string m_label;
+struct CompileOptions
+{
+    bool m_stream = false;
+    bool m_debug = false;
+    bool m_alloc_stats = false;
 
-    // FIXME - can we get away with just the initial pos here and only write
-    // the data on completion (or maybe srting_views rather than strings...)
-    std::vector<BlockElement> m_data = {};
+    enum class StatsFormat
+    {
+        None,
+        Text,
+        Json
+    };
+    // Time per phase and what was made for each file
+    StatsFormat m_stats = StatsFormat::None;
+    // Memory per phase and structure for each file. Like --alloc-stats a big file
+    // is not split, so that all its memory is counted.
+    bool m_mem_stats = false;
+
+    // The arena for each file, and the threads a big file is split between when
+    // not streaming. Only the lexing is split for --debug and --token-cache, which
+    // need the tokens, and nothing is for --alloc-stats, which needs the one arena.
+    CompileSettings m_settings;
+
+    // Not used for --debug, as that needs the tokens, or --stats, as that needs
+    // the compile
+    CompileCache* m_cache = nullptr;
+
+    // Footer with a hash of the source rather than the time
+    bool m_deterministic = false;
+    // Leave the output (and so its mtime) alone if it already holds the tex
+    bool m_write_if_changed = false;
+    // Convert from the tokens saved beside each file (its .ntxc) while the file
+    // is unchanged, saving them when it is not. Not used when streaming, which
+    // lexes a line at a time.
+    bool m_token_cache = false;
+    // Only find out whether each file compiles, writing no tex
+    bool m_check = false;
+    // Read the sources rather than mapping them (see SourceFile), for --watch and
+    // --serve, which compile files while they are being saved
+    bool m_read_sources = false;
 };
 
-template <typename T, typename... Ts>
-bool contains_any_of(const std::string& s, T c, Ts... cs) {
-    bool out = s.find(c) != std::string::npos;
-    if constexpr (sizeof...(Ts) > 0) {
-        return out || contains_any_of(s, cs...);
+// Whether the file at path holds exactly data
+bool file_equals(const std::string& path, std::string_view data) {
+    std::error_code ec;
+    if (std::filesystem::file_size(path, ec) != data.size() || ec) {
+        return false;
     }
-    else {
-        return out;
+    try {
+        SourceFile existing{path};
+        return existing.view() == data;
+    }
+    catch (const Exception&) {
+        return false;
     }
 }
 
-template <typename T, typename... Ts>
-bool starts_with_any_of(const std::string& s, T t, Ts... ts) {
-    if constexpr (sizeof...(Ts) > 0) {
-        return s.starts_with(t) || starts_with_any_of(s, ts...);
-    }
-    else {
-        return s.starts_with(t);
+void write_output(const std::string& path, std::string_view data, bool if_changed) {
+    if (if_changed && file_equals(path, data)) {
+        return;
     }
+    std::ofstream file{path, std::ios::binary};
+    file.write(data.data(), data.size());
 }
 
+// The .ntxc file the tokens of the ntx file in are saved to
+std::filesystem::path token_cache_path(const std::string& in) {
+    return std::filesystem::path{in}.replace_extension(".ntxc");
+}
 
-template <typename T, typename... Ts>
-bool ends_with_any_of(const std::string& s, T t, Ts... ts) {
-    if constexpr (sizeof...(Ts) > 0) {
-        return s.ends_with(t) || ends_with_any_of(s, ts...);
+// The tokens saved at path, if they are of this source (with this key)
+std::optional<Tokens> load_token_cache(
+    const std::filesystem::path& path,
+    std::string_view source,
+    std::uint64_t source_key,
+    const Environments& environments,
+    std::pmr::memory_resource* resource) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec)) {
+        return std::nullopt;
     }
-    else {
-        return s.ends_with(t);
+    try {
+        SourceFile file{path.string()};
+        return load_tokens(file.view(), source, source_key, environments, resource);
+    }
+    catch (const Exception&) {
+        return std::nullopt;
     }
 }
 
-
-std::string get_clean_view(
-    const std::string& word,
-    const BlockElement* next) {
-    if (!next) {
-        // last element just return it
-        return word;
+// Written to a temporary file and renamed into place, so that another compile of
+// the same file never reads half of it. Failing to save (say the directory is
+// read only) only means lexing again next time.
+void save_token_cache(const std::filesystem::path& path, const Tokens& tokens, std::uint64_t source_key) {
+    const auto writer = hash_bytes(
+        std::to_string(::getpid()),
+        std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    auto tmp = path;
+    tmp += "." + to_hex(writer) + ".tmp";
+
+    const std::string data = save_tokens(tokens, source_key);
+    {
+        std::ofstream file{tmp, std::ios::binary};
+        file.write(data.data(), data.size());
+        if (!file) {
+            return;
+        }
     }
-
-    const auto& w_next = next->m_data;
-
-    if (ends_with_any_of(word, '{', '[', '(', '"', '\'', '\n') ||
-        starts_with_any_of(w_next, '}', ']', ')', '.', ',', ';', ':', '"', '\'') ||
-        (word.starts_with('\\') && starts_with_any_of(w_next, '{', '[', '('))){
-        return word;
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
     }
-
-    return word + ' ';
 }
 
-std::vector<std::string> amalgamate_block(const Block& block) {
-    std::vector<std::string> amalgamates = {std::string{}};
-    // Common views
-    auto clean_view_f = [&](const auto& data_raw, std::size_t n_data) {
-            // Drop all terminal new lines (we will add them back)
-            for (auto it = data_raw.rbegin(); it != data_raw.rend() && it->m_data == "\n"; ++it) {
-                --n_data;
-            }
-
-            for (std::size_t pos = 0; pos < n_data; ++pos) {
-                amalgamates.front() += get_clean_view(
-                    data_raw[pos].m_data,
-                    pos + 1 < n_data ? &data_raw[pos + 1] : nullptr);
-            }
+void print_alloc_stats(const Arena& arena, std::ostream& os) {
+    os << "[alloc] requested "
+       << arena.requests().m_n_allocations
+       << " allocations ("
+       << arena.requests().m_n_bytes
+       << " bytes), of which "
+       << arena.heap().m_n_allocations
+       << " went to the heap ("
+       << arena.heap().m_n_bytes
+       << " bytes)"
+       << std::endl;
+}
 
-            for (; n_data < data_raw.size(); ++n_data) {
-                amalgamates.emplace_back("\n");
-            }
+void print_stats(const CompileStats& compile_stats, std::ostream& os) {
+    auto ms_f = [](std::chrono::nanoseconds t) {
+        return std::chrono::duration<double, std::milli>(t).count();
     };
-    
-    const auto& data = block.m_data;
-
-    switch (block.m_type)
-    {
-    case EnvironmentType::PlainText:
-        {
-            if (block.m_name.length()) {
-                amalgamates.front() += "\n\\begin{" + block.m_name + "}\n";
-                if (block.m_label.length()) {
-                    amalgamates.front() += "\\label{" + block.m_label + "}\n";
-                }
-            }
-
-            clean_view_f(data, data.size());
 
-            if (block.m_name.length()) {
-                amalgamates.front() += "\n\\end{" + block.m_name + "}\n";
-            }
-            break;
-        }
-    case EnvironmentType::MathBlock:
-        {
-            bool has_label = block.m_label.length();
-            std::string name = has_label ? "equation" : "equation*";
-            amalgamates.front() += "\n\\begin{" + name + "}\n";
-            if (has_label) {
-                amalgamates.front() += "\\label{" + block.m_label + "}\n";
-            }
-
-            clean_view_f(data, data.size());
+    os << "[stats]";
+    for (std::size_t i = 0; i < s_n_phases; ++i) {
+        const auto phase = static_cast<Phase>(i);
+        os << (i ? ", " : " ") << to_string(phase) << " " << ms_f(compile_stats.time(phase)) << "ms";
+    }
+    os << "\n[stats] tokens";
+    for (std::size_t i = 0; i < s_n_token_kinds; ++i) {
+        os << (i ? ", " : " ") << to_string(static_cast<TokenKind>(i)) << "=" << compile_stats.m_n_tokens[i];
+    }
+    os << "\n[stats] blocks";
+    for (std::size_t i = 0; i < s_n_environment_types; ++i) {
+        os << (i ? ", " : " ") << to_string(static_cast<EnvironmentType>(i)) << "=" << compile_stats.m_n_blocks[i];
+    }
+    os << "\n[stats] peak history depth "
+       << compile_stats.m_peak_history_depth
+       << ", "
+       << compile_stats.m_n_output_bytes
+       << " bytes output"
+       << std::endl;
+}
 
-            amalgamates.front() += "\n\\end{" + name + "}\n";
-            break;
-        }
-    case EnvironmentType::MathInline:
-        {
-            amalgamates.front() += "$";
-            assert (!data.empty());
-            if (const auto& s = data.back().m_data; ends_with_any_of(s, ';', ',', '.', ':')) {
-                clean_view_f(data, data.size() - 1);
-                amalgamates.front() += s.substr(0, s.length() - 1) + "$";
-                amalgamates.insert(amalgamates.begin() + 1, std::string{s[s.length() - 1]});
-            }
-            else {
-                clean_view_f(data, data.size());
-                amalgamates.front() += "$";
-            }
-            break;
+void print_memory_stats(const MemoryStats& memory, std::ostream& os) {
+    auto counts_f = [&](std::string_view name, const AllocationCounts& counts, bool with_peak) {
+        os << "[mem] "
+           << name
+           << " "
+           << counts.m_n_allocations
+           << " allocations ("
+           << counts.m_n_bytes
+           << " bytes)";
+        if (with_peak) {
+            os << ", peak " << counts.m_peak_bytes << " bytes";
         }
-    case EnvironmentType::Array:
-        {
-            std::size_t max_row_length = 0;
-            std::size_t current_row_length = 0;
-            
-            for (const auto& e : block.m_data) {
-                if (e.m_data.ends_with(';')) {
-                    max_row_length = std::max(max_row_length, current_row_length + (e.m_data.length() > 1));
-                    current_row_length = 0;
-                }
-                else {
-                    ++current_row_length;
-                }
-            }
-
-            max_row_length = std::max(max_row_length, current_row_length);
-            current_row_length = 0;
+        os << "\n";
+    };
 
-            amalgamates.front() += "\\left\\( \\begin{array}{" + std::string(max_row_length, 'c') + "} ";
-            for (const auto& e : block.m_data) {
-                if (e.m_data.ends_with(';')) {
-                    if (auto n_e = e.m_data.length(); n_e > 1) {
-                        amalgamates.front() += e.m_data.substr(0, n_e - 1) + " ";
-                    }
-                    amalgamates.front() += "// ";
-                    current_row_length = 0;
-                }
-                else {
-                    amalgamates.front() += e.m_data + (++current_row_length < max_row_length ? " & " : " ");
-                }
-            }
-            amalgamates.front() += "\\end{array} \\right\\)";
-            break;
-        }
-    case EnvironmentType::ListItem:
-        {
-            if (block.m_label == "first") {
-                amalgamates.back() += "\n\\begin{enumerate}";
-            }
-            amalgamates.back() += '\n' + block.m_name + ' ';
-            clean_view_f(data, data.size());
-            if (block.m_label == "first") {
-                amalgamates.back() += "\n\\end{enumerate}";
-            }
-            break;
-        }
-    default:
-        // Section
-        assert(false);
+    for (std::size_t i = 0; i < s_n_phases; ++i) {
+        counts_f(to_string(static_cast<Phase>(i)), memory.m_phases[i], false);
     }
-    return amalgamates;
-}
-
-void push_last_block(std::deque<Block>& history) {
-    // FIXME - check that all brackets are closed...
-    auto& block = history.back();
-    auto amalgamated = amalgamate_block(block);
-    history.pop_back();
-    std::transform(
-        amalgamated.begin(),
-        amalgamated.end(),
-        std::back_inserter(history.back().m_data),
-        [](auto&& a) { return BlockElement{a}; }
-    );
+    for (std::size_t i = 0; i < s_n_structures; ++i) {
+        counts_f(to_string(static_cast<Structure>(i)), memory.m_structures[i], true);
+    }
+    counts_f("total", memory.m_total, true);
+    os << "[mem] peak resident " << memory.m_peak_resident_bytes << " bytes" << std::endl;
 }
 
-using item_label_t = std::tuple<std::string, std::size_t /* end of label */>;
+// As print_stats but one JSON object per file, on a line of its own
+void print_stats_json(const std::string& in, const CompileStats& compile_stats, std::ostream& os) {
+    auto ms_f = [](std::chrono::nanoseconds t) {
+        return std::chrono::duration<double, std::milli>(t).count();
+    };
 
-std::optional<item_label_t> try_get_item_label(
-    std::size_t pos,
-    const std::vector<element_v>& elements) {
-    if (pos == 0 || !std::holds_alternative<LineBreak>(elements[pos - 1])) {
-        return std::nullopt;
+    // A file name is the only thing that could need escaping
+    os << "{\"file\":\"";
+    for (char c : in) {
+        if (c == '"' || c == '\\') os << '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) os << c;
     }
-
-    //    * ...
-    if (std::holds_alternative<Element>(elements[pos]) &&
-        std::get<Element>(elements[pos]).m_data == "*") {
-        return item_label_t{"\\item", pos + 1};
+    os << "\",\"phases_ms\":{";
+    for (std::size_t i = 0; i < s_n_phases; ++i) {
+        const auto phase = static_cast<Phase>(i);
+        os << (i ? "," : "") << "\"" << to_string(phase) << "\":" << ms_f(compile_stats.time(phase));
     }
-
-    // [[ {some labelling} ]] ...
-    {
-        std::size_t stage = 0;
-        bool matched = false;
-        std::string label = "";
-        std::size_t offset = 0;
-        for (; pos + offset < elements.size(); ++offset) {
-            if (!std::holds_alternative<Element>(elements[pos + offset])) {
-                goto escape_loop;
-            }
-            const auto& s = std::get<Element>(elements[pos + offset]).m_data;
-            switch (stage)
-            {
-            case 0:
-            case 1:
-                {
-                    if (s == "[") { ++stage; }
-                    else { goto escape_loop; }
-                    break;
-                }
-            case 2:
-                if (s == "]") { ++stage; }
-                else { label += (label.length() ? " " : "") + s; }
-                break;
-            case 3:
-                {
-                    if (s == "]") { matched = true; }
-                    else { goto escape_loop; }
-                    break;
-                }
+    os << "},\"tokens\":{";
+    for (std::size_t i = 0; i < s_n_token_kinds; ++i) {
+        os << (i ? "," : "") << "\"" << to_string(static_cast<TokenKind>(i)) << "\":" << compile_stats.m_n_tokens[i];
+    }
+    os << "},\"blocks\":{";
+    for (std::size_t i = 0; i < s_n_environment_types; ++i) {
+        os << (i ? "," : "") << "\"" << to_string(static_cast<EnvironmentType>(i)) << "\":" << compile_stats.m_n_blocks[i];
+    }
+    os << "},\"peak_history_depth\":"
+       << compile_stats.m_peak_history_depth
+       << ",\"output_bytes\":"
+       << compile_stats.m_n_output_bytes;
+
+    if (const auto& memory = compile_stats.m_memory) {
+        auto counts_f = [&](std::string_view name, const AllocationCounts& counts, bool with_peak) {
+            os << "\"" << name << "\":{\"allocations\":" << counts.m_n_allocations << ",\"bytes\":" << counts.m_n_bytes;
+            if (with_peak) {
+                os << ",\"peak_bytes\":" << counts.m_peak_bytes;
             }
+            os << "}";
+        };
+
+        os << ",\"memory\":{\"phases\":{";
+        for (std::size_t i = 0; i < s_n_phases; ++i) {
+            os << (i ? "," : "");
+            counts_f(to_string(static_cast<Phase>(i)), memory->m_phases[i], false);
         }
-        escape_loop:
-        if (matched) {
-            // FIXME - what if the label needs to be in mathmode...
-            return item_label_t{"\\item[" + label + "]", pos + offset + 1};
+        os << "},\"structures\":{";
+        for (std::size_t i = 0; i < s_n_structures; ++i) {
+            os << (i ? "," : "");
+            counts_f(to_string(static_cast<Structure>(i)), memory->m_structures[i], true);
         }
+        os << "},";
+        counts_f("total", memory->m_total, true);
+        os << ",\"peak_resident_bytes\":" << memory->m_peak_resident_bytes << "}";
     }
-
-    return std::nullopt;
+    os << "}" << std::endl;
 }
 
-
-bool cannot_take(const std::string& s) {
-    return s.find_first_of("}])") != std::string::npos;
+// The errors of a failed compile, a line each
+std::string get_errors_message(const CompileResult& result) {
+    std::string message;
+    for (const auto& error : result.m_errors) {
+        if (!message.empty()) {
+            message += '\n';
+        }
+        message += error;
+    }
+    return message;
 }
 
+// Compiles the file in to out, or to stdout if out is not set. Errors and the
+// debug output are written to log, the allocation and compile stats to stats.
+// Returns false if the file could not be compiled.
+bool compile_file(
+    const std::string& in,
+    const std::optional<std::string>& out,
+    const CompileOptions& options,
+    std::ostream& log,
+    std::ostream& stats) {
+
+    auto fatal_f = [&](const std::string& message) {
+        log << message << std::endl;
+        log << "[FATAL] Cannot continue compiling" << std::endl;
+        return false;
+    };
 
-std::size_t take_at_least_one(const std::vector<BlockElement>& history) {
-    using namespace std;
-
-    size_t n_history = history.size();
-    if (!n_history || cannot_take(history[n_history - 1].m_data)) return 0;
-
-    // TODO - do I ever need to take more?
-    return 1;
-}
+    Trace* trace = options.m_settings.m_trace;
+    Span file_span{trace, "compile_file", nullptr, in};
 
+    CompileStats compile_stats;
+    if (options.m_mem_stats) {
+        compile_stats.m_memory.emplace();
+    }
+    CompileStats* stats_ptr = options.m_stats != CompileOptions::StatsFormat::None || options.m_mem_stats
+        ? &compile_stats
+        : nullptr;
+    auto print_stats_f = [&]() {
+        if (auto& memory = compile_stats.m_memory) {
+            rusage usage;
+            if (::getrusage(RUSAGE_SELF, &usage) == 0) {
+                memory->m_peak_resident_bytes = static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+            }
+        }
 
-std::optional<std::size_t> start_math_inline(
-    const Element& element,
-    const std::vector<BlockElement>& history) {
+        if (options.m_stats == CompileOptions::StatsFormat::Json) {
+            print_stats_json(in, compile_stats, stats);
+            return;
+        }
+        if (options.m_stats == CompileOptions::StatsFormat::Text) {
+            print_stats(compile_stats, stats);
+        }
+        if (compile_stats.m_memory) {
+            print_memory_stats(*compile_stats.m_memory, stats);
+        }
+    };
 
-    using namespace std;
-    const auto& s = element.m_data;
-    switch (s.length())
-    {
-    case 0:
-        return std::nullopt;
-    case 1:
+    std::optional<std::string> tex_data;
+    try {
+        std::optional<SourceFile> source_file;
         {
-            char c = s[0];
-            if (element.n_numerals) return nullopt;
-            if (element.n_lower_case) return c == 'a' ? nullopt : optional<size_t>{0};
-            if (element.n_upper_case) return c == 'I' ? nullopt : optional<size_t>{0};
-            if (c =='[' || c == '{') return 0;
-            if (c == '=' || c == '-' || c == '+' || c =='/' || c =='*' || c == '^' || c == '_' ||
-                c == '<' || c == '>') {
-                return take_at_least_one(history);
-            }
-            return nullopt;
+            Span span{trace, "read", phase_time(stats_ptr, Phase::Read)};
+            source_file.emplace(in, !options.m_read_sources);
         }
-    case 2:
-        {
-            // FIXME - do we want to check if closing
-            if (element.n_lower_case == 0) {
-                return 0;
-            }
-            else if (element.n_lower_case == 1) {
-                if (element.n_upper_case) return s[0] > s[1] ? optional<size_t>{0} : nullopt;
-                return 0;
+        const SourceFile& source = *source_file;
+
+        if (options.m_check) {
+            CompileSettings settings = options.m_settings;
+            settings.m_stats = stats_ptr;
+            if (auto result = check(source.view(), settings); !result) {
+                throw Exception{get_errors_message(result)};
             }
-            return nullopt;
+            print_stats_f();
+            return true;
         }
-    default:
-        {
-            if (cannot_take(s)) {
-                return nullopt;
-            }
-            if (s.find_first_of("\\[{^_") != string::npos) {
-                // TODO - If s starts with a take one character then take at least one
-                return 0;
+
+        // Identifies the source and everything else the tex depends on
+        const std::uint64_t compile_salt = get_compile_salt(source.view());
+        const std::uint64_t source_hash = hash_bytes(source.view(), compile_salt);
+        const std::string footer = options.m_deterministic ? get_ntx_info(source_hash) : get_ntx_info();
+
+        // A hit means there is no need to lex the source at all. The tex is cached
+        // without its footer, which is made afresh, so that a timestamp is always
+        // of when the output was written.
+        CompileCache* cache = options.m_debug || stats_ptr ? nullptr : options.m_cache;
+        const std::uint64_t cache_key = CompileCache::make_key(source.view(), compile_salt);
+        if (cache) {
+            if (out && !options.m_write_if_changed) {
+                if (cache->copy_to(cache_key, *out)) {
+                    std::ofstream file{*out, std::ios::binary | std::ios::app};
+                    file << footer;
+                    return true;
+                }
             }
-            if (((element.n_upper_case + element.n_lower_case) == 1) &&
-                contains_any_of(element.m_data, '+', '-', '/', '*')) {
-                return 0;
+            else if (auto cached = cache->find(cache_key)) {
+                SourceFile cached_file{cached->string()};
+                if (out) {
+                    std::string data{cached_file.view()};
+                    data += footer;
+                    write_output(*out, data, options.m_write_if_changed);
+                }
+                else {
+                    std::cout << cached_file.view() << footer;
+                }
+                return true;
             }
         }
-    }
-    return std::nullopt;
-}
 
-std::optional<std::size_t> read_math_inline(
-    std::size_t pos,
-    std::size_t initial_pos, /*where did the math inline block start*/
-    const std::vector<element_v>& elements,
-    std::vector<BlockElement>& history) {
-    // FIXME - This is really not optimal...
-    const auto& e = std::get<Element>(elements[pos]); 
-    if (e.m_open_b_square || e.m_open_b_curly) {
-        history.emplace_back(e.m_data);
-        return pos;
-    }
-    else if (start_math_inline(e, history)) {
-        history.emplace_back(e.m_data);
-        return pos;
-    }
-    // TODO - this is awful
-    else if (e.n_numerals == e.m_data.length()) {
-        history.emplace_back(e.m_data);
-        return pos;
-    }
-    else if (e.m_open_b_round != std::get<Element>(elements[initial_pos]).m_open_b_round) {
-        // We must exit math mode with the same number of round brackets with which
-        // we entered it
-        history.emplace_back(e.m_data);
-        return pos;
-    }
-    else if (
-        !(e.n_lower_case == e.m_data.size()) &&
-        pos + 1 < elements.size() && 
-        std::holds_alternative<Element>(elements[pos + 1]) &&
-        start_math_inline(std::get<Element>(elements[pos + 1]), history)) {
-        history.emplace_back(std::get<Element>(elements[pos]).m_data);
-        history.emplace_back(std::get<Element>(elements[pos + 1]).m_data);
-        return pos + 1;
-    }
-    return std::nullopt;
-}
+        Arena arena{options.m_settings.m_arena_kind, options.m_settings.m_upstream};
 
-
-size_t handle_line_break(
-    const LineBreak& line_break,
-    size_t pos,
-    const std::vector<element_v>& elements,
-    std::deque<Block>& history) {
-    if (history.back().m_type == EnvironmentType::Array) {
-        // An array must be completed on the same line
-        throw Exception{
-            "[",
-            line_break.m_line_number,
-            ":0] SyntaxError: Array started on previous line must be completed on the same line"
-        };
-    }
-    if (line_break.is_empty) {
-        switch (history.back().m_type)
-        {
-        case EnvironmentType::MathInline:
-            // RULE: an empty line ends an inline environment
-            push_last_block(history);
-        case EnvironmentType::PlainText:
-        case EnvironmentType::MathBlock:
-        case EnvironmentType::ListItem:
-            history.back().m_data.emplace_back("\n");
-            break;
-        default:
-            assert(false);
-        }
-    }
-    else
-    {
-        if (line_break.m_indent > history.back().m_indent) {
-            if (auto item_label = try_get_item_label(pos + 1, elements)) {
-                auto [label, end_of_label] = *item_label;
-                history.emplace_back(
-                    EnvironmentType::ListItem,
-                    line_break.m_indent,  // TODO check if it is +4
-                    pos + 1,
-                    label,
-                    history.back().m_type != EnvironmentType::ListItem ? "first" : ""
-                );
-                return end_of_label;
-            }
-            else {
-                throw Exception{
-                    "[",
-                    line_break.m_line_number,
-                    ":0] IndentationError: Expected indent ",
-                    history.back().m_indent,
-                    " found ",
-                    line_break.m_indent
-                };
-            }
+        // For --alloc-stats compiling gets its memory through our arena, so that
+        // it can be counted
+        CompileSettings settings = options.m_settings;
+        settings.m_stats = stats_ptr;
+        if (options.m_alloc_stats) {
+            settings.m_arena_kind = Arena::Kind::Heap;
+            settings.m_upstream = arena.resource();
+            settings.m_pool = nullptr;
         }
-
-        while (history.back().m_indent > line_break.m_indent) {
-            push_last_block(history);
+        if (options.m_mem_stats) {
+            settings.m_pool = nullptr;
         }
-        if (history.back().m_indent != line_break.m_indent) {
-            throw Exception{
-                "[",
-                line_break.m_line_number,
-                ":0] IndentationError: Indent level doesn't match any. Expecting ",
-                history.back().m_indent,
-                " started on line ",
-                get_line_number(elements[history.back().m_initial_pos]),
-                " found ",
-                line_break.m_indent
-            };
 
-        }
-    }
-    return pos + 1;
-}
+        if (options.m_stream) {
+            // As output is written whilst compiling an error will leave it
+            // incomplete. When only writing if changed it goes to a temporary file
+            // first, which replaces the output if it is different.
+            std::optional<std::string> out_path;
+            if (out) {
+                out_path = options.m_write_if_changed ? *out + ".ntx-tmp" : *out;
+            }
 
+            std::ofstream out_file;
+            if (out_path) {
+                out_file.open(*out_path, std::ios::binary);
+            }
+            std::ostream& os = out_path ? out_file : std::cout;
 
-size_t handle_environment_decleration(
-    const EnvironmentDecleration& environment_decleration,
-    size_t pos,
-    const std::vector<element_v>& elements,
-    std::deque<Block>& history) {
-    switch (history.back().m_type)
-    {
-    case EnvironmentType::MathBlock:
-    case EnvironmentType::Array:
-        {
-            throw Exception{
-                "[",
-                environment_decleration.m_line_number,
-                ":*] SyntaxError: Cannot declare an environment whilst in environment ",
-                history.back().m_type
+            auto write_f = [&](std::string_view tex) {
+                Span span{trace, "write", phase_time(stats_ptr, Phase::Write)};
+                os << tex;
             };
-        }
-    case EnvironmentType::MathInline:
-        push_last_block(history);
-    case EnvironmentType::PlainText:
-    case EnvironmentType::ListItem:
-        {
-            switch(environment_decleration.m_type)
-            {
-            case EnvironmentType::Section:
-                {
-                    history.back().m_data.emplace_back(
-                        "\\" +
-                        environment_decleration.m_name + 
-                        "{" +
-                        environment_decleration.m_label +
-                        "}"
-                    );
-                    break;
-                }
-            case EnvironmentType::PlainText:
-            case EnvironmentType::MathBlock:
-                {
-                    history.emplace_back(
-                        environment_decleration.m_type,
-                        history.back().m_indent + 4,
-                        pos,
-                        environment_decleration.m_name,
-                        environment_decleration.m_label
-                    );
-                    break;
-                }
-            default:
-                {
-                    throw Exception{
-                        "[",
-                        environment_decleration.m_line_number,
-                        ":*] SyntaxError: Cannot declar environment of type ",
-                        environment_decleration.m_type
-                    };
-                } 
+            auto result = compile(source.view(), write_f, settings);
+            if (!result) {
+                throw Exception{get_errors_message(result)};
             }
-            break;
-        }
-    default:
-        assert(false);
-    }
-    return pos + 1;
-}
 
-size_t handle_element(
-    const Element& element,
-    size_t pos,
-    const std::vector<element_v>& elements,
-    std::deque<Block>& history) {
-    switch (history.back().m_type)
-    {
-    case EnvironmentType::ListItem:
-        {
-            if (auto item_label = try_get_item_label(pos, elements)) {
-                auto [label, end_of_label] = *item_label;
-                history.emplace_back(
-                    EnvironmentType::ListItem,
-                    history.back().m_indent + 4,
-                    pos,
-                    label,
-                    ""
-                );
-                return end_of_label;
+            // Only a file can be read back into the cache, which is done before
+            // the footer is written
+            if (out_path && cache) {
+                out_file.flush();
+                cache->store_file(cache_key, *out_path);
             }
-        }
-    case EnvironmentType::PlainText:
-        {
-            if (auto math_start_opt = start_math_inline(element, history.back().m_data)) {
-                // FIXME - check here for bracket numbers and raise exception if have curly or
-                // square. In the case that we have a round we need to check that we exit with the
-                // same number
-
-                // If math_start > 0 we need to take that many elements from the history
-                // We first create the block and then add in the data
-                size_t math_start = *math_start_opt;
-                Block block = {
-                    EnvironmentType::MathInline,
-                    history.back().m_indent,
-                    pos - math_start, // TODO - not sure actually correct
-                    "",
-                    ""
-                };
-
-                for (;math_start > 0; --math_start) {
-                    block.m_data.emplace_back(history.back().m_data.back());
-                    history.back().m_data.pop_back();
+            write_f(footer);
+            compile_stats.m_n_output_bytes += footer.size();
+
+            if (out_path) {
+                out_file.close();
+
+                if (*out_path != *out) {
+                    std::error_code ec;
+                    bool same = false;
+                    {
+                        SourceFile written{*out_path};
+                        same = file_equals(*out, written.view());
+                    }
+                    if (same) {
+                        std::filesystem::remove(*out_path, ec);
+                    }
+                    else {
+                        std::filesystem::rename(*out_path, *out, ec);
+                    }
                 }
-
-                block.m_data.emplace_back(element.m_data);
-
-                history.emplace_back(block);
-            }
-            else {
-                // TODO - could look at neateing up words somehow
-                history.back().m_data.emplace_back(element.m_data);
             }
-            break;
         }
-    case EnvironmentType::MathBlock:
-        {
-            // 1. Check if the array starts
-            if (element.m_data == "\\arr{") {
-                // TODO - figure out how to change bracket type...
-                // could be something like \arr(, \arr[, etc.
-                history.emplace_back(
-                    EnvironmentType::Array,
-                    history.back().m_indent,
-                    pos,
-                    "",
-                    ""
-                );
+        else {
+            if (options.m_debug || options.m_token_cache) {
+                std::optional<ProfilingResource> tokens_profiling;
+                auto* tokens_resource = ProfilingResource::wrap(
+                    tokens_profiling, stats_ptr, Structure::Tokens, arena.resource());
+
+                // These convert the tokens themselves, so the rest of the errors
+                // are looked for as compile would
+                std::optional<SourceEnvironments> environments;
+                std::optional<Tokens> tokens;
+                try {
+                    // Loading the saved tokens counts as lexing
+                    {
+                        Span span{trace, "lex", phase_time(stats_ptr, Phase::Lex)};
+                        PhaseScope phase{stats_ptr, Phase::Lex};
+                        environments.emplace(source.view(), *settings.m_environments);
+                        if (options.m_token_cache) {
+                            tokens = load_token_cache(
+                                token_cache_path(in), source.view(), source_hash, environments->get(), tokens_resource);
+                        }
+                        if (!tokens) {
+                            tokens = lex(source.view(), environments->get(), tokens_resource, settings.m_pool);
+                            if (options.m_token_cache) {
+                                save_token_cache(token_cache_path(in), *tokens, source_hash);
+                            }
+                        }
+                    }
+                    if (stats_ptr) {
+                        stats_ptr->count_tokens(*tokens);
+                    }
+                    tex_data = convert_to_tex(*tokens, arena.resource(), stats_ptr, trace);
+                }
+                catch (const Exception&) {
+                    if (settings.m_max_errors > 1) {
+                        CompileSettings check_settings = settings;
+                        check_settings.m_stats = nullptr;
+                        if (auto result = check(source.view(), check_settings); !result) {
+                            throw Exception{get_errors_message(result)};
+                        }
+                    }
+                    throw;
+                }
+                if (options.m_debug) {
+                    print_tokens(*tokens, log);
+                }
             }
             else {
-                history.back().m_data.emplace_back(element.m_data);
+                auto result = compile(source.view(), settings);
+                if (!result) {
+                    throw Exception{get_errors_message(result)};
+                }
+                tex_data = std::move(result.m_tex);
+            }
+            if (cache) {
+                cache->store(cache_key, *tex_data);
             }
 
-            break;
+            *tex_data += footer;
+            compile_stats.m_n_output_bytes = tex_data->size();
         }
-    case EnvironmentType::Array:
-        {
-            if (element.m_data == "}") {
-                // Array is complete
-                push_last_block(history);
-            }
-            else {
-                history.back().m_data.emplace_back(element.m_data);
-            }
 
-            break;
+        if (options.m_alloc_stats) {
+            print_alloc_stats(arena, stats);
         }
-    case EnvironmentType::MathInline:
-        {
-            if (auto pos_opt = read_math_inline(
-                    pos,
-                    history.back().m_initial_pos,
-                    elements,
-                    history.back().m_data))
-            {
-                // In this case we stay in math inline mode
-                pos = *pos_opt;
-            }
-            else {
-                push_last_block(history);
-                history.back().m_data.emplace_back(element.m_data);
-            }
-            break;
+    }
+    catch (const Exception& e) {
+        if (options.m_stream && options.m_write_if_changed && out) {
+            std::error_code ec;
+            std::filesystem::remove(*out + ".ntx-tmp", ec);
         }
-    default:
-        assert(false);
+        return fatal_f(e.m_message);
     }
-    return pos + 1;
-}
 
-std::string convert_to_tex(const std::vector<element_v>& elements) {
-    using namespace std;
-
-    size_t pos = 0;
-
-    deque<Block> history;
-    history.emplace_back(EnvironmentType::PlainText, 0, 0, "", "");
-
-    while (pos < elements.size()) {
-        pos = visit(
-            [&](auto&& a) -> size_t {
-                using T = decay_t<decltype(a)>;
-                if constexpr (is_same_v<T, LineBreak>) {
-                    return handle_line_break(a, pos, elements, history);
-                }
-                else if constexpr (is_same_v<T, EnvironmentDecleration>) {
-                    return handle_environment_decleration(a, pos, elements, history);
-                }
-                else {
-                    static_assert(is_same_v<T, Element>);
-                    return handle_element(a, pos, elements, history);
-                }
-            },
-            elements[pos]
-        );
+    if (options.m_stream) {
+        print_stats_f();
+        return true;
     }
 
-    while (history.size() > 1) {
-        push_last_block(history);
+    if (!tex_data) {
+        return fatal_f("Internal error - no tex data produced");
     }
 
-    assert(history.size() == 1);
-
-    auto final_block = amalgamate_block(history.back());
-    return final_block.front(); // Everything else is just new lines
+    {
+        Span span{trace, "write", phase_time(stats_ptr, Phase::Write)};
+        if (out) {
+            write_output(*out, *tex_data, options.m_write_if_changed);
+        }
+        else {
+            std::cout << *tex_data;
+        }
+    }
+    print_stats_f();
+    return true;
 }
 
-std::vector<element_v> read_file(std::string f_name) {
-    using namespace std;
-
-    string line;
-    ifstream f_handle{f_name};
 
-    size_t line_number = 0;
-    // TODO - could get nicer error messages if kept track of where the last open brace
-    // was , i.e. a stack of braces rather than a count;
-    size_t open_b_round = 0;
-    size_t open_b_square = 0;
-    size_t open_b_curly = 0;
-
-    std::vector<element_v> elements;
-
-    while (++line_number, getline(f_handle, line)) {
+// Adds the environments of the "% CMD environment" lines of each file to those
+// every source can declare. Returns false once one has been reported to log.
+bool load_environment_files(const std::vector<std::string>& paths, std::ostream& log) {
+    for (const auto& path : paths) {
+        std::optional<SourceFile> file;
+        try {
+            file.emplace(path);
+        }
+        catch (const Exception& e) {
+            log << e.what() << std::endl;
+            return false;
+        }
+        try {
+            load_environments(file->view());
+        }
+        catch (const Exception& e) {
+            log << path << ": " << e.what() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-        // 1. If it matches any lines we use for meta data we do not include in the elements
-        // 2. Each new line is an element. If all white space we treat as a blank line
-        // 3. An environment decleration is a single element.
-        //    (i) It cannot happen if we have any open braces
-        // 4. General element construction
 
-        // 1. ...
-        smatch match;
+// The ntx files to compile, with directories searched (recursively) for .ntx files
+std::vector<std::string> find_inputs(const std::vector<std::string>& paths) {
+    namespace fs = std::filesystem;
 
-        if (regex_match(line, match, patterns::tag)) {
+    std::vector<std::string> inputs;
+    for (const auto& path : paths) {
+        std::error_code ec;
+        if (!fs::is_directory(path, ec)) {
+            inputs.push_back(path);
             continue;
         }
 
-        if (regex_match(line, match, patterns::cmd)) {
-            continue;
+        std::vector<std::string> found;
+        for (const auto& entry : fs::recursive_directory_iterator{path, ec}) {
+            if (entry.is_regular_file(ec) && entry.path().extension() == ".ntx") {
+                found.push_back(entry.path().string());
+            }
         }
+        std::sort(found.begin(), found.end());
+        inputs.insert(inputs.end(), found.begin(), found.end());
+    }
+    return inputs;
+}
 
-        // TODO - comments
+// Where the tex for in goes when compiling several files: next to it, or in
+// out_dir (keeping its name) if that is set
+std::string get_batch_output(const std::string& in, const std::optional<std::string>& out_dir) {
+    namespace fs = std::filesystem;
 
-        // 2. ...
-        size_t indent = line.find_first_not_of(' ');
-        if (indent == string::npos) {
-            // Line is empty
-            elements.emplace_back(LineBreak{line_number, true, 0});
-            continue;
-        }
+    fs::path out = fs::path{in}.replace_extension(".tex");
+    if (out_dir) {
+        out = fs::path{*out_dir} / out.filename();
+    }
+    return out.string();
+}
 
-        elements.emplace_back(LineBreak{line_number, false, indent});
-
-        // 3. ...
-        if (regex_match(line, match, patterns::env_decl) ||
-            regex_match(line, match, patterns::section_def)) {
-            string short_name = match[1];
-            if (auto it = s_environments.find(short_name); it != s_environments.end()) {
-                if (open_b_round || open_b_square || open_b_curly) {
-                    throw Exception{
-                        "[",
-                        line_number,
-                        ":0] SyntaxError: Cannot start new environment='",
-                        short_name,
-                        "' as brackets not closed. Open '('=",
-                        open_b_round,
-                        ", '{'=",
-                        open_b_curly,
-                        ", '['=",
-                        open_b_square,
-                        "."
-                    };
+using compile_job_t = std::tuple<std::string /* in */, std::string /* out */>;
+
+// Compiles every job on the pool. Each file's messages are written together once
+// it is done, prefixed by its name. If report_latency is set the time from the
+// file being saved (its mtime) to the tex being written is also reported.
+// Returns the number of files that failed.
+std::size_t compile_files(
+    const std::vector<compile_job_t>& jobs,
+    const CompileOptions& options,
+    WorkStealingPool& pool,
+    bool report_latency = false) {
+
+    std::mutex print_mutex;
+    std::atomic<std::size_t> n_failed = 0;
+
+    for (const auto& job : jobs) {
+        pool.submit([&]() {
+            const auto& [in, out] = job;
+
+            // JSON stats go out as they are, one object per line, as they name
+            // the file themselves
+            std::ostringstream log;
+            std::ostringstream json_stats;
+            const bool is_json = options.m_stats == CompileOptions::StatsFormat::Json;
+            bool ok = compile_file(in, out, options, log, is_json ? json_stats : log);
+            if (!ok) {
+                ++n_failed;
+            }
+            else if (report_latency) {
+                namespace fs = std::filesystem;
+                std::error_code ec;
+                auto saved = fs::last_write_time(in, ec);
+                if (!ec) {
+                    std::chrono::duration<double, std::milli> latency = fs::file_time_type::clock::now() - saved;
+                    log << "[watch] " << (options.m_check ? "checked" : "written to " + out)
+                        << " " << latency.count() << "ms after saving\n";
                 }
-
-                auto [env_type, name] = it->second;
-                string label = match[2];
-                elements.emplace_back(EnvironmentDecleration{line_number, env_type, name, label});
-                continue;
             }
-        }
 
-        // 4. Now we loop over over the characters in the line and do the big switch statement
-        auto element_f = [&](size_t pos, string data) {
-            size_t n_lower_case = 0, n_upper_case = 0, n_numerals = 0;
-            for (char c : data) {
-                if (c >= 'a' && c <= 'z') ++n_lower_case;
-                if (c >= 'A' && c <= 'Z') ++n_upper_case;
-                if (c >= '0' && c <= '9') ++n_numerals;
+            if (auto messages = log.str(); !messages.empty()) {
+                std::lock_guard lock{print_mutex};
+                std::istringstream lines{messages};
+                for (std::string line; std::getline(lines, line);) {
+                    std::cout << "[" << in << "] " << line << "\n";
+                }
+                std::cout << std::flush;
             }
+            if (auto stats = json_stats.str(); !stats.empty()) {
+                std::lock_guard lock{print_mutex};
+                std::cerr << stats << std::flush;
+            }
+        });
+    }
+    pool.wait();
 
-            return Element{
-                line_number,
-                pos,
-                open_b_round,
-                open_b_square,
-                open_b_curly,
-                n_lower_case,
-                n_upper_case,
-                n_numerals,
-                data
-            };
-        };
+    return n_failed;
+}
 
-        auto write_element_f = [&](size_t start, size_t end) {
-            if (start < end) {
-                elements.emplace_back(element_f(start, line.substr(start, end - start)));
-            }
-        };
+// Recompiles files as they are saved, until killed. paths are what was passed on
+// the command line, out_of gives where the tex of a changed file goes. The pool
+// threads, the cache and (through options) the allocator are kept between
+// recompiles.
+[[noreturn]] void watch_files(
+    const std::vector<std::string>& paths,
+    const std::function<std::string(const std::string&)>& out_of,
+    const CompileOptions& options,
+    WorkStealingPool& pool,
+    const std::function<void()>& after_each) {
+
+    Watcher watcher{paths};
+    std::cout << "[watch] waiting for changes" << std::endl;
+
+    while (true) {
+        std::vector<compile_job_t> jobs;
+        for (const auto& in : watcher.wait()) {
+            jobs.emplace_back(in, out_of(in));
+        }
+        compile_files(jobs, options, pool, true);
+        after_each();
+    }
+}
 
-        size_t w_begin = indent;
 
-        for (size_t pos = indent; pos < line.size(); ++pos) {
-            char c = line[pos];
+// The messages between --client and --serve. A request is a kind and then
+//   Source: the ntx, to be compiled to tex sent back
+//   File:   the path of an ntx file, '\0', where its tex is to be written
+// and the reply is whether it compiled, the length of the tex, the tex (empty
+// for a file) and then any messages, which are what the command line would print.
+enum class Request : char
+{
+    Source = 'S',
+    File = 'F'
+};
 
-            switch (c)
-            {
-            case ' ':
-                {
-                    write_element_f(w_begin, pos);
-                    w_begin = pos + 1;
-                    break;
-                }
-            case '{':
-                {
-                    write_element_f(w_begin, pos + 1);
-                    ++open_b_curly;
-                    w_begin = pos + 1;
-                    break;
-                }
-            case '}':
-                {
-                    write_element_f(w_begin, pos);
-                    elements.emplace_back(element_f(pos, "}"));
-                    --open_b_curly;
-                    w_begin = pos + 1;
-                    break;
-                }
-            case '[':
-                {
-                    write_element_f(w_begin, pos);
-                    elements.emplace_back(element_f(pos, "["));
-                    ++open_b_square;
-                    w_begin = pos + 1;
-                    break;
+std::string make_reply(bool ok, std::string_view tex, std::string_view messages) {
+    std::string reply;
+    reply.reserve(1 + sizeof(std::uint32_t) + tex.size() + messages.size());
+    reply += ok ? '1' : '0';
+    const auto tex_size = static_cast<std::uint32_t>(tex.size());
+    reply.append(reinterpret_cast<const char*>(&tex_size), sizeof(tex_size));
+    reply += tex;
+    reply += messages;
+    return reply;
+}
 
-                }
-            case ']':
-                {
-                    write_element_f(w_begin, pos);
-                    elements.emplace_back(element_f(pos, "]"));
-                    --open_b_square;
-                    w_begin = pos + 1;
-                    break;
+struct Reply
+{
+    bool m_ok;
+    std::string_view m_tex;
+    std::string_view m_messages;
+};
 
-                }
-            case '(':
-                {
-                    write_element_f(w_begin, pos);
-                    elements.emplace_back(element_f(pos, "("));
-                    ++open_b_round;
-                    w_begin = pos + 1;
-                    break;
+Reply read_reply(std::string_view reply) {
+    std::uint32_t tex_size;
+    if (reply.size() < 1 + sizeof(tex_size)) {
+        throw Exception{"Bad reply from the server"};
+    }
+    const bool ok = reply.front() == '1';
+    std::memcpy(&tex_size, reply.data() + 1, sizeof(tex_size));
+    reply.remove_prefix(1 + sizeof(tex_size));
+    if (reply.size() < tex_size) {
+        throw Exception{"Bad reply from the server"};
+    }
+    return {ok, reply.substr(0, tex_size), reply.substr(tex_size)};
+}
 
-                }
-            case ')':
-                {
-                    write_element_f(w_begin, pos);
-                    elements.emplace_back(element_f(pos, ")"));
-                    --open_b_round;
-                    w_begin = pos + 1;
-                    break;
+// Compiles what is in a request. This runs on the server's pool, so a big source
+// is not split (options.m_settings.m_pool is not set).
+std::string answer_request(std::string_view request, const CompileOptions& options) {
+    if (request.empty()) {
+        return make_reply(false, {}, "Empty request\n");
+    }
+    const auto kind = static_cast<Request>(request.front());
+    request.remove_prefix(1);
 
-                }
-            case ';':
-                {
-                    write_element_f(w_begin, pos + 1);
-                    w_begin = pos + 1;
-                    break;
-                }
-            case '+':
-            case '*':
-            case '/':
-                {
-                    write_element_f(w_begin, pos);
-                    elements.emplace_back(element_f(pos, string{c}));
-                    w_begin = pos + 1;
-                    break;
-                }
-            default:
+    std::ostringstream log;
+    switch (kind)
+    {
+    case Request::File:
+        {
+            const auto split = request.find('\0');
+            if (split == std::string_view::npos) {
                 break;
             }
+            const std::string in{request.substr(0, split)};
+            const std::string out{request.substr(split + 1)};
+            bool ok = compile_file(in, out, options, log, log);
+            return make_reply(ok, {}, log.str());
         }
-
-        if (w_begin < line.size()) {
-            elements.emplace_back(
-                element_f(w_begin, line.substr(w_begin))
-            );
+    case Request::Source:
+        {
+            auto result = compile(request, options.m_settings);
+            if (!result) {
+                log << get_errors_message(result) << "\n[FATAL] Cannot continue compiling\n";
+                return make_reply(false, {}, log.str());
+            }
+            result.m_tex += options.m_deterministic
+                ? get_ntx_info(hash_bytes(request, get_compile_salt(request)))
+                : get_ntx_info();
+            return make_reply(true, result.m_tex, {});
         }
     }
-
-    return elements;
+    return make_reply(false, {}, "Bad request\n");
 }
 
+// Answers requests on the unix socket at path, until killed
+[[noreturn]] void serve(const std::string& path, const CompileOptions& options, WorkStealingPool& pool) {
+    // A client that goes away before its reply should not take the server with it
+    std::signal(SIGPIPE, SIG_IGN);
 
-std::string get_ntx_info() {
+    Server server{path, pool};
+    std::cout << "[serve] listening on " << path << std::endl;
+    server.run([&](std::string_view request) { return answer_request(request, options); });
+}
 
-    std::time_t now = std::time(nullptr);
+// Has the server on the unix socket at path compile the inputs, with the tex of
+// each going to out_of it, or if there are none the ntx on stdin (with the tex
+// going to stdout). Prints what the command line would and returns its exit code.
+int run_client(
+    const std::string& path,
+    const std::vector<std::string>& inputs,
+    const std::function<std::string(const std::string&)>& out_of) {
+
+    namespace fs = std::filesystem;
+
+    Socket server = Socket::connect(path);
+    std::string reply;
+    auto send_f = [&](std::string_view request) {
+        if (!server.write_message(request) || !server.read_message(reply)) {
+            throw Exception{"Lost the connection to '", path, "'"};
+        }
+        return read_reply(reply);
+    };
 
-    std::stringstream ss;
-    ss << "\n\n% "
-       << "ntx["
-       << NTX_VERSION_MAJOR
-       << ":"
-       << NTX_VERSION_MINOR
-       << "] - compiled @ "
-       << std::asctime(std::gmtime(&now));
+    if (inputs.empty()) {
+        std::string request{static_cast<char>(Request::Source)};
+        request.append(std::istreambuf_iterator<char>{std::cin}, std::istreambuf_iterator<char>{});
 
-    return ss.str();
+        const auto result = send_f(request);
+        std::cout << result.m_tex << result.m_messages << std::flush;
+        return result.m_ok ? 0 : 2;
+    }
+
+    // One at a time over the connection, the server has the threads. Paths are
+    // made absolute as the server need not be in the same directory.
+    std::size_t n_failed = 0;
+    for (const auto& in : inputs) {
+        std::string request{static_cast<char>(Request::File)};
+        request += fs::absolute(in).string();
+        request += '\0';
+        request += fs::absolute(out_of(in)).string();
+
+        const auto result = send_f(request);
+        if (!result.m_ok) {
+            ++n_failed;
+        }
+        if (inputs.size() == 1) {
+            std::cout << result.m_messages;
+            continue;
+        }
+        std::istringstream lines{std::string{result.m_messages}};
+        for (std::string line; std::getline(lines, line);) {
+            std::cout << "[" << in << "] " << line << "\n";
+        }
+    }
+    if (n_failed && inputs.size() > 1) {
+        std::cout << "[FATAL] " << n_failed << " of " << inputs.size() << " files could not be compiled\n";
+    }
+    std::cout << std::flush;
+    return n_failed ? 2 : 0;
 }
 
 } // ntx
@@ -1035,13 +1053,42 @@ int main(int argc, char** argv) {
     po::options_description desc{"Allowed options."};
     desc.add_options()
         ("help",                              "Produce help message")
-        ("file,f",  po::value<std::string>(), "Which ntx to compile to tex")
-        ("out,o",   po::value<std::string>(), "If set write to the passed file")
+        ("file,f",  po::value<std::vector<std::string>>()->multitoken(),
+                                              "Which ntx files (or directories of them) to compile to tex")
+        ("out,o",   po::value<std::string>(), "If set write to the passed file (directory for several files)")
+        ("jobs,j",  po::value<std::size_t>(), "How many threads to compile with, all cores by default. A single big file is split between them")
         ("debug,d",                           "Print the elements to screen")
+        ("check",                             "Only report whether the files compile, writing no tex")
+        ("max-errors", po::value<std::size_t>()->default_value(1),
+                                              "Report up to this many errors in each file rather than only the first")
+        ("stream,s",                          "Write blocks out as soon as they are complete")
+        ("arena",                             "Allocate from a per file arena rather than the heap")
+        ("alloc-stats",                       "Print how many allocations compiling took")
+        ("stats",                             "Print the time of each phase and what was made")
+        ("stats-json",                        "As --stats but a JSON object per file (to stderr)")
+        ("mem-stats",                         "Print the memory each phase and structure took, and the peak resident")
+        ("trace",   po::value<std::string>(), "Write spans of the compile to this file in the Chrome trace format")
+        ("cache",   po::value<std::string>(), "Reuse the tex of unchanged files from (and save it to) this directory")
+        ("cache-size", po::value<std::size_t>()->default_value(256),
+                                              "Largest the cache can get in MB, least recently used are removed first")
+        ("cache-stats",                       "Print the cache hits and misses")
+        ("deterministic",                     "End the tex with a hash of the source rather than the time")
+        ("write-if-changed",                  "Do not touch output files that already hold the tex")
+        ("token-cache",                       "Save the tokens of each file beside it (as .ntxc) and skip lexing while it is unchanged")
+        ("watch,w",                           "Stay running and recompile files as they are saved")
+        ("serve",   po::value<std::string>(), "Stay running and compile what is sent to this unix socket by --client")
+        ("client",  po::value<std::string>(), "Have the --serve on this unix socket compile the files, or stdin if there are none")
+        ("lsp",                               "Stay running as a language server for editors, over stdin and stdout")
+        ("environments", po::value<std::vector<std::string>>()->multitoken(),
+                                              "Add the environments of the '% CMD environment <short name>=<type>:<name>' lines of these files")
     ;
 
+    // Files can also be given without -f
+    po::positional_options_description positional;
+    positional.add("file", -1);
+
     po::variables_map vm{};
-    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
     po::notify(vm);
 
     if (vm.count("help")) {
@@ -1049,93 +1096,218 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    if (vm.count("file")) {
+    ntx::CompileOptions options;
+    options.m_stream = vm.count("stream");
+    options.m_debug = vm.count("debug");
+    options.m_alloc_stats = vm.count("alloc-stats");
+    options.m_mem_stats = vm.count("mem-stats");
+    if (vm.count("stats-json")) {
+        options.m_stats = ntx::CompileOptions::StatsFormat::Json;
+    }
+    else if (vm.count("stats")) {
+        options.m_stats = ntx::CompileOptions::StatsFormat::Text;
+    }
+    options.m_deterministic = vm.count("deterministic");
+    options.m_write_if_changed = vm.count("write-if-changed");
+    options.m_token_cache = vm.count("token-cache");
+    options.m_check = vm.count("check");
+    options.m_settings.m_max_errors = vm["max-errors"].as<std::size_t>();
+    // The arena keeps every small allocation until the end, so it cannot be used
+    // when streaming as that relies on freeing blocks as soon as they are written
+    options.m_settings.m_arena_kind = vm.count("arena") && !vm.count("stream")
+        ? ntx::Arena::Kind::Monotonic
+        : ntx::Arena::Kind::Heap;
+
+    std::optional<ntx::CompileCache> cache;
+    if (vm.count("cache")) {
+        cache.emplace(vm["cache"].as<std::string>(), vm["cache-size"].as<std::size_t>() << 20);
+        options.m_cache = &*cache;
+    }
+
+    std::optional<ntx::Trace> trace;
+    if (vm.count("trace")) {
+        trace.emplace();
+        options.m_settings.m_trace = &*trace;
+    }
+
+    // The cache is only trimmed (and the trace written) once all the files are
+    // done
+    auto finish_f = [&](int rc) {
+        if (trace) {
+            std::ofstream file{vm["trace"].as<std::string>(), std::ios::binary};
+            file << trace->to_json();
+        }
+        if (cache) {
+            cache->evict();
+            if (vm.count("cache-stats")) {
+                std::cerr << "[cache] "
+                          << cache->hits()
+                          << " hits, "
+                          << cache->misses()
+                          << " misses, "
+                          << cache->evicted()
+                          << " evicted"
+                          << std::endl;
+            }
+        }
+        return rc;
+    };
+
+    std::size_t n_jobs = vm.count("jobs")
+        ? vm["jobs"].as<std::size_t>()
+        : std::max(1u, std::thread::hardware_concurrency());
 
-        std::optional<std::string> tex_data;
+    // Added before anything compiles. Those the files being compiled declare are
+    // added by each for itself.
+    if (vm.count("environments") &&
+        !ntx::load_environment_files(vm["environments"].as<std::vector<std::string>>(), std::cout)) {
+        std::cout << "[FATAL] Cannot add the environments" << std::endl;
+        return 1;
+    }
+
+    if (options.m_check && options.m_debug) {
+        std::cout << "--check makes no tex so cannot be used with --debug" << std::endl;
+        return 1;
+    }
+
+    if (vm.count("lsp")) {
+        if (vm.count("file") || vm.count("serve") || vm.count("client") || vm.count("watch")) {
+            std::cout << "--lsp takes its documents from the editor so cannot be used with files, --serve, --client or --watch" << std::endl;
+            return 1;
+        }
+        return ntx::LanguageServer{std::cin, std::cout, options.m_settings}.run();
+    }
+
+    if (vm.count("serve")) {
+        if (options.m_debug || options.m_check || trace) {
+            std::cout << "--debug, --check and --trace cannot be used with --serve" << std::endl;
+            return 1;
+        }
+        finish_f(0);
+
+        // As for --watch the memory is kept warm between requests
+        std::pmr::synchronized_pool_resource warm_resource;
+        options.m_settings.m_upstream = &warm_resource;
+        options.m_read_sources = true;
+
+        ntx::WorkStealingPool pool{n_jobs};
         try {
-            auto elements = ntx::read_file(vm["file"].as<std::string>());
-
-            tex_data = convert_to_tex(elements);
-
-            if (vm.count("debug")) {
-                using namespace std;
-                using namespace ntx;
-
-                for (const auto& element : elements) {
-                    visit(
-                        [](auto&& a) {
-                            using T = std::decay_t<decltype(a)>;
-
-                            if constexpr (std::is_same_v<T, LineBreak>) {
-                                cout << "["
-                                     << a.m_line_number
-                                     << "]  LineBreak{is_empty="
-                                     << a.is_empty
-                                     << ", indent="
-                                     << a.m_indent
-                                     << "}\n";
-                            }
-                            if constexpr (std::is_same_v<T, EnvironmentDecleration>) {
-                                cout << "["
-                                     << a.m_line_number
-                                     << "]  EnvironmentDecleration{name="
-                                     << a.m_name
-                                     << ", label="
-                                     << a.m_label
-                                     << "}\n";
+            ntx::serve(vm["serve"].as<std::string>(), options, pool);
+        }
+        catch (const std::system_error& e) {
+            std::cout << e.what() << std::endl;
+            std::cout << "[FATAL] Cannot serve" << std::endl;
+            return 2;
+        }
+    }
 
-                            }
-                            if constexpr (std::is_same_v<T, Element>) {
-                                cout << "["
-                                     << a.m_line_number
-                                     << ":"
-                                     << a.m_line_pos
-                                     << "]  Element{open_b_round="
-                                     << a.m_open_b_round
-                                     << ", open_b_square="
-                                     << a.m_open_b_square
-                                     << ", open_b_curly="
-                                     << a.m_open_b_curly
-                                     << ", n_lower_case="
-                                     << a.n_lower_case
-                                     << ", n_upper_case="
-                                     << a.n_upper_case
-                                     << ", n_numerals="
-                                     << a.n_numerals
-                                     << ", data=\""
-                                     << a.m_data
-                                     << "\"}\n";
+    if (!vm.count("file") && !vm.count("client")) {
+        return 0;
+    }
 
-                            }
-                        },
-                        element
-                    );
-                }
+    const auto paths = vm.count("file")
+        ? vm["file"].as<std::vector<std::string>>()
+        : std::vector<std::string>{};
+    std::optional<std::string> out;
+    if (vm.count("out")) {
+        out = vm["out"].as<std::string>();
+    }
+
+    const bool is_batch = paths.size() > 1 || (!paths.empty() && std::filesystem::is_directory(paths.front()));
+    if (vm.count("client")) {
+        // The server was started with the options for compiling
+        auto out_of_f = [&](const std::string& in) {
+            if (!is_batch && out) {
+                return *out;
             }
+            return ntx::get_batch_output(in, is_batch ? out : std::nullopt);
+        };
+        try {
+            return ntx::run_client(vm["client"].as<std::string>(), ntx::find_inputs(paths), out_of_f);
+        }
+        catch (const std::system_error& e) {
+            std::cout << e.what() << std::endl;
+            return 2;
         }
-
         catch (const ntx::Exception& e) {
-            std::cout << e.m_message << std::endl;
-            std::cout << "[FATAL] Cannot continue compiling" << std::endl;
+            std::cout << e.what() << std::endl;
             return 2;
         }
+    }
 
-        if (!tex_data) {
-            std::cout << "Internal error - no tex data produced" << std::endl;
-            std::cout << "[FATAL] Cannot continue compiling" << std::endl;
-            return 2;
+    const auto inputs = ntx::find_inputs(paths);
+
+    const bool is_watch = vm.count("watch");
+    if (!is_batch && !is_watch) {
+        if (options.m_stream && options.m_debug) {
+            std::cout << "--debug needs every element so cannot be used with --stream" << std::endl;
+            return 1;
+        }
+        // Streaming is for keeping memory down, so it stays on one thread
+        std::optional<ntx::WorkStealingPool> pool;
+        if (n_jobs > 1 && !options.m_stream) {
+            pool.emplace(n_jobs);
+            options.m_settings.m_pool = &*pool;
         }
+        return finish_f(ntx::compile_file(paths.front(), out, options, std::cout, std::cerr) ? 0 : 2);
+    }
 
-        if (vm.count("out")) {
-            std::ofstream out{vm["out"].as<std::string>()};
-            out << *tex_data << ntx::get_ntx_info();
+    // FIXME - need to have the option to add preamble to one tex file
+    if (options.m_debug) {
+        std::cout << "--debug can only be used when compiling a single file once" << std::endl;
+        return 1;
+    }
+    if (out && is_batch) {
+        std::error_code ec;
+        std::filesystem::create_directories(*out, ec);
+        if (!std::filesystem::is_directory(*out)) {
+            std::cout << "--out must be a directory when compiling several files" << std::endl;
+            return 1;
         }
-        else {
-            std::cout << *tex_data << ntx::get_ntx_info();
+    }
+
+    // A single file goes to --out, otherwise tex goes next to the ntx (or in --out)
+    auto out_of_f = [&](const std::string& in) {
+        if (!is_batch && out) {
+            return *out;
         }
+        return ntx::get_batch_output(in, is_batch ? out : std::nullopt);
+    };
+
+    std::vector<ntx::compile_job_t> jobs;
+    for (const auto& in : inputs) {
+        jobs.emplace_back(in, out_of_f(in));
+    }
+
+    if (is_watch) {
+        // Kept warm between recompiles, rather than going back to malloc
+        std::pmr::synchronized_pool_resource warm_resource;
+        options.m_settings.m_upstream = &warm_resource;
+        options.m_read_sources = true;
+
+        ntx::WorkStealingPool pool{n_jobs};
+        ntx::compile_files(jobs, options, pool);
+        finish_f(0);
+
+        try {
+            ntx::watch_files(paths, out_of_f, options, pool, [&]() { finish_f(0); });
+        }
+        catch (const std::system_error& e) {
+            std::cout << e.what() << std::endl;
+            std::cout << "[FATAL] Cannot watch for changes" << std::endl;
+            return 2;
+        }
+    }
+
+    if (jobs.empty()) {
+        return 0;
+    }
 
-        // FIXME - need to have the option to add preamble to one tex file,
-        //       - to be able to compile multiple files,
-        //       - ...
+    ntx::WorkStealingPool pool{std::min(n_jobs, jobs.size())};
+    const auto n_failed = ntx::compile_files(jobs, options, pool);
+    if (n_failed) {
+        std::cout << "[FATAL] " << n_failed << " of " << jobs.size() << " files could not be compiled" << std::endl;
+        return finish_f(2);
     }
+    return finish_f(0);
 }
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "scan.hpp"
+#include "tokens.hpp"
+
+
+namespace ntx {
+
+// Whether a word of prose starts inline maths, before looking at the words
+// before it
+enum class MathStart : std::uint8_t
+{
+    None,
+    Start,
+    // As does the word before it, if that can be taken (see take_at_least_one)
+    TakeOne
+};
+
+
+namespace detail {
+
+// A word of one character is decided by that character alone
+constexpr MathStart get_single_char_math_start(char c) {
+    if (WordScanner::is_numeral(c)) return MathStart::None;
+    if (WordScanner::is_lower_case(c)) return c == 'a' ? MathStart::None : MathStart::Start;
+    if (WordScanner::is_upper_case(c)) return c == 'I' ? MathStart::None : MathStart::Start;
+    switch (c)
+    {
+    case '[': case '{':
+        return MathStart::Start;
+    case '=': case '-': case '+': case '/': case '*': case '^': case '_': case '<': case '>':
+        return MathStart::TakeOne;
+    default:
+        return MathStart::None;
+    }
+}
+
+inline constexpr auto s_single_char_math_starts = []() {
+    std::array<MathStart, 256> starts{};
+    for (std::size_t c = 0; c < starts.size(); ++c) {
+        starts[c] = get_single_char_math_start(static_cast<char>(c));
+    }
+    return starts;
+}();
+
+// A longer word is decided by the classes of its characters and whether it has
+// exactly one letter, which make the index into a table. The classes are only
+// looked up here, for the words that get this far, rather than by the lexer for
+// every word.
+static constexpr std::uint32_t s_class_closing = 1 << 0;   // } ] )
+static constexpr std::uint32_t s_class_math = 1 << 1;      // \ [ { ^ _
+static constexpr std::uint32_t s_class_operator = 1 << 2;  // + - / *
+static constexpr std::uint32_t s_one_letter = 1 << 3;
+
+constexpr std::uint32_t get_char_classes(char c) {
+    switch (c)
+    {
+    case '}': case ']': case ')':
+        return s_class_closing;
+    case '\\': case '[': case '{': case '^': case '_':
+        return s_class_math;
+    case '+': case '-': case '/': case '*':
+        return s_class_operator;
+    default:
+        return 0;
+    }
+}
+
+inline constexpr auto s_char_classes = []() {
+    std::array<std::uint8_t, 256> classes{};
+    for (std::size_t c = 0; c < classes.size(); ++c) {
+        classes[c] = static_cast<std::uint8_t>(get_char_classes(static_cast<char>(c)));
+    }
+    return classes;
+}();
+
+constexpr MathStart get_long_math_start(std::uint32_t key) {
+    if (key & s_class_closing) return MathStart::None;
+    if (key & s_class_math) return MathStart::Start;
+    if ((key & s_one_letter) && (key & s_class_operator)) return MathStart::Start;
+    return MathStart::None;
+}
+
+inline constexpr auto s_long_math_starts = []() {
+    std::array<MathStart, 2 * s_one_letter> starts{};
+    for (std::uint32_t key = 0; key < starts.size(); ++key) {
+        starts[key] = get_long_math_start(key);
+    }
+    return starts;
+}();
+
+} // detail
+
+
+// Decided from what the lexer counted and one pass over the word's classes,
+// rather than by searching it again for each bracket and operator
+inline MathStart get_math_start(const Element& element) {
+    using namespace detail;
+
+    const auto& s = element.m_data;
+    switch (s.length())
+    {
+    case 0:
+        return MathStart::None;
+    case 1:
+        return s_single_char_math_starts[static_cast<unsigned char>(s[0])];
+    case 2:
+        // FIXME - do we want to check if closing
+        if (element.n_lower_case == 0) {
+            return MathStart::Start;
+        }
+        if (element.n_lower_case == 1) {
+            return !element.n_upper_case || s[0] > s[1] ? MathStart::Start : MathStart::None;
+        }
+        return MathStart::None;
+    default:
+        {
+            std::uint32_t key = element.n_upper_case + element.n_lower_case == 1 ? s_one_letter : 0;
+            for (char c : s) {
+                key |= s_char_classes[static_cast<unsigned char>(c)];
+            }
+            return s_long_math_starts[key];
+        }
+    }
+}
+
+} // ntx
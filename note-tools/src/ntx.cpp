@@ -0,0 +1,395 @@
+#include "ntx.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "blox.hpp"
+#include "detextion.hpp"
+#include "exception.hpp"
+
+
+namespace ntx {
+
+// Converts the lines as the lexer produces them, writing top level blocks as soon
+// as they are complete. Memory then depends on how deeply the notes are nested
+// rather than on the size of the file.
+void convert_to_tex(
+    Lexer& lexer,
+    const tex_sink_t& sink,
+    std::pmr::memory_resource* resource,
+    CompileStats* stats,
+    Trace* trace) {
+    std::optional<ProfilingResource> tokens_profiling;
+    Tokens line{lexer.text(), ProfilingResource::wrap(tokens_profiling, stats, Structure::Tokens, resource)};
+    std::string tex;
+    Converter converter{tex, resource, stats, trace};
+
+    auto next_line_f = [&]() {
+        line.clear();
+        Span span{trace, "lex", phase_time(stats, Phase::Lex)};
+        PhaseScope phase{stats, Phase::Lex};
+        return lexer.next_line(line);
+    };
+    auto write_f = [&]() {
+        if (stats) {
+            stats->m_n_output_bytes += tex.size();
+        }
+        sink(tex);
+        tex.clear();
+    };
+
+    while (next_line_f()) {
+        if (stats) {
+            stats->count_tokens(line);
+        }
+        converter.feed(line);
+        if (!tex.empty()) {
+            write_f();
+        }
+    }
+
+    converter.finish();
+    if (!tex.empty()) {
+        write_f();
+    }
+}
+
+
+// Splits the text at top level lines and lexes and converts the parts on the
+// pool, joining the tex in order. Whether a part really was independent of the
+// one before is only known once that has been converted; if not it is converted
+// again, carrying on from the one before, so the tex is always the same as
+// converting the whole text at once. Must not be called from a task on the pool.
+std::string convert_to_tex(
+    std::string_view text,
+    const Environments& environments,
+    WorkStealingPool& pool,
+    const CompileSettings& settings) {
+
+    struct Chunk
+    {
+        Chunk(std::string_view text, const CompileSettings& settings)
+            : m_arena{settings.m_arena_kind, settings.m_upstream}
+            , m_stats_ptr{settings.m_stats ? &m_stats : nullptr}
+            , m_tokens{text, m_arena.resource()}
+            , m_converter{m_tex, m_arena.resource(), m_stats_ptr, settings.m_trace}
+        {}
+
+        std::size_t m_begin = 0;
+        std::size_t m_end = 0;
+        std::size_t m_first_line = 1;
+        // Whether its converter was used, rather than its tokens being fed to the
+        // one before
+        bool m_is_independent = true;
+
+        Arena m_arena;
+        // Added to the settings' once all the chunks are done
+        CompileStats m_stats;
+        CompileStats* m_stats_ptr;
+        Tokens m_tokens;
+        std::string m_tex;
+        Converter m_converter;
+
+        // Tasks cannot throw
+        std::exception_ptr m_lex_error;
+        std::exception_ptr m_convert_error;
+    };
+
+    // A few chunks per thread, so that one slow chunk does not hold up the rest
+    const auto cuts = find_top_level_cuts(
+        text,
+        environments,
+        std::max(s_min_chunk_size, text.size() / (4 * pool.size())));
+
+    const std::size_t first_line = find_first_line(text);
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    for (std::size_t i = 0; i <= cuts.size(); ++i) {
+        auto& chunk = *chunks.emplace_back(std::make_unique<Chunk>(text, settings));
+        chunk.m_converter.set_first_line(first_line);
+        chunk.m_begin = i ? cuts[i - 1].m_begin : 0;
+        chunk.m_end = i < cuts.size() ? cuts[i].m_begin : text.size();
+        chunk.m_first_line = i ? cuts[i - 1].m_line_number : 1;
+    }
+
+    auto convert_f = [text, &environments, trace = settings.m_trace](Chunk& chunk) {
+        try {
+            Span span{trace, "lex", phase_time(chunk.m_stats_ptr, Phase::Lex)};
+            Lexer lexer{text, environments, chunk.m_begin, chunk.m_end, chunk.m_first_line};
+            while (lexer.next_line(chunk.m_tokens)) {}
+        }
+        catch (...) {
+            chunk.m_lex_error = std::current_exception();
+            return;
+        }
+        try {
+            chunk.m_converter.feed(chunk.m_tokens);
+        }
+        catch (...) {
+            chunk.m_convert_error = std::current_exception();
+        }
+    };
+
+    if (chunks.size() == 1) {
+        // Nowhere to split the converting, but the lexing still can be
+        auto& chunk = *chunks.front();
+        {
+            Span span{settings.m_trace, "lex", phase_time(chunk.m_stats_ptr, Phase::Lex)};
+            lex_in_parallel(text, environments, chunk.m_tokens, pool);
+        }
+        chunk.m_converter.feed(chunk.m_tokens);
+    }
+    else {
+        for (auto& chunk : chunks) {
+            pool.submit([&convert_f, &chunk = *chunk]() { convert_f(chunk); });
+        }
+        pool.wait();
+    }
+
+    // All the lexing happens before any converting when done at once, so any
+    // lexing error comes first
+    for (const auto& chunk : chunks) {
+        if (chunk->m_lex_error) {
+            std::rethrow_exception(chunk->m_lex_error);
+        }
+    }
+
+    std::string tex;
+    std::optional<Converter::Boundary> boundary;
+    auto append_f = [&](const Chunk& chunk) {
+        const auto first_front = chunk.m_converter.first_front();
+        if (boundary && first_front && needs_space(boundary->m_front, boundary->m_back, *first_front)) {
+            tex += ' ';
+        }
+        tex += chunk.m_tex;
+    };
+
+    Chunk* current = chunks.front().get();
+    if (current->m_convert_error) {
+        std::rethrow_exception(current->m_convert_error);
+    }
+    for (std::size_t i = 1; i < chunks.size(); ++i) {
+        auto& chunk = *chunks[i];
+        auto next_boundary = current->m_converter.finish_chunk();
+        if (!next_boundary) {
+            // Not independent after all, so carry on from the chunk before
+            current->m_converter.feed(chunk.m_tokens);
+            chunk.m_is_independent = false;
+            continue;
+        }
+
+        append_f(*current);
+        boundary = next_boundary;
+        current = &chunk;
+        if (current->m_convert_error) {
+            std::rethrow_exception(current->m_convert_error);
+        }
+    }
+    current->m_converter.finish();
+    append_f(*current);
+
+    if (settings.m_stats) {
+        for (auto& chunk : chunks) {
+            chunk->m_stats.count_tokens(chunk->m_tokens);
+            if (!chunk->m_is_independent) {
+                // Its blocks were made again by the converter before, only the
+                // time spent on them counts
+                CompileStats time_only;
+                time_only.m_phase_times = chunk->m_stats.m_phase_times;
+                time_only.m_n_tokens = chunk->m_stats.m_n_tokens;
+                chunk->m_stats = time_only;
+            }
+            *settings.m_stats += chunk->m_stats;
+        }
+        settings.m_stats->m_n_output_bytes += tex.size();
+    }
+    return tex;
+}
+
+
+// Fills in m_errors once compiling has failed, looking for more than the first
+// only if they were asked for
+void find_all_errors(CompileResult& result, std::string_view source, const CompileSettings& settings) {
+    if (settings.m_max_errors > 1) {
+        result.m_errors = find_errors(source, settings);
+    }
+    if (result.m_errors.empty()) {
+        result.m_errors.push_back(*result.m_error);
+    }
+}
+
+
+CompileResult compile(std::string_view source, const CompileSettings& settings) {
+    CompileResult result;
+    try {
+        const SourceEnvironments environments{source, *settings.m_environments};
+        if (settings.m_pool) {
+            result.m_tex = convert_to_tex(source, environments.get(), *settings.m_pool, settings);
+        }
+        else {
+            Arena arena{settings.m_arena_kind, settings.m_upstream};
+            std::optional<ProfilingResource> tokens_profiling;
+            auto* tokens_resource = ProfilingResource::wrap(
+                tokens_profiling, settings.m_stats, Structure::Tokens, arena.resource());
+
+            std::optional<Tokens> tokens;
+            {
+                Span span{settings.m_trace, "lex", phase_time(settings.m_stats, Phase::Lex)};
+                PhaseScope phase{settings.m_stats, Phase::Lex};
+                tokens = lex(source, environments.get(), tokens_resource);
+            }
+            if (settings.m_stats) {
+                settings.m_stats->count_tokens(*tokens);
+            }
+            result.m_tex = convert_to_tex(*tokens, arena.resource(), settings.m_stats, settings.m_trace);
+            if (settings.m_stats) {
+                settings.m_stats->m_n_output_bytes += result.m_tex.size();
+            }
+        }
+    }
+    catch (const Exception& e) {
+        result.m_tex.clear();
+        result.m_error = e.m_message;
+        find_all_errors(result, source, settings);
+    }
+    return result;
+}
+
+
+CompileResult compile(
+    std::string_view source,
+    const tex_sink_t& sink,
+    const CompileSettings& settings) {
+    CompileResult result;
+    try {
+        const SourceEnvironments environments{source, *settings.m_environments};
+        Arena arena{settings.m_arena_kind, settings.m_upstream};
+        Lexer lexer{source, environments.get()};
+        convert_to_tex(lexer, sink, arena.resource(), settings.m_stats, settings.m_trace);
+    }
+    catch (const Exception& e) {
+        result.m_error = e.m_message;
+        find_all_errors(result, source, settings);
+    }
+    return result;
+}
+
+
+// A line at a time, as streaming is, so that the tokens are never all held. But
+// compiling lexes all of the source before converting any of it, so once the
+// blocks fail the rest is still lexed, as an error there is the one reported.
+CompileResult check(std::string_view source, const CompileSettings& settings) {
+    CompileStats* stats = settings.m_stats;
+    Trace* trace = settings.m_trace;
+
+    CompileResult result;
+    try {
+        const SourceEnvironments environments{source, *settings.m_environments};
+        Arena arena{settings.m_arena_kind, settings.m_upstream};
+        std::optional<ProfilingResource> tokens_profiling;
+        Lexer lexer{source, environments.get()};
+        Tokens line{source, ProfilingResource::wrap(tokens_profiling, stats, Structure::Tokens, arena.resource())};
+        std::string tex;
+        Converter converter{tex, arena.resource(), stats, trace};
+        converter.check_only();
+
+        auto next_line_f = [&]() {
+            line.clear();
+            Span span{trace, "lex", phase_time(stats, Phase::Lex)};
+            PhaseScope phase{stats, Phase::Lex};
+            return lexer.next_line(line);
+        };
+
+        std::optional<Exception> convert_error;
+        while (next_line_f()) {
+            if (stats) {
+                stats->count_tokens(line);
+            }
+            if (convert_error) {
+                continue;
+            }
+            try {
+                converter.feed(line);
+            }
+            catch (const Exception& e) {
+                convert_error = e;
+            }
+        }
+        if (convert_error) {
+            throw *convert_error;
+        }
+        converter.finish();
+    }
+    catch (const Exception& e) {
+        result.m_error = e.m_message;
+        find_all_errors(result, source, settings);
+    }
+    return result;
+}
+
+
+// As check, a line at a time and making no tex, but in the order of the lines
+// rather than lexing everything first, so that the errors come in that order.
+// The lexer carries on through every line, whatever the blocks do, so that the
+// brackets it counts are right.
+std::vector<std::string> find_errors(std::string_view source, const CompileSettings& settings) {
+    ErrorLog log{std::max<std::size_t>(settings.m_max_errors, 1)};
+    try {
+        const SourceEnvironments environments{source, *settings.m_environments};
+        Arena arena{settings.m_arena_kind, settings.m_upstream};
+        Lexer lexer{source, environments.get()};
+        lexer.recover_into(log);
+        Tokens line{source, arena.resource()};
+        std::string tex;
+        std::optional<Converter> converter;
+        const std::size_t first_line = find_first_line(source);
+        auto start_f = [&]() {
+            converter.emplace(tex, arena.resource());
+            converter->check_only();
+            converter->recover_into(log);
+            converter->set_first_line(first_line);
+        };
+
+        start_f();
+        while (lexer.next_line(line)) {
+            if (!converter) {
+                const std::size_t begin = line.begin(0);
+                const auto text = source.substr(begin, source.find('\n', begin) - begin);
+                if (!is_top_level_line(text, classify_line(text))) {
+                    line.clear();
+                    continue;
+                }
+                start_f();
+            }
+            try {
+                converter->feed(line);
+            }
+            catch (const Exception& e) {
+                log.report(e);
+                converter.reset();
+            }
+            line.clear();
+        }
+        if (converter) {
+            converter->finish();
+        }
+    }
+    catch (const Exception& e) {
+        log.m_errors.push_back(e.m_message);
+    }
+    return std::move(log.m_errors);
+}
+
+
+std::size_t get_error_line(std::string_view error) {
+    std::size_t line = 0;
+    if (error.starts_with('[')) {
+        std::from_chars(error.data() + 1, error.data() + error.size(), line);
+    }
+    return line;
+}
+
+} // ntx
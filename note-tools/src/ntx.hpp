@@ -0,0 +1,93 @@
+#pragma once
+
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.hpp"
+#include "environments.hpp"
+#include "pool.hpp"
+#include "stats.hpp"
+
+
+namespace ntx {
+
+// Where compiling gets its memory and threads, and the environments it knows. By
+// default it is all on the calling thread, using the heap.
+struct CompileSettings
+{
+    Arena::Kind m_arena_kind = Arena::Kind::Heap;
+    // Where the arena gets its memory. Must be thread safe if there is a pool.
+    std::pmr::memory_resource* m_upstream = std::pmr::new_delete_resource();
+
+    // If set a big source is split between its threads, in which case compile
+    // must not be called from one of its tasks
+    WorkStealingPool* m_pool = nullptr;
+
+    // If set the phases of compiling are timed and what they made counted into
+    // m_stats (which is added to), and spans of them recorded in m_trace. Memory
+    // is counted too if m_stats->m_memory is set, but only when not split between
+    // threads.
+    CompileStats* m_stats = nullptr;
+    Trace* m_trace = nullptr;
+
+    // How many errors to report at most. Compiling stops at the first, and only
+    // if there is one is the source checked again for the rest (see find_errors),
+    // so more cost nothing while the source compiles.
+    std::size_t m_max_errors = 1;
+
+    // The environments a source can declare, along with those its own
+    // "% CMD environment" lines add (see SourceEnvironments). Must not be added to
+    // while anything compiles with them.
+    const Environments* m_environments = &s_environments;
+};
+
+struct CompileResult
+{
+    // Without the ntx footer, empty if there was an error
+    std::string m_tex;
+    // Why the source could not be compiled, as the command line reports it
+    std::optional<std::string> m_error;
+    // If there was an error, every error found (at most m_max_errors of them) in
+    // the order of their lines. Just m_error unless more were asked for.
+    std::vector<std::string> m_errors;
+
+    explicit operator bool() const { return !m_error; }
+};
+
+using tex_sink_t = std::function<void(std::string_view)>;
+
+// Compiles ntx source to tex, without reading or writing any files. All the
+// state lives in the call (the settings' environments are only ever read, and
+// those the source declares are its own), so any number of threads can compile
+// at once. An environment the source cannot declare is an error of the source.
+CompileResult compile(std::string_view source, const CompileSettings& settings = {});
+
+// As above but the tex is passed to sink as each top level block is complete, so
+// that only the open blocks are held. On an error sink will have been given the
+// tex up to it. Always on the calling thread.
+CompileResult compile(
+    std::string_view source,
+    const tex_sink_t& sink,
+    const CompileSettings& settings = {});
+
+// Whether source compiles, and if not why (the same error compile gives), without
+// making any tex: it is lexed and its blocks followed but nothing is amalgamated
+// or written. m_tex is always empty. Always on the calling thread.
+CompileResult check(std::string_view source, const CompileSettings& settings = {});
+
+// Every error in source, up to settings.m_max_errors, in the order of their
+// lines. Indentation errors and brackets left open are carried on past where
+// they are. Anything else leaves the blocks in no state to carry on from, so
+// they are picked up again at the next top level line (see is_top_level_line)
+// as if a new file started there.
+std::vector<std::string> find_errors(std::string_view source, const CompileSettings& settings = {});
+
+// The line (counted from 1) of an error, from the "[line:column]" it starts
+// with, or 0 if it has none
+std::size_t get_error_line(std::string_view error);
+
+} // ntx
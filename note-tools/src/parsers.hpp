@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+
+namespace ntx {
+
+// Hand written replacement for the line level regexes that used to live in
+// ntx::patterns, i.e.
+//
+//     tag         = "^% TAG (.+)"
+//     cmd         = "^% CMD (.+) (.+)"
+//     env_decl    = "^[ ]*\\\\([A-z]+)[ ]*([^ ]*)"
+//     section_def = "^[ ]*\\\\([A-z]+)[ ]*(.*)"
+//
+// The captures are views into the line that was classified, so nothing is
+// allocated. Note that (as with std::regex) '.' does not match '\r' or '\n'
+// and [A-z] is the raw character range, so it also takes [\]^_`.
+
+enum class LineKind
+{
+    Text,
+    Tag,
+    Cmd,
+    Declaration
+};
+
+struct LineClass
+{
+    LineKind m_kind;
+
+    // Tag         -> m_first = tag
+    // Cmd         -> m_first = command, m_second = argument
+    // Declaration -> m_first = name,    m_second = label
+    std::string_view m_first = {};
+    std::string_view m_second = {};
+};
+
+
+namespace detail {
+
+constexpr bool is_name_char(char c) {
+    return static_cast<unsigned char>(c) >= 'A' && static_cast<unsigned char>(c) <= 'z';
+}
+
+constexpr bool is_line_end(char c) {
+    return c == '\n' || c == '\r';
+}
+
+// Equivalent to (.+) being able to consume all of s
+constexpr bool is_dot_plus(std::string_view s) {
+    if (s.empty()) return false;
+    for (char c : s) {
+        if (is_line_end(c)) return false;
+    }
+    return true;
+}
+
+} // detail
+
+
+constexpr LineClass classify_line(std::string_view line) {
+    using namespace detail;
+
+    // % TAG ... / % CMD ...
+    if (line.starts_with("% TAG ")) {
+        if (auto rest = line.substr(6); is_dot_plus(rest)) {
+            return {LineKind::Tag, rest};
+        }
+        return {LineKind::Text};
+    }
+
+    if (line.starts_with("% CMD ")) {
+        auto rest = line.substr(6);
+        if (!is_dot_plus(rest)) return {LineKind::Text};
+
+        // The first group is greedy so we split on the last space that leaves
+        // both groups non-empty
+        for (std::size_t pos = rest.length() - 1; pos-- > 1;) {
+            if (rest[pos] == ' ') {
+                return {LineKind::Cmd, rest.substr(0, pos), rest.substr(pos + 1)};
+            }
+        }
+        return {LineKind::Text};
+    }
+
+    // [ ]*\\name[ ]*label
+    std::size_t pos = 0;
+    const std::size_t n = line.length();
+
+    while (pos < n && line[pos] == ' ') ++pos;
+    if (pos == n || line[pos] != '\\') return {LineKind::Text};
+
+    const std::size_t name_begin = ++pos;
+    while (pos < n && is_name_char(line[pos])) ++pos;
+    if (pos == name_begin) return {LineKind::Text};
+
+    const std::size_t name_end = pos;
+    while (pos < n && line[pos] == ' ') ++pos;
+
+    // env_decl requires the label to have no spaces, section_def requires it to
+    // have no line ends. The name and label are the same for both.
+    bool has_space = false;
+    bool has_line_end = false;
+    for (std::size_t i = pos; i < n; ++i) {
+        has_space = has_space || line[i] == ' ';
+        has_line_end = has_line_end || is_line_end(line[i]);
+    }
+    if (has_space && has_line_end) return {LineKind::Text};
+
+    return {
+        LineKind::Declaration,
+        line.substr(name_begin, name_end - name_begin),
+        line.substr(pos)
+    };
+}
+
+} // ntx
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+
+namespace ntx {
+
+// Runs tasks on a fixed number of threads. Every worker has its own queue: it
+// takes tasks from the back of its own and, once that is empty, steals from the
+// front of the others'. So a worker that is given a few long tasks (big files)
+// does not hold up the rest, which are taken by whoever is free.
+//
+// Tasks must not throw.
+class WorkStealingPool
+{
+public:
+    using task_t = std::function<void()>;
+
+    explicit WorkStealingPool(std::size_t n_threads) {
+        if (n_threads == 0) n_threads = 1;
+
+        for (std::size_t i = 0; i < n_threads; ++i) {
+            m_queues.push_back(std::make_unique<Queue>());
+        }
+        for (std::size_t i = 0; i < n_threads; ++i) {
+            m_threads.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator = (const WorkStealingPool&) = delete;
+
+    // Finishes all the tasks that have been submitted
+    ~WorkStealingPool() {
+        wait();
+        {
+            std::lock_guard lock{m_mutex};
+            m_stop = true;
+        }
+        m_work_available.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    std::size_t size() const { return m_threads.size(); }
+
+    // Tasks are dealt out round robin, unless submitted from a task in which case
+    // they go on the back of that worker's own queue
+    void submit(task_t task) {
+        const std::size_t queue = s_worker && s_worker->m_pool == this
+            ? s_worker->m_index
+            : m_next_queue++ % m_queues.size();
+
+        m_n_pending.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard lock{m_queues[queue]->m_mutex};
+            m_queues[queue]->m_tasks.push_back(std::move(task));
+        }
+        {
+            // Taken so that a worker cannot miss the notification between
+            // finding no work and going to sleep
+            std::lock_guard lock{m_mutex};
+            ++m_n_queued;
+        }
+        m_work_available.notify_one();
+    }
+
+    // Blocks until every task submitted so far has finished
+    void wait() {
+        std::unique_lock lock{m_mutex};
+        m_all_done.wait(lock, [this]() { return m_n_pending.load() == 0; });
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex m_mutex;
+        std::deque<task_t> m_tasks;
+    };
+
+    struct Worker
+    {
+        const WorkStealingPool* m_pool;
+        std::size_t m_index;
+    };
+
+    std::optional<task_t> pop(std::size_t index) {
+        auto& own = *m_queues[index];
+        {
+            std::lock_guard lock{own.m_mutex};
+            if (!own.m_tasks.empty()) {
+                auto task = std::move(own.m_tasks.back());
+                own.m_tasks.pop_back();
+                return task;
+            }
+        }
+
+        for (std::size_t offset = 1; offset < m_queues.size(); ++offset) {
+            auto& other = *m_queues[(index + offset) % m_queues.size()];
+            std::lock_guard lock{other.m_mutex};
+            if (!other.m_tasks.empty()) {
+                auto task = std::move(other.m_tasks.front());
+                other.m_tasks.pop_front();
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void work(std::size_t index) {
+        Worker worker{this, index};
+        s_worker = &worker;
+
+        while (true) {
+            {
+                std::unique_lock lock{m_mutex};
+                m_work_available.wait(lock, [this]() { return m_stop || m_n_queued > 0; });
+                if (m_n_queued == 0) {
+                    return;
+                }
+                // We claim a task now, so it is there for us in some queue
+                --m_n_queued;
+            }
+
+            auto task = pop(index);
+            while (!task) {
+                std::this_thread::yield();
+                task = pop(index);
+            }
+            (*task)();
+
+            if (m_n_pending.fetch_sub(1) == 1) {
+                std::lock_guard lock{m_mutex};
+                m_all_done.notify_all();
+            }
+        }
+    }
+
+    inline static thread_local Worker* s_worker = nullptr;
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<std::size_t> m_next_queue = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_all_done;
+    std::size_t m_n_queued = 0;
+    bool m_stop = false;
+
+    // Submitted but not finished
+    std::atomic<std::size_t> m_n_pending = 0;
+};
+
+} // ntx
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+namespace ntx {
+
+// Output builder. A rope owns the text written directly into it and holds the
+// ropes of its children by pointer at the offsets they were spliced in. So a
+// completed child block is moved into its parent without copying its text, and
+// the text of every block is only written out once, when the top level rope is.
+class Rope
+{
+public:
+    // Ropes live in whichever memory resource made them
+    struct Deleter
+    {
+        void operator()(Rope* rope) const {
+            auto alloc = rope->m_text.get_allocator();
+            alloc.delete_object(rope);
+        }
+    };
+
+    using ptr_t = std::unique_ptr<Rope, Deleter>;
+
+    static ptr_t make(std::pmr::memory_resource* resource) {
+        std::pmr::polymorphic_allocator<> alloc{resource};
+        return ptr_t{alloc.new_object<Rope>(resource)};
+    }
+
+    explicit Rope(std::pmr::memory_resource* resource)
+        : m_text{resource}
+        , m_children{resource}
+    { }
+
+    // Either a view of some text (the source or a literal) or a whole rope
+    struct Segment
+    {
+        Segment(std::string_view data) : m_data{data} {}
+        Segment(ptr_t rope) : m_rope{std::move(rope)} {}
+
+        // Only meaningful if m_rope is not set
+        std::string_view m_data = {};
+        ptr_t m_rope = {};
+
+        std::size_t size() const { return m_rope ? m_rope->size() : m_data.size(); }
+        bool empty() const { return size() == 0; }
+
+        char front() const { return m_rope ? m_rope->front() : m_data.front(); }
+        char back() const { return m_rope ? m_rope->back() : m_data.back(); }
+
+        bool starts_with(char c) const { return !empty() && front() == c; }
+        bool ends_with(char c) const { return !empty() && back() == c; }
+
+        bool is(std::string_view s) const {
+            if (!m_rope) return m_data == s;
+            return m_rope->size() == s.size() && m_rope->str() == s;
+        }
+
+        bool contains_any_of(std::string_view chars) const {
+            if (!m_rope) return m_data.find_first_of(chars) != std::string_view::npos;
+            return m_rope->contains_any_of(chars);
+        }
+
+        void append_to(std::string& out) const {
+            if (m_rope) m_rope->append_to(out);
+            else out += m_data;
+        }
+    };
+
+    void append(std::string_view data) {
+        m_text += data;
+        m_size += data.size();
+    }
+
+    void append(Segment&& segment) {
+        if (!segment.m_rope) {
+            append(segment.m_data);
+            return;
+        }
+        m_size += segment.m_rope->size();
+        m_children.emplace_back(m_text.size(), std::move(segment.m_rope));
+    }
+
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    char front() const {
+        for (const auto& [offset, child] : m_children) {
+            if (offset > 0) break;
+            if (!child->empty()) return child->front();
+        }
+        return m_text.empty() ? '\0' : m_text.front();
+    }
+
+    char back() const {
+        for (auto it = m_children.rbegin(); it != m_children.rend(); ++it) {
+            if (it->first < m_text.size()) break;
+            if (!it->second->empty()) return it->second->back();
+        }
+        return m_text.empty() ? '\0' : m_text.back();
+    }
+
+    bool contains_any_of(std::string_view chars) const {
+        if (m_text.find_first_of(chars) != std::string::npos) return true;
+        for (const auto& [offset, child] : m_children) {
+            if (child->contains_any_of(chars)) return true;
+        }
+        return false;
+    }
+
+    void append_to(std::string& out) const {
+        for_each_piece([&](std::string_view piece) { out += piece; });
+    }
+
+    std::string str() const {
+        std::string out;
+        out.reserve(m_size);
+        append_to(out);
+        return out;
+    }
+
+private:
+    // Calls f with the text in order, descending into the children
+    template <typename F>
+    void for_each_piece(F&& f) const {
+        std::size_t text_pos = 0;
+        for (const auto& [offset, child] : m_children) {
+            if (offset > text_pos) {
+                f(std::string_view{m_text}.substr(text_pos, offset - text_pos));
+                text_pos = offset;
+            }
+            child->for_each_piece(f);
+        }
+        if (text_pos < m_text.size()) {
+            f(std::string_view{m_text}.substr(text_pos));
+        }
+    }
+
+    std::pmr::string m_text;
+    std::pmr::vector<std::pair<std::size_t /* offset in m_text */, ptr_t>> m_children;
+    std::size_t m_size = 0;
+};
+
+} // ntx
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define NTX_SANITIZING 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define NTX_SANITIZING 1
+#endif
+#endif
+#ifndef NTX_SANITIZING
+#define NTX_SANITIZING 0
+#endif
+
+
+namespace ntx {
+
+struct CharCounts
+{
+    std::uint32_t n_lower_case;
+    std::uint32_t n_upper_case;
+    std::uint32_t n_numerals;
+};
+
+
+// Splits the lines of a text into words. Rather than switching on every
+// character, the text is classified 64 bytes at a time into bit masks (one bit
+// per character) of where the delimiters, lower case, upper case and numeral
+// characters are. The words are then found by jumping between set delimiter
+// bits, and a word's character counts are popcounts over its range of the masks.
+//
+// The blocks are of the text rather than of each line, so short lines share
+// them: the lines are split in order and the blocks the last line ended in are
+// kept for the next. Only the block at the end of the text can run past it.
+//
+// The masks are built with AVX2 or SSE2 when the compiler targets them, and one
+// character at a time otherwise. Without the popcnt instruction (which comes
+// with NTX_NATIVE) std::popcount is a call, so the counts of a word of up to 16
+// characters are looked up a byte at a time instead.
+class WordScanner
+{
+public:
+    explicit WordScanner(std::string_view text) : m_text{text} {}
+
+    // The characters that end a word:
+    //   ' '                          is dropped
+    //   '{' ';'                      is kept as the end of the word
+    //   '}' '[' ']' '(' ')' '+' '*' '/'  is a word on its own
+    static constexpr bool is_delimiter(char c) {
+        switch (c)
+        {
+        case ' ': case '{': case '}': case '[': case ']': case '(': case ')':
+        case ';': case '+': case '*': case '/':
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static constexpr bool is_lower_case(char c) { return c >= 'a' && c <= 'z'; }
+    static constexpr bool is_upper_case(char c) { return c >= 'A' && c <= 'Z'; }
+    static constexpr bool is_numeral(char c) { return c >= '0' && c <= '9'; }
+
+    // Calls f(word, char_counts) for each word of line from pos on, where line is
+    // a view into the text and word one into line. Lines are faster split in the
+    // order they come in the text.
+    template <typename F>
+    void split(std::string_view line, std::size_t pos, F&& f) {
+        const std::size_t offset = static_cast<std::size_t>(line.data() - m_text.data());
+        const std::size_t begin = offset + pos, end = offset + line.size();
+        if (begin >= end) {
+            return;
+        }
+
+        const std::size_t first = begin / 64, last = (end - 1) / 64;
+        scan(first, last + 1);
+
+        auto emit_f = [&](std::size_t w_begin, std::size_t w_end) {
+            if (w_begin < w_end) {
+                f(std::string_view{m_text.data() + w_begin, w_end - w_begin}, count(w_begin, w_end));
+            }
+        };
+
+        std::size_t w_begin = begin;
+        for (std::size_t block = first; block <= last; ++block) {
+            std::uint64_t bits = masks(block).m_delimiters;
+            if (block == first) {
+                bits &= ~std::uint64_t{0} << (begin % 64);
+            }
+            if (block == last) {
+                bits &= ~std::uint64_t{0} >> (63 - (end - 1) % 64);
+            }
+
+            for (; bits; bits &= bits - 1) {
+                const std::size_t d = block * 64 + std::countr_zero(bits);
+                const char c = m_text[d];
+                const bool kept = c == '{' || c == ';';
+                emit_f(w_begin, d + kept);
+                if (c != ' ' && !kept) {
+                    emit_f(d, d + 1);
+                }
+                w_begin = d + 1;
+            }
+        }
+
+        emit_f(w_begin, end);
+    }
+
+private:
+    struct Masks
+    {
+        std::uint64_t m_delimiters;
+        std::uint64_t m_lower_case;
+        std::uint64_t m_upper_case;
+        std::uint64_t m_numerals;
+    };
+
+    const Masks& masks(std::size_t block) const { return m_masks[block - m_first_block]; }
+
+    // Makes sure the masks hold the blocks [first, last) of the text, keeping
+    // those already scanned for the last line
+    void scan(std::size_t first, std::size_t last) {
+        const std::size_t scanned = m_first_block + m_masks.size();
+        if (first < m_first_block || first >= scanned) {
+            m_masks.clear();
+            m_first_block = first;
+        }
+        else if (first > m_first_block) {
+            m_masks.erase(m_masks.begin(), m_masks.begin() + (first - m_first_block));
+            m_first_block = first;
+        }
+
+        for (std::size_t block = m_first_block + m_masks.size(); block < last; ++block) {
+            m_masks.push_back(scan_block(block));
+        }
+    }
+
+    Masks scan_block(std::size_t block) const {
+        const char* p = m_text.data() + block * 64;
+        const std::size_t n = m_text.size() - block * 64;
+        if (n >= 64) {
+            return scan_block(p);
+        }
+
+        // Reading past the end of the text cannot fault as long as we stay in the
+        // same page, and split never looks at the bits past it. Otherwise the tail
+        // is copied out and padded with nul, which is in none of the classes.
+        if (s_can_overread && (reinterpret_cast<std::uintptr_t>(p) & (s_page_size - 1)) <= s_page_size - 64) {
+            return scan_block(p);
+        }
+        alignas(64) char tail[64] = {};
+        std::memcpy(tail, p, n);
+        return scan_block(tail);
+    }
+
+    static Masks scan_block(const char* p) {
+        Masks masks{0, 0, 0, 0};
+#if defined(__AVX2__)
+        for (std::size_t half = 0; half < 2; ++half) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * half));
+            auto eq_f = [&](char c) { return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)); };
+            // Unsigned lo <= c <= hi as a single signed compare
+            auto in_range_f = [&](char lo, char hi) {
+                const __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8(static_cast<char>(lo + 128)));
+                return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi - lo - 127)), shifted);
+            };
+            auto bits_f = [&](__m256i m) {
+                return std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(m))} << (32 * half);
+            };
+            // ( ) * + are a run of ascii
+            const __m256i d = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_or_si256(eq_f(' '), in_range_f('(', '+')),
+                    _mm256_or_si256(eq_f('{'), eq_f('}'))),
+                _mm256_or_si256(
+                    _mm256_or_si256(eq_f('['), eq_f(']')),
+                    _mm256_or_si256(eq_f(';'), eq_f('/'))));
+
+            masks.m_delimiters |= bits_f(d);
+            masks.m_lower_case |= bits_f(in_range_f('a', 'z'));
+            masks.m_upper_case |= bits_f(in_range_f('A', 'Z'));
+            masks.m_numerals |= bits_f(in_range_f('0', '9'));
+        }
+#elif defined(__SSE2__)
+        for (std::size_t quarter = 0; quarter < 4; ++quarter) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * quarter));
+            auto eq_f = [&](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+            // Unsigned lo <= c <= hi as a single signed compare
+            auto in_range_f = [&](char lo, char hi) {
+                const __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8(static_cast<char>(lo + 128)));
+                return _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(hi - lo - 127)), shifted);
+            };
+            auto bits_f = [&](__m128i m) {
+                return std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(m))} << (16 * quarter);
+            };
+            // ( ) * + are a run of ascii
+            const __m128i d = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_or_si128(eq_f(' '), in_range_f('(', '+')),
+                    _mm_or_si128(eq_f('{'), eq_f('}'))),
+                _mm_or_si128(
+                    _mm_or_si128(eq_f('['), eq_f(']')),
+                    _mm_or_si128(eq_f(';'), eq_f('/'))));
+
+            masks.m_delimiters |= bits_f(d);
+            masks.m_lower_case |= bits_f(in_range_f('a', 'z'));
+            masks.m_upper_case |= bits_f(in_range_f('A', 'Z'));
+            masks.m_numerals |= bits_f(in_range_f('0', '9'));
+        }
+#else
+        for (std::size_t i = 0; i < 64; ++i) {
+            const std::uint64_t bit = std::uint64_t{1} << i;
+            if (is_delimiter(p[i])) masks.m_delimiters |= bit;
+            if (is_lower_case(p[i])) masks.m_lower_case |= bit;
+            if (is_upper_case(p[i])) masks.m_upper_case |= bit;
+            if (is_numeral(p[i])) masks.m_numerals |= bit;
+        }
+#endif
+        return masks;
+    }
+
+    CharCounts count(std::size_t begin, std::size_t end) const {
+        const std::size_t first = begin / 64, last = (end - 1) / 64;
+
+        // Almost all words lie within one block
+        if (first == last) {
+            const auto& m = masks(first);
+            const std::size_t shift = begin % 64, n = end - begin;
+            const std::uint64_t range = ~std::uint64_t{0} >> (64 - n);
+            const std::uint64_t lower_case = (m.m_lower_case >> shift) & range;
+            const std::uint64_t upper_case = (m.m_upper_case >> shift) & range;
+            const std::uint64_t numerals = (m.m_numerals >> shift) & range;
+#if !defined(__POPCNT__)
+            if (n <= 8) {
+                return CharCounts{s_popcounts[lower_case], s_popcounts[upper_case], s_popcounts[numerals]};
+            }
+            if (n <= 16) {
+                auto popcount_f = [](std::uint64_t x) {
+                    return static_cast<std::uint32_t>(s_popcounts[x & 0xff] + s_popcounts[x >> 8]);
+                };
+                return CharCounts{popcount_f(lower_case), popcount_f(upper_case), popcount_f(numerals)};
+            }
+#endif
+            return CharCounts{
+                static_cast<std::uint32_t>(std::popcount(lower_case)),
+                static_cast<std::uint32_t>(std::popcount(upper_case)),
+                static_cast<std::uint32_t>(std::popcount(numerals))
+            };
+        }
+
+        CharCounts counts{0, 0, 0};
+        for (std::size_t block = first; block <= last; ++block) {
+            std::uint64_t range = ~std::uint64_t{0};
+            if (block == first) range &= ~std::uint64_t{0} << (begin % 64);
+            if (block == last) range &= ~std::uint64_t{0} >> (63 - (end - 1) % 64);
+            counts.n_lower_case += std::popcount(masks(block).m_lower_case & range);
+            counts.n_upper_case += std::popcount(masks(block).m_upper_case & range);
+            counts.n_numerals += std::popcount(masks(block).m_numerals & range);
+        }
+        return counts;
+    }
+
+    static constexpr std::uintptr_t s_page_size = 4096;
+
+    // The number of bits set in each byte
+    static constexpr auto s_popcounts = []() {
+        std::array<std::uint8_t, 256> counts{};
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            counts[i] = static_cast<std::uint8_t>(std::popcount(i));
+        }
+        return counts;
+    }();
+
+    // The sanitizers rightly see the overread as reading memory that is not ours.
+    // GCC says it is sanitizing with macros, clang only through __has_feature.
+    static constexpr bool s_can_overread = !NTX_SANITIZING;
+
+    std::string_view m_text;
+
+    // The blocks of the text from m_first_block on that the lines being split lie
+    // in, reused between lines
+    std::size_t m_first_block = 0;
+    std::vector<Masks> m_masks;
+};
+
+} // ntx
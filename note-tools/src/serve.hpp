@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pool.hpp"
+
+
+namespace ntx {
+
+// A connected unix socket, over which messages are sent whole: a 32 bit length
+// (in the byte order of the host, as both ends are on it) and then that many
+// bytes.
+class Socket
+{
+public:
+    explicit Socket(int fd = -1) : m_fd{fd} {}
+
+    Socket(Socket&& other) : m_fd{std::exchange(other.m_fd, -1)} {}
+    Socket& operator = (Socket&& other) {
+        std::swap(m_fd, other.m_fd);
+        return *this;
+    }
+
+    ~Socket() {
+        if (m_fd >= 0) ::close(m_fd);
+    }
+
+    int fd() const { return m_fd; }
+    int release() { return std::exchange(m_fd, -1); }
+
+    static Socket connect(const std::string& path) {
+        Socket socket{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        auto address = make_address(path);
+        if (socket.m_fd < 0 ||
+            ::connect(socket.m_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+            throw std::system_error{errno, std::generic_category(), "Cannot connect to '" + path + "'"};
+        }
+        return socket;
+    }
+
+    // Longer than any note or its tex, and the most a peer can make the other end
+    // allocate
+    static constexpr std::uint32_t s_max_message_size = 256 << 20;
+
+    // Returns false if the other end closed the connection before a message, or
+    // said one longer than s_max_message_size was coming, which should be taken
+    // as the connection being lost
+    bool read_message(std::string& message) {
+        std::uint32_t size;
+        if (!read_all(&size, sizeof(size)) || size > s_max_message_size) return false;
+        message.resize(size);
+        return read_all(message.data(), size);
+    }
+
+    bool write_message(std::string_view message) {
+        std::uint32_t size = static_cast<std::uint32_t>(message.size());
+        iovec parts[2] = {
+            {&size, sizeof(size)},
+            {const_cast<char*>(message.data()), message.size()}
+        };
+        return write_all(parts, 2);
+    }
+
+    static sockaddr_un make_address(const std::string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::system_error{ENAMETOOLONG, std::generic_category(), "Socket path '" + path + "'"};
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+private:
+    bool read_all(void* data, std::size_t n) {
+        auto* p = static_cast<char*>(data);
+        while (n > 0) {
+            ssize_t n_read = ::read(m_fd, p, n);
+            if (n_read < 0 && errno == EINTR) continue;
+            if (n_read <= 0) return false;
+            p += n_read;
+            n -= n_read;
+        }
+        return true;
+    }
+
+    bool write_all(iovec* parts, int n_parts) {
+        while (n_parts > 0) {
+            ssize_t n_written = ::writev(m_fd, parts, n_parts);
+            if (n_written < 0 && errno == EINTR) continue;
+            if (n_written < 0) return false;
+            for (; n_parts > 0 && static_cast<std::size_t>(n_written) >= parts->iov_len; ++parts, --n_parts) {
+                n_written -= parts->iov_len;
+            }
+            if (n_parts > 0) {
+                parts->iov_base = static_cast<char*>(parts->iov_base) + n_written;
+                parts->iov_len -= n_written;
+            }
+        }
+        return true;
+    }
+
+    int m_fd;
+};
+
+
+// Answers messages sent over a unix socket. The connections are polled from the
+// thread that calls run, and once one has a message it is handed to the pool,
+// which reads it, works out the reply and sends it back. So a connection only
+// ties up a thread whilst it has a message being handled, and a client can
+// keep its connection open between messages.
+class Server
+{
+public:
+    // Takes the reply to a message
+    using handler_t = std::function<std::string(std::string_view)>;
+
+    Server(const std::string& path, WorkStealingPool& pool)
+        : m_path{path}
+        , m_pool{pool}
+    {
+        m_listener = Socket{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        m_wake = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_listener.fd() < 0 || m_wake < 0) {
+            throw std::system_error{errno, std::generic_category(), "Cannot create socket"};
+        }
+
+        remove_stale_socket(path);
+        auto address = Socket::make_address(path);
+        if (::bind(m_listener.fd(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 ||
+            ::listen(m_listener.fd(), SOMAXCONN) < 0) {
+            throw std::system_error{errno, std::generic_category(), "Cannot listen on '" + path + "'"};
+        }
+    }
+
+    Server(const Server&) = delete;
+    Server& operator = (const Server&) = delete;
+
+    ~Server() {
+        m_pool.wait();
+        for (int fd : m_idle) ::close(fd);
+        ::close(m_wake);
+        ::unlink(m_path.c_str());
+    }
+
+    [[noreturn]] void run(const handler_t& handler) {
+        std::vector<pollfd> pfds;
+        while (true) {
+            pfds.clear();
+            pfds.push_back({m_listener.fd(), POLLIN, 0});
+            pfds.push_back({m_wake, POLLIN, 0});
+            for (int fd : m_idle) {
+                pfds.push_back({fd, POLLIN, 0});
+            }
+
+            if (::poll(pfds.data(), pfds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error{errno, std::generic_category(), "poll"};
+            }
+
+            if (pfds[0].revents & POLLIN) {
+                int fd = ::accept4(m_listener.fd(), nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0) m_idle.push_back(fd);
+            }
+            if (pfds[1].revents & POLLIN) {
+                std::uint64_t n;
+                [[maybe_unused]] auto _ = ::read(m_wake, &n, sizeof(n));
+                std::lock_guard lock{m_mutex};
+                m_idle.insert(m_idle.end(), m_returned.begin(), m_returned.end());
+                m_returned.clear();
+            }
+
+            // A message (or the connection closing) is handled on the pool
+            for (std::size_t i = 2; i < pfds.size(); ++i) {
+                if (!pfds[i].revents) continue;
+                const int fd = pfds[i].fd;
+                m_idle.erase(std::find(m_idle.begin(), m_idle.end(), fd));
+                m_pool.submit([this, fd, &handler]() { handle(fd, handler); });
+            }
+        }
+    }
+
+private:
+    // Removes the socket at path if it was left by a server that was killed, so
+    // no one answers it. Anything else there, including a server that is still
+    // running, is not ours to remove.
+    static void remove_stale_socket(const std::string& path) {
+        struct stat status;
+        if (::lstat(path.c_str(), &status) < 0) {
+            if (errno == ENOENT) return;
+            throw std::system_error{errno, std::generic_category(), "Cannot listen on '" + path + "'"};
+        }
+
+        if (S_ISSOCK(status.st_mode)) {
+            try {
+                Socket::connect(path);
+            }
+            catch (const std::system_error& e) {
+                if (e.code().value() == ECONNREFUSED) {
+                    ::unlink(path.c_str());
+                    return;
+                }
+            }
+        }
+        throw std::system_error{EADDRINUSE, std::generic_category(), "Cannot listen on '" + path + "'"};
+    }
+
+    void handle(int fd, const handler_t& handler) {
+        Socket connection{fd};
+        std::string message;
+        if (!connection.read_message(message) || !connection.write_message(handler(message))) {
+            return;
+        }
+
+        // Back to being polled for the next message
+        {
+            std::lock_guard lock{m_mutex};
+            m_returned.push_back(connection.release());
+        }
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(m_wake, &one, sizeof(one));
+    }
+
+    std::string m_path;
+    WorkStealingPool& m_pool;
+
+    Socket m_listener;
+    // Signalled when a connection is handed back by the pool
+    int m_wake = -1;
+
+    // Connections waiting for a message, only touched by run
+    std::vector<int> m_idle;
+
+    std::mutex m_mutex;
+    std::vector<int> m_returned;
+};
+
+} // ntx
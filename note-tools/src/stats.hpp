@@ -0,0 +1,421 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "tokens.hpp"
+
+
+namespace ntx {
+
+// What compiling a file spends its time on. Parse is converting the tokens to
+// blocks, Amalgamate is writing finished blocks into their parents.
+enum class Phase : std::uint8_t
+{
+    Read,
+    Lex,
+    Parse,
+    Amalgamate,
+    Write
+};
+
+inline constexpr std::size_t s_n_phases = 5;
+inline constexpr std::size_t s_n_token_kinds = 4;
+inline constexpr std::size_t s_n_environment_types = 6;
+
+inline std::string_view to_string(Phase phase) {
+    switch (phase) {
+    case Phase::Read:
+        return "read";
+    case Phase::Lex:
+        return "lex";
+    case Phase::Parse:
+        return "parse";
+    case Phase::Amalgamate:
+        return "amalgamate";
+    case Phase::Write:
+        return "write";
+    }
+    return "";
+}
+
+
+// What compiling holds in memory
+enum class Structure : std::uint8_t
+{
+    // The token table
+    Tokens,
+    // The open blocks, their elements and the labels and sections in them
+    Blocks,
+    // The ropes finished blocks are amalgamated into
+    Amalgamates,
+    // The tex
+    Output
+};
+
+inline constexpr std::size_t s_n_structures = 4;
+
+inline std::string_view to_string(Structure structure) {
+    switch (structure) {
+    case Structure::Tokens:
+        return "tokens";
+    case Structure::Blocks:
+        return "blocks";
+    case Structure::Amalgamates:
+        return "amalgamates";
+    case Structure::Output:
+        return "output";
+    }
+    return "";
+}
+
+struct AllocationCounts
+{
+    std::size_t m_n_allocations = 0;
+    std::size_t m_n_bytes = 0;
+    // Allocated and not yet given back, now and at most
+    std::size_t m_live_bytes = 0;
+    std::size_t m_peak_bytes = 0;
+
+    void allocate(std::size_t bytes) {
+        ++m_n_allocations;
+        m_n_bytes += bytes;
+        m_live_bytes += bytes;
+        m_peak_bytes = std::max(m_peak_bytes, m_live_bytes);
+    }
+
+    void deallocate(std::size_t bytes) {
+        m_live_bytes -= std::min(bytes, m_live_bytes);
+    }
+
+    AllocationCounts& operator += (const AllocationCounts& other) {
+        m_n_allocations += other.m_n_allocations;
+        m_n_bytes += other.m_n_bytes;
+        m_live_bytes += other.m_live_bytes;
+        m_peak_bytes = std::max(m_peak_bytes, other.m_peak_bytes);
+        return *this;
+    }
+};
+
+// Where the memory of compiling a file went: by the phase that asked for it and
+// by the structure it is for. Memory is often given back in a later phase than
+// it was asked for in, so only the structures (and the total) have what was held
+// at once.
+struct MemoryStats
+{
+    std::array<AllocationCounts, s_n_phases> m_phases = {};
+    std::array<AllocationCounts, s_n_structures> m_structures = {};
+    AllocationCounts m_total = {};
+
+    // Of the whole process, as the OS reports it
+    std::size_t m_peak_resident_bytes = 0;
+
+    // Set as compiling moves between phases. What is asked for outside of them
+    // (setting up the converter) is parse's.
+    Phase m_phase = Phase::Parse;
+
+    void allocate(Structure structure, std::size_t bytes) {
+        m_phases[static_cast<std::size_t>(m_phase)].allocate(bytes);
+        m_structures[static_cast<std::size_t>(structure)].allocate(bytes);
+        m_total.allocate(bytes);
+    }
+
+    void deallocate(Structure structure, std::size_t bytes) {
+        m_structures[static_cast<std::size_t>(structure)].deallocate(bytes);
+        m_total.deallocate(bytes);
+    }
+
+    // A string (which cannot take a memory resource) growing from old_capacity.
+    // Short strings are held in the string itself.
+    void reallocate(Structure structure, std::size_t old_capacity, std::size_t new_capacity) {
+        if (new_capacity == old_capacity) {
+            return;
+        }
+        allocate(structure, new_capacity);
+        if (old_capacity > std::string{}.capacity()) {
+            deallocate(structure, old_capacity);
+        }
+    }
+
+    MemoryStats& operator += (const MemoryStats& other) {
+        for (std::size_t i = 0; i < s_n_phases; ++i) m_phases[i] += other.m_phases[i];
+        for (std::size_t i = 0; i < s_n_structures; ++i) m_structures[i] += other.m_structures[i];
+        m_total += other.m_total;
+        m_peak_resident_bytes = std::max(m_peak_resident_bytes, other.m_peak_resident_bytes);
+        return *this;
+    }
+};
+
+
+// Where the time of compiling a file went and what it made. Only filled in when
+// asked for (see CompileSettings::m_stats). When a file is split between threads
+// the times of each part are added together, so are CPU rather than wall times.
+struct CompileStats
+{
+    std::array<std::chrono::nanoseconds, s_n_phases> m_phase_times = {};
+
+    // By TokenKind and EnvironmentType. Sections are counted as they are declared,
+    // although they are written straight into their parent.
+    std::array<std::size_t, s_n_token_kinds> m_n_tokens = {};
+    std::array<std::size_t, s_n_environment_types> m_n_blocks = {};
+
+    // The most blocks open at once, including the root
+    std::size_t m_peak_history_depth = 0;
+
+    std::size_t m_n_output_bytes = 0;
+
+    // Only kept if set before compiling, as every allocation is then counted
+    std::optional<MemoryStats> m_memory;
+
+    std::chrono::nanoseconds& time(Phase phase) {
+        return m_phase_times[static_cast<std::size_t>(phase)];
+    }
+
+    std::chrono::nanoseconds time(Phase phase) const {
+        return m_phase_times[static_cast<std::size_t>(phase)];
+    }
+
+    void count_tokens(const Tokens& tokens) {
+        for (std::size_t pos = 0; pos < tokens.size(); ++pos) {
+            ++m_n_tokens[static_cast<std::size_t>(tokens.kind(pos))];
+        }
+    }
+
+    void count_block(EnvironmentType type, std::size_t history_depth) {
+        ++m_n_blocks[static_cast<std::size_t>(type)];
+        m_peak_history_depth = std::max(m_peak_history_depth, history_depth);
+    }
+
+    CompileStats& operator += (const CompileStats& other) {
+        for (std::size_t i = 0; i < s_n_phases; ++i) m_phase_times[i] += other.m_phase_times[i];
+        for (std::size_t i = 0; i < s_n_token_kinds; ++i) m_n_tokens[i] += other.m_n_tokens[i];
+        for (std::size_t i = 0; i < s_n_environment_types; ++i) m_n_blocks[i] += other.m_n_blocks[i];
+        m_peak_history_depth = std::max(m_peak_history_depth, other.m_peak_history_depth);
+        m_n_output_bytes += other.m_n_output_bytes;
+        if (other.m_memory) {
+            if (!m_memory) m_memory.emplace();
+            *m_memory += *other.m_memory;
+        }
+        return *this;
+    }
+};
+
+
+// Where the time of a phase goes, if stats are being kept
+inline std::chrono::nanoseconds* phase_time(CompileStats* stats, Phase phase) {
+    return stats ? &stats->time(phase) : nullptr;
+}
+
+// Where memory is counted, if it is
+inline MemoryStats* memory_stats(CompileStats* stats) {
+    return stats && stats->m_memory ? &*stats->m_memory : nullptr;
+}
+
+
+// Forwards to upstream, counting what passes through as memory for structure
+class ProfilingResource : public std::pmr::memory_resource
+{
+public:
+    ProfilingResource(MemoryStats& stats, Structure structure, std::pmr::memory_resource* upstream)
+        : m_stats{stats}
+        , m_structure{structure}
+        , m_upstream{upstream}
+    { }
+
+    // The resource to allocate structure from: upstream, or through profiling
+    // (made in profiling) if memory is being counted
+    static std::pmr::memory_resource* wrap(
+        std::optional<ProfilingResource>& profiling,
+        CompileStats* stats,
+        Structure structure,
+        std::pmr::memory_resource* upstream) {
+        if (auto* memory = memory_stats(stats)) {
+            return &profiling.emplace(*memory, structure, upstream);
+        }
+        return upstream;
+    }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        m_stats.allocate(m_structure, bytes);
+        return m_upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        m_stats.deallocate(m_structure, bytes);
+        m_upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    MemoryStats& m_stats;
+    Structure m_structure;
+    std::pmr::memory_resource* m_upstream;
+};
+
+// Counts the memory asked for in its scope as phase's
+class PhaseScope
+{
+public:
+    PhaseScope(CompileStats* stats, Phase phase) : m_memory{memory_stats(stats)} {
+        if (m_memory) {
+            m_outer = std::exchange(m_memory->m_phase, phase);
+        }
+    }
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator = (const PhaseScope&) = delete;
+
+    ~PhaseScope() {
+        if (m_memory) {
+            m_memory->m_phase = m_outer;
+        }
+    }
+
+private:
+    MemoryStats* m_memory;
+    Phase m_outer = Phase::Read;
+};
+
+
+// Spans of time on each thread, written out in the Chrome trace format (which
+// Perfetto and chrome://tracing load). Any number of threads can record at once.
+class Trace
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Event
+    {
+        // Always a literal, so that recording a span does not allocate
+        std::string_view m_name;
+        // Shown with the span, e.g. the file
+        std::string m_detail;
+        std::uint32_t m_thread;
+        clock::time_point m_begin;
+        clock::time_point m_end;
+    };
+
+    Trace() : m_start{clock::now()} {}
+
+    void record(std::string_view name, clock::time_point begin, clock::time_point end, std::string detail = {}) {
+        Event event{name, std::move(detail), thread_index(), begin, end};
+        std::lock_guard lock{m_mutex};
+        m_events.push_back(std::move(event));
+    }
+
+    // A JSON array of complete ("X") events, in microseconds from when the trace
+    // was started
+    std::string to_json() const {
+        std::lock_guard lock{m_mutex};
+
+        auto us_f = [&](clock::time_point t) {
+            return std::to_string(std::chrono::duration<double, std::micro>(t - m_start).count());
+        };
+
+        std::string json = "[\n";
+        for (std::size_t i = 0; i < m_events.size(); ++i) {
+            const auto& event = m_events[i];
+            json += R"({"name":")";
+            json += event.m_name;
+            json += R"(","ph":"X","pid":1,"tid":)";
+            json += std::to_string(event.m_thread);
+            json += R"(,"ts":)";
+            json += us_f(event.m_begin);
+            json += R"(,"dur":)";
+            json += std::to_string(std::chrono::duration<double, std::micro>(event.m_end - event.m_begin).count());
+            if (!event.m_detail.empty()) {
+                json += R"(,"args":{"detail":")";
+                append_escaped(json, event.m_detail);
+                json += R"("})";
+            }
+            json += i + 1 < m_events.size() ? "},\n" : "}\n";
+        }
+        json += "]\n";
+        return json;
+    }
+
+private:
+    // Small and stable, unlike std::thread::id
+    static std::uint32_t thread_index() {
+        static std::atomic<std::uint32_t> s_next = 0;
+        thread_local const std::uint32_t index = s_next++;
+        return index;
+    }
+
+    static void append_escaped(std::string& json, std::string_view s) {
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                json += '\\';
+            }
+            if (static_cast<unsigned char>(c) >= 0x20) {
+                json += c;
+            }
+        }
+    }
+
+    clock::time_point m_start;
+
+    mutable std::mutex m_mutex;
+    std::vector<Event> m_events;
+};
+
+
+// Times its scope, adding the time to a phase and recording it as a span if
+// either is given. Costs a branch when neither is.
+class Span
+{
+public:
+    Span(
+        Trace* trace,
+        std::string_view name,
+        std::chrono::nanoseconds* total = nullptr,
+        std::string_view detail = {})
+        : m_trace{trace}
+        , m_total{total}
+        , m_name{name}
+        , m_detail{detail}
+    {
+        if (m_trace || m_total) {
+            m_begin = Trace::clock::now();
+        }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator = (const Span&) = delete;
+
+    ~Span() {
+        if (!m_trace && !m_total) {
+            return;
+        }
+        const auto end = Trace::clock::now();
+        if (m_total) {
+            *m_total += end - m_begin;
+        }
+        if (m_trace) {
+            m_trace->record(m_name, m_begin, end, std::string{m_detail});
+        }
+    }
+
+private:
+    Trace* m_trace;
+    std::chrono::nanoseconds* m_total;
+    std::string_view m_name;
+    std::string_view m_detail;
+    Trace::clock::time_point m_begin;
+};
+
+} // ntx
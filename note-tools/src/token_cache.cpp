@@ -0,0 +1,212 @@
+#include "token_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "detextion.hpp"
+#include "hash.hpp"
+
+
+namespace ntx {
+
+struct TokenCacheHeader
+{
+    char m_magic[4];
+    std::uint32_t m_version;
+    std::uint64_t m_source_key;
+    std::uint64_t m_source_size;
+    std::uint64_t m_n_tokens;
+    std::uint64_t m_n_declarations;
+    std::uint64_t m_n_name_bytes;
+    // Of everything after the header, so that a file that was written over is
+    // not converted to the wrong tex
+    std::uint64_t m_data_hash;
+};
+
+// A declaration as saved. The label is a view into the source and the short name
+// of its environment one into the pool of names.
+struct CachedDecleration
+{
+    std::uint32_t m_line_number;
+    std::uint32_t m_label_begin;
+    std::uint32_t m_label_length;
+    std::uint32_t m_name_begin;
+    std::uint16_t m_name_length;
+    std::uint8_t m_type;
+    std::uint8_t m_padding;
+};
+
+static constexpr char s_token_cache_magic[4] = {'N', 'T', 'X', 'C'};
+
+static_assert(std::is_trivially_copyable_v<Brackets> && std::is_trivially_copyable_v<CharCounts>);
+
+
+std::string save_tokens(const Tokens& tokens, std::uint64_t source_key) {
+    const std::string_view source = tokens.m_source;
+
+    // The names are a few distinct strings, so each is only saved once
+    std::string names;
+    std::vector<CachedDecleration> declarations;
+    declarations.reserve(tokens.m_declarations.size());
+    for (const auto& decleration : tokens.m_declarations) {
+        const auto& environment = *decleration.m_environment;
+        std::size_t name_begin = names.find(environment.m_short_name);
+        if (name_begin == std::string::npos) {
+            name_begin = names.size();
+            names += environment.m_short_name;
+        }
+
+        // An empty label need not point into the source at all
+        const auto& label = decleration.m_label;
+        const std::size_t label_begin = label.empty() ? 0 : label.data() - source.data();
+
+        declarations.push_back(CachedDecleration{
+            static_cast<std::uint32_t>(decleration.m_line_number),
+            static_cast<std::uint32_t>(label_begin),
+            static_cast<std::uint32_t>(label.size()),
+            static_cast<std::uint32_t>(name_begin),
+            static_cast<std::uint16_t>(environment.m_short_name.size()),
+            static_cast<std::uint8_t>(environment.m_type),
+            0
+        });
+    }
+
+    TokenCacheHeader header{};
+    std::memcpy(header.m_magic, s_token_cache_magic, sizeof(header.m_magic));
+    header.m_version = s_token_cache_version;
+    header.m_source_key = source_key;
+    header.m_source_size = source.size();
+    header.m_n_tokens = tokens.size();
+    header.m_n_declarations = declarations.size();
+    header.m_n_name_bytes = names.size();
+
+    std::string data;
+    auto write_f = [&data](const void* bytes, std::size_t n_bytes) {
+        data.append(static_cast<const char*>(bytes), n_bytes);
+        data.append((8 - data.size() % 8) % 8, '\0');
+    };
+    auto write_column_f = [&write_f](const auto& column) {
+        write_f(column.data(), column.size() * sizeof(column[0]));
+    };
+
+    write_f(&header, sizeof(header));
+    write_column_f(tokens.m_kinds);
+    write_column_f(tokens.m_line_numbers);
+    write_column_f(tokens.m_begins);
+    write_column_f(tokens.m_lengths);
+    write_column_f(tokens.m_brackets);
+    write_column_f(tokens.m_char_counts);
+    write_column_f(declarations);
+    write_f(names.data(), names.size());
+
+    header.m_data_hash = hash_bytes(std::string_view{data}.substr(sizeof(header)));
+    std::memcpy(data.data(), &header, sizeof(header));
+    return data;
+}
+
+
+// Nothing in data is trusted: a file cut short or written over fails a check
+// rather than being read out of bounds.
+std::optional<Tokens> load_tokens(
+    std::string_view data,
+    std::string_view source,
+    std::uint64_t source_key,
+    const Environments& environments,
+    std::pmr::memory_resource* resource) {
+    TokenCacheHeader header;
+    if (data.size() < sizeof(header)) {
+        return std::nullopt;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.m_magic, s_token_cache_magic, sizeof(header.m_magic)) != 0
+        || header.m_version != s_token_cache_version
+        || header.m_source_key != source_key
+        || header.m_source_size != source.size()
+        || header.m_data_hash != hash_bytes(data.substr(sizeof(header)))) {
+        return std::nullopt;
+    }
+
+    std::size_t offset = sizeof(header);
+    auto read_f = [&](void* bytes, std::size_t n, std::size_t size) {
+        // Checked by division so that a huge count cannot overflow
+        if (n > (data.size() - offset) / size) {
+            return false;
+        }
+        std::memcpy(bytes, data.data() + offset, n * size);
+        offset += n * size;
+        offset += (8 - offset % 8) % 8;
+        offset = std::min(offset, data.size());
+        return true;
+    };
+    auto read_column_f = [&](auto& column, std::size_t n) {
+        column.resize(n);
+        return read_f(column.data(), n, sizeof(column[0]));
+    };
+
+    // Checked before anything is allocated for them
+    const std::size_t n_tokens = header.m_n_tokens;
+    if (n_tokens > data.size()) {
+        return std::nullopt;
+    }
+
+    Tokens tokens{source, resource};
+    std::vector<CachedDecleration> declarations;
+    std::string names;
+    if (!read_column_f(tokens.m_kinds, n_tokens)
+        || !read_column_f(tokens.m_line_numbers, n_tokens)
+        || !read_column_f(tokens.m_begins, n_tokens)
+        || !read_column_f(tokens.m_lengths, n_tokens)
+        || !read_column_f(tokens.m_brackets, n_tokens)
+        || !read_column_f(tokens.m_char_counts, n_tokens)
+        || header.m_n_declarations > n_tokens
+        || !read_column_f(declarations, header.m_n_declarations)
+        || header.m_n_name_bytes > data.size()
+        || !read_column_f(names, header.m_n_name_bytes)) {
+        return std::nullopt;
+    }
+
+    for (std::size_t pos = 0; pos < n_tokens; ++pos) {
+        const auto kind = tokens.m_kinds[pos];
+        if (kind > TokenKind::Element) {
+            return std::nullopt;
+        }
+        const std::size_t begin = tokens.m_begins[pos];
+        const std::size_t end = begin + tokens.m_lengths[pos];
+        if (kind == TokenKind::EnvironmentDecleration ? begin >= declarations.size() : end > source.size()) {
+            return std::nullopt;
+        }
+    }
+
+    // The environments are looked up again by short name, each only once, and
+    // must still be of the type they were saved with
+    std::vector<const Environment*> resolved(names.size());
+    tokens.m_declarations.reserve(declarations.size());
+    for (const auto& cached : declarations) {
+        if (cached.m_name_begin >= names.size()
+            || cached.m_name_begin + std::size_t{cached.m_name_length} > names.size()
+            || cached.m_label_begin + std::size_t{cached.m_label_length} > source.size()) {
+            return std::nullopt;
+        }
+
+        auto& environment = resolved[cached.m_name_begin];
+        const std::string_view saved_name{names.data() + cached.m_name_begin, cached.m_name_length};
+        if (!environment || environment->m_short_name != saved_name) {
+            environment = environments.find(saved_name);
+        }
+        if (!environment || static_cast<std::uint8_t>(environment->m_type) != cached.m_type) {
+            return std::nullopt;
+        }
+
+        tokens.m_declarations.push_back(EnvironmentDecleration{
+            cached.m_line_number,
+            environment,
+            source.substr(cached.m_label_begin, cached.m_label_length)
+        });
+    }
+
+    return tokens;
+}
+
+} // ntx
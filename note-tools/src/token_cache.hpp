@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "environments.hpp"
+#include "tokens.hpp"
+
+
+namespace ntx {
+
+// A binary copy of the lexer's output (a .ntxc file), so that an unchanged
+// source can be converted without lexing it again. It is a header followed by
+// each column of the token table as it is in memory, then the declarations with
+// their labels as offsets into the source and the short names of their
+// environments in a pool of strings:
+//
+//     header | kinds | line numbers | begins | lengths | brackets | char counts
+//            | declarations | names
+//
+// Each part starts at a multiple of 8 bytes. Numbers are in the host's byte
+// order, as the file is only ever read back on the machine that wrote it.
+//
+// The header holds the format version and the source's key, a hash of the source
+// and of everything else that decides the tokens (the ntx version and the
+// environments it uses, see get_compile_salt), so a stale file is never used, and
+// a hash of the rest of the file.
+static constexpr std::uint32_t s_token_cache_version = 4;
+
+// The bytes of the .ntxc file for tokens of the source with this key
+std::string save_tokens(const Tokens& tokens, std::uint64_t source_key);
+
+// The tokens saved in data, if it is a .ntxc file of this version for the source
+// with this key, otherwise nothing. The environments are looked up again in
+// those the source can declare. The tokens refer to source and environments (but
+// not to data) so they must outlive them.
+std::optional<Tokens> load_tokens(
+    std::string_view data,
+    std::string_view source,
+    std::uint64_t source_key,
+    const Environments& environments,
+    std::pmr::memory_resource* resource);
+
+} // ntx
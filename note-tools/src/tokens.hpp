@@ -0,0 +1,304 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "scan.hpp"
+
+
+namespace ntx {
+
+struct LineBreak
+{
+    std::size_t m_line_number;
+
+    bool is_empty;
+    std::size_t m_indent;
+};
+
+
+enum class EnvironmentType
+{
+    Section,
+    PlainText,
+    MathBlock,
+    MathInline,
+    Array,
+    ListItem
+};
+
+inline std::string_view to_string(EnvironmentType e_type) {
+    switch (e_type) {
+    case EnvironmentType::Section:
+        return "Section";
+    case EnvironmentType::PlainText:
+        return "PlainText";
+    case EnvironmentType::MathBlock:
+        return "MathBlock";
+    case EnvironmentType::MathInline:
+        return "MathInline";
+    case EnvironmentType::Array:
+        return "Array";
+    case EnvironmentType::ListItem:
+        return "ListItem";
+    default:
+        assert(false);
+    }
+    return "";
+}
+
+struct Environment;
+class Environments;
+
+struct EnvironmentDecleration
+{
+    std::size_t m_line_number;
+
+    // One of those the source can declare, which outlive the tokens
+    const Environment* m_environment;
+    std::string_view m_label;
+};
+
+// The open bracket counts when a word was read. They are only ever compared with
+// each other (or zero) so are kept modulo 2^16, like the lexer's counters wrap.
+struct Brackets
+{
+    std::uint16_t m_round;
+    std::uint16_t m_square;
+    std::uint16_t m_curly;
+};
+
+// A word, as read out of the token table
+struct Element
+{
+    std::size_t m_line_number;
+
+    std::uint16_t m_open_b_round;
+    std::uint16_t m_open_b_square;
+    std::uint16_t m_open_b_curly;
+
+    std::uint32_t n_lower_case;
+    std::uint32_t n_upper_case;
+    std::uint32_t n_numerals;
+
+    std::string_view m_data;
+};
+
+
+enum class TokenKind : std::uint8_t
+{
+    LineBreak,
+    BlankLine,
+    EnvironmentDecleration,
+    Element
+};
+
+inline std::string_view to_string(TokenKind kind) {
+    switch (kind) {
+    case TokenKind::LineBreak:
+        return "LineBreak";
+    case TokenKind::BlankLine:
+        return "BlankLine";
+    case TokenKind::EnvironmentDecleration:
+        return "EnvironmentDecleration";
+    case TokenKind::Element:
+        return "Element";
+    }
+    return "";
+}
+
+inline bool is_line_break(TokenKind kind) {
+    return kind == TokenKind::LineBreak || kind == TokenKind::BlankLine;
+}
+
+// The lexer's output. Each column holds one field for every token so that the
+// converter, which mostly looks at kinds and words, walks small dense arrays
+// rather than a vector of variants sized for the largest of them. Text is kept as
+// an offset and length into the source (which must outlive the table).
+//
+// The columns are shared by all kinds:
+//   LineBreak              -> text is the indent
+//   BlankLine              -> text is empty
+//   EnvironmentDecleration -> m_begins is an index into m_declarations, as the
+//                             environment comes from the lexer's environments
+//                             rather than the source
+//   Element                -> text is the word, with its brackets and char counts
+class Tokens
+{
+public:
+    Tokens(std::string_view source, std::pmr::memory_resource* resource)
+        : m_source{source}
+        , m_kinds{resource}
+        , m_line_numbers{resource}
+        , m_begins{resource}
+        , m_lengths{resource}
+        , m_brackets{resource}
+        , m_char_counts{resource}
+        , m_declarations{resource}
+    { }
+
+    std::size_t size() const { return m_kinds.size(); }
+    bool empty() const { return m_kinds.empty(); }
+
+    void clear() {
+        m_kinds.clear();
+        m_line_numbers.clear();
+        m_begins.clear();
+        m_lengths.clear();
+        m_brackets.clear();
+        m_char_counts.clear();
+        m_declarations.clear();
+    }
+
+    void reserve(std::size_t n) {
+        m_kinds.reserve(n);
+        m_line_numbers.reserve(n);
+        m_begins.reserve(n);
+        m_lengths.reserve(n);
+        m_brackets.reserve(n);
+        m_char_counts.reserve(n);
+    }
+
+    // Appends the tokens of other, which must be of the same source
+    void append(const Tokens& other) {
+        const std::size_t n = size();
+        const auto n_declarations = static_cast<std::uint32_t>(m_declarations.size());
+
+        m_kinds.insert(m_kinds.end(), other.m_kinds.begin(), other.m_kinds.end());
+        m_line_numbers.insert(m_line_numbers.end(), other.m_line_numbers.begin(), other.m_line_numbers.end());
+        m_begins.insert(m_begins.end(), other.m_begins.begin(), other.m_begins.end());
+        m_lengths.insert(m_lengths.end(), other.m_lengths.begin(), other.m_lengths.end());
+        m_brackets.insert(m_brackets.end(), other.m_brackets.begin(), other.m_brackets.end());
+        m_char_counts.insert(m_char_counts.end(), other.m_char_counts.begin(), other.m_char_counts.end());
+        m_declarations.insert(m_declarations.end(), other.m_declarations.begin(), other.m_declarations.end());
+
+        if (n_declarations && !other.m_declarations.empty()) {
+            for (std::size_t pos = n; pos < size(); ++pos) {
+                if (m_kinds[pos] == TokenKind::EnvironmentDecleration) {
+                    m_begins[pos] += n_declarations;
+                }
+            }
+        }
+    }
+
+    TokenKind kind(std::size_t pos) const { return m_kinds[pos]; }
+    std::size_t line_number(std::size_t pos) const { return m_line_numbers[pos]; }
+
+    // Offset of the token in the source. For line breaks this is the start of the line.
+    std::size_t begin(std::size_t pos) const { return m_begins[pos]; }
+
+    std::string_view text(std::size_t pos) const {
+        if (m_kinds[pos] == TokenKind::EnvironmentDecleration) {
+            return m_declarations[m_begins[pos]].m_label;
+        }
+        return m_source.substr(m_begins[pos], m_lengths[pos]);
+    }
+
+    // The bracket counts of an element, zero for everything else
+    const Brackets& brackets(std::size_t pos) const { return m_brackets[pos]; }
+
+    LineBreak line_break(std::size_t pos) const {
+        assert(is_line_break(m_kinds[pos]));
+        return LineBreak{m_line_numbers[pos], m_kinds[pos] == TokenKind::BlankLine, m_lengths[pos]};
+    }
+
+    const EnvironmentDecleration& environment_decleration(std::size_t pos) const {
+        assert(m_kinds[pos] == TokenKind::EnvironmentDecleration);
+        return m_declarations[m_begins[pos]];
+    }
+
+    Element element(std::size_t pos) const {
+        assert(m_kinds[pos] == TokenKind::Element);
+        const auto& b = m_brackets[pos];
+        const auto& c = m_char_counts[pos];
+        return Element{
+            m_line_numbers[pos],
+            b.m_round,
+            b.m_square,
+            b.m_curly,
+            c.n_lower_case,
+            c.n_upper_case,
+            c.n_numerals,
+            text(pos)
+        };
+    }
+
+    // line_begin is the offset of the start of the line in the source
+    void push_line_break(std::size_t line_number, std::size_t line_begin, std::size_t indent) {
+        push(TokenKind::LineBreak, line_number, line_begin, indent, {}, {});
+    }
+
+    void push_blank_line(std::size_t line_number, std::size_t line_begin) {
+        push(TokenKind::BlankLine, line_number, line_begin, 0, {}, {});
+    }
+
+    void push_environment_decleration(const EnvironmentDecleration& decleration) {
+        push(
+            TokenKind::EnvironmentDecleration,
+            decleration.m_line_number,
+            m_declarations.size(),
+            0,
+            {},
+            {});
+        m_declarations.push_back(decleration);
+    }
+
+    // data must be a view into the source
+    void push_element(
+        std::size_t line_number,
+        std::string_view data,
+        const Brackets& brackets,
+        const CharCounts& char_counts) {
+        push(
+            TokenKind::Element,
+            line_number,
+            static_cast<std::size_t>(data.data() - m_source.data()),
+            data.size(),
+            brackets,
+            char_counts);
+    }
+
+private:
+    // Write and read the columns as they are (see token_cache.hpp)
+    friend std::string save_tokens(const Tokens& tokens, std::uint64_t source_key);
+    friend std::optional<Tokens> load_tokens(
+        std::string_view data,
+        std::string_view source,
+        std::uint64_t source_key,
+        const Environments& environments,
+        std::pmr::memory_resource* resource);
+
+    void push(
+        TokenKind kind,
+        std::size_t line_number,
+        std::size_t begin,
+        std::size_t length,
+        const Brackets& brackets,
+        const CharCounts& char_counts) {
+        m_kinds.push_back(kind);
+        m_line_numbers.push_back(static_cast<std::uint32_t>(line_number));
+        m_begins.push_back(static_cast<std::uint32_t>(begin));
+        m_lengths.push_back(static_cast<std::uint32_t>(length));
+        m_brackets.push_back(brackets);
+        m_char_counts.push_back(char_counts);
+    }
+
+    std::string_view m_source;
+
+    std::pmr::vector<TokenKind> m_kinds;
+    std::pmr::vector<std::uint32_t> m_line_numbers;
+    std::pmr::vector<std::uint32_t> m_begins;
+    std::pmr::vector<std::uint32_t> m_lengths;
+    std::pmr::vector<Brackets> m_brackets;
+    std::pmr::vector<CharCounts> m_char_counts;
+
+    std::pmr::vector<EnvironmentDecleration> m_declarations;
+};
+
+} // ntx
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+
+namespace ntx {
+
+// Waits for ntx files to be saved, using inotify. Directories are watched rather
+// than the files themselves, as many editors save by writing a new file and
+// renaming it over the old one (which a watch on the file would not survive).
+//
+// A directory that was passed in is watched recursively for any .ntx file, a
+// file that was passed in is watched by name in its directory.
+class Watcher
+{
+public:
+    explicit Watcher(const std::vector<std::string>& paths) {
+        m_fd = ::inotify_init1(IN_CLOEXEC);
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::generic_category(), "inotify_init1"};
+        }
+
+        namespace fs = std::filesystem;
+        for (const auto& path : paths) {
+            std::error_code ec;
+            if (fs::is_directory(path, ec)) {
+                watch_tree(path);
+            }
+            else {
+                auto file = fs::absolute(path, ec).lexically_normal();
+                m_files.push_back(file.string());
+                watch(file.parent_path().string(), false);
+            }
+        }
+    }
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator = (const Watcher&) = delete;
+
+    ~Watcher() {
+        ::close(m_fd);
+    }
+
+    // Blocks until at least one file has been saved and then returns every file
+    // saved within settle_ms of the last, so that a burst of saves (a checkout, a
+    // save all) is handled together. Each file is returned once.
+    std::vector<std::string> wait(int settle_ms = 10) {
+        std::vector<std::string> changed;
+        int timeout = -1;
+        while (true) {
+            pollfd pfd{m_fd, POLLIN, 0};
+            int n = ::poll(&pfd, 1, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error{errno, std::generic_category(), "poll"};
+            }
+            if (n == 0) {
+                // Quiet for settle_ms
+                if (!changed.empty()) break;
+                continue;
+            }
+
+            read_events(changed);
+            timeout = settle_ms;
+        }
+
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        return changed;
+    }
+
+private:
+    void watch(const std::string& dir, bool is_tree) {
+        int wd = ::inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd < 0) {
+            throw std::system_error{errno, std::generic_category(), "Cannot watch '" + dir + "'"};
+        }
+        // The same directory may be a tree and hold a named file
+        auto& watched = m_dirs[wd];
+        watched.m_path = dir;
+        watched.m_is_tree = watched.m_is_tree || is_tree;
+    }
+
+    void watch_tree(const std::string& root) {
+        namespace fs = std::filesystem;
+        watch(fs::absolute(root).lexically_normal().string(), true);
+
+        std::error_code ec;
+        for (const auto& entry : fs::recursive_directory_iterator{root, ec}) {
+            if (entry.is_directory(ec)) {
+                watch(fs::absolute(entry.path()).lexically_normal().string(), true);
+            }
+        }
+    }
+
+    void read_events(std::vector<std::string>& changed) {
+        alignas(inotify_event) char buffer[1 << 14];
+        ssize_t n = ::read(m_fd, buffer, sizeof(buffer));
+        if (n <= 0) return;
+
+        for (char* p = buffer; p < buffer + n;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            auto it = m_dirs.find(event->wd);
+            if (it == m_dirs.end() || event->len == 0) continue;
+
+            // Copied as watching a new directory can rehash m_dirs
+            const auto dir = it->second;
+            const std::string path = (std::filesystem::path{dir.m_path} / event->name).string();
+
+            if (event->mask & IN_ISDIR) {
+                // A new directory in a tree may already have notes in it
+                if (dir.m_is_tree && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    watch_tree(path);
+                    std::error_code ec;
+                    for (const auto& entry : std::filesystem::recursive_directory_iterator{path, ec}) {
+                        if (entry.path().extension() == ".ntx") {
+                            changed.push_back(entry.path().string());
+                        }
+                    }
+                }
+                continue;
+            }
+
+            // A new file is only interesting once it has been written and closed
+            if (!(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) continue;
+
+            if (dir.m_is_tree && std::filesystem::path{path}.extension() == ".ntx") {
+                changed.push_back(path);
+            }
+            else if (std::find(m_files.begin(), m_files.end(), path) != m_files.end()) {
+                changed.push_back(path);
+            }
+        }
+    }
+
+    struct Directory
+    {
+        std::string m_path;
+        bool m_is_tree = false;
+    };
+
+    int m_fd = -1;
+    std::unordered_map<int, Directory> m_dirs;
+    std::vector<std::string> m_files;
+};
+
+} // ntx